@@ -27,6 +27,7 @@ kPerfInitValue = 1.0
 
 
 def log_reproduce(path: str, point: Point, engine: Engine):
+    engine.log_workload(point, path)
     engine.log_scripts(point, path)
     return
 
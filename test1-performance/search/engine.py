@@ -5,6 +5,7 @@
 
 # See LICENSE for license information
 
+import json
 import time
 import space
 import subprocess
@@ -57,16 +58,18 @@ class Engine(object):
             for i in range(traffic.get_process_num()):
                 # Set up server first
                 server_numa_node = server.get_numa()
-                server_cmd = "numactl -N {} -m {} {} {} {} --server --port={} --use_cuda={} --tos=105 --share_mr --gpu_id=0 2>/dev/null &".format(
-                    server_numa_node, server_numa_node,
+                server_cmd = "numactl -N {} {} {} {} --send_numa={} --recv_numa={} --server --port={} --use_cuda={} --tos=105 --share_mr --gpu_id=0 2>/dev/null &".format(
+                    server_numa_node,
                     self._binary, server.to_cmd(), traffic.to_cmd(),
+                    server_numa_node, server_numa_node,
                     self._global_port, bool(server._use_gpu))
                 self._commands[server_ip]["server"].append(server_cmd)
                 # Then, the client.
                 client_numa_node = client.get_numa()
-                client_cmd = "numactl -N {} -m {} {} {} {} --connect={} --port={} --use_cuda={} --tos=105  --share_mr --gpu_id=0 --run_infinitely 2>/dev/null &".format(
-                    client_numa_node, client_numa_node,
+                client_cmd = "numactl -N {} {} {} {} --send_numa={} --recv_numa={} --connect={} --port={} --use_cuda={} --tos=105  --share_mr --gpu_id=0 --run_infinitely 2>/dev/null &".format(
+                    client_numa_node,
                     self._binary, client.to_cmd(), traffic.to_cmd(),
+                    client_numa_node, client_numa_node,
                     server_ip, self._global_port, bool(client._use_gpu))
                 self._commands[client_ip]["client"].append(client_cmd)
                 self._global_port += 1
@@ -102,6 +105,41 @@ class Engine(object):
                 f.write("sleep 1\n")
         self.clean()
 
+    # One JSON artifact per point: hosts and flags of each traffic, instead of
+    # the request vectors spelled out on command lines. The --workload of
+    # traffic n goes to <path>.<n>.workload.json next to it, which both
+    # flag strings point to (the server takes its "receive" from there), so
+    # the file has to be at that path on both hosts. Process k of a traffic
+    # uses --port=<port + k>, as in translate(); the runner supplies the
+    # numactl binding and --send_numa/--recv_numa/--use_cuda/--gpu_id.
+    def log_workload(self, point, path: str):
+        if path.endswith(".json"):
+            path = path[:-len(".json")]
+        artifact = {"traffics": []}
+        port = 3000
+        for n, traffic in enumerate(point._traffics):
+            server = traffic.get_server()
+            client = traffic.get_client()
+            workload_path = "{}.{}.workload.json".format(path, n)
+            with open(workload_path, "w") as f:
+                json.dump(traffic.to_workload(), f, indent=2)
+            artifact["traffics"].append({
+                "server": server.get_ip(),
+                "client": client.get_ip(),
+                "process_num": traffic.get_process_num(),
+                "port": port,
+                "workload": workload_path,
+                "server_flags": "{} {} --workload={} --server --port={} --tos=105 --share_mr".format(
+                    server.to_cmd(), traffic.to_cmd(with_reqs=False),
+                    workload_path, port),
+                "client_flags": "{} {} --workload={} --connect={} --port={} --tos=105 --share_mr --run_infinitely".format(
+                    client.to_cmd(), traffic.to_cmd(with_reqs=False),
+                    workload_path, server.get_ip(), port),
+            })
+            port += traffic.get_process_num()
+        with open(path + ".json", "w") as f:
+            json.dump(artifact, f, indent=2)
+
     def save_err_scripts(self):
         ips = list(self._commands.keys())
         cmd = "mkdir -p {}/err_scripts/".format(self._scripts_path)
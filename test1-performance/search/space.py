@@ -386,7 +386,10 @@ class Traffic(object):
         req_str.rstrip(',')
         return req_str
 
-    def to_cmd(self):
+    def to_cmd(self, with_reqs=True):
+        if not with_reqs:
+            return "--qp_num={} --mtu={} --qp_type={}".format(
+                self._qp_num, self._mtu, TAG_TO_QPTYPE[self._qp_type])
         req_str = self.req_to_str(self._reqs)
         recv_str = self.req_to_str(self._recvs)
         cmd = "--qp_num={} --mtu={} --qp_type={} --request={} --receive={}".format(
@@ -394,6 +397,20 @@ class Traffic(object):
         )
         return cmd
 
+    # The traffic engine's --workload file for this traffic
+    def to_workload(self):
+        workload = {
+            "receive": self.req_to_str(self._recvs).rstrip(','),
+            "groups": [{
+                "qps": [0, self._qp_num - 1],
+                "phases": [{
+                    "sequence": self.req_to_str(self._reqs).rstrip(','),
+                    "batch": self._client._send_batch
+                }]
+            }]
+        }
+        return workload
+
     def get_numqps(self):
         if self._client._ip == self._server._ip:
             return 2 * int(self._qp_num * self._process_num)
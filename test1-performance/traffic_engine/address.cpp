@@ -0,0 +1,84 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+#include "address.hpp"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <random>
+
+namespace Collie {
+
+rdma_zipf_tables::~rdma_zipf_tables() {
+  for (auto &it : tables_) delete it.second;
+}
+
+const rdma_size_dist *rdma_zipf_tables::Get(double s, size_t pages) {
+  std::lock_guard<std::mutex> lock(lock_);
+  auto &table = tables_[{s, pages}];
+  if (table) return table;
+  // Rank r gets weight 1 / r^s. A seeded shuffle scatters the ranks,
+  // otherwise the hot set would be the first pages of the first buffer.
+  std::vector<uint32_t> order(pages);
+  std::iota(order.begin(), order.end(), 0);
+  std::shuffle(order.begin(), order.end(), std::mt19937_64(pages));
+  std::vector<double> weights(pages);
+  for (size_t r = 0; r < pages; r++)
+    weights[order[r]] = 1.0 / std::pow(r + 1, s);
+  table = new rdma_size_dist();
+  if (table->InitIndex(weights)) {
+    delete table;
+    table = nullptr;
+    tables_.erase({s, pages});
+  }
+  return table;
+}
+
+int rdma_addr_picker::Init(const std::string &spec, size_t units,
+                           uint32_t unit_size, uint64_t seed,
+                           rdma_zipf_tables *tables) {
+  double arg = 0;
+  mode_ = ParseAddrMode(spec, &arg);
+  if (mode_ < 0) {
+    LOG(ERROR) << "Bad address strategy " << spec;
+    return -1;
+  }
+  if (!units || !unit_size) {
+    LOG(ERROR) << "No buffer to pick addresses from";
+    return -1;
+  }
+  units_ = units;
+  unit_size_ = unit_size;
+  page_ = sysconf(_SC_PAGESIZE);
+  pages_per_unit_ = (unit_size + page_ - 1) / page_;
+  rand_ = SeedRand(seed);
+  unit_ = seed % units;
+  offset_ = 0;
+  switch (mode_) {
+    case kStrideAddr:
+      stride_units_ = (uint64_t)arg / unit_size % units;
+      stride_rem_ = (uint64_t)arg % unit_size;
+      break;
+    case kZipfAddr:
+      zipf_ = tables->Get(arg, units * pages_per_unit_);
+      if (!zipf_) return -1;
+      break;
+    case kPageAddr:
+      if (pages_per_unit_ < 2) {
+        LOG(ERROR) << "Buffers of " << unit_size
+                   << " bytes have no page boundary to straddle";
+        return -1;
+      }
+      break;
+  }
+  return 0;
+}
+
+}  // namespace Collie
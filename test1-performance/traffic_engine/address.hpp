@@ -0,0 +1,124 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+#ifndef RDMA_ADDRESS_HPP
+#define RDMA_ADDRESS_HPP
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include "distribution.hpp"
+#include "helper.hpp"
+
+namespace Collie {
+
+// Picks where the next SGE lands in a pool of equally sized buffers, for
+// --local_addr and --remote_addr. A pick is a buffer index and an offset
+// inside it that leaves room for the SGE:
+//
+//   seq            the next buffer, from its start (the default)
+//   random         a uniform buffer and a kAddrAlign-aligned offset
+//   stride:<b>     the buffers as one span, each pick <b> bytes after the
+//                  last one, wrapping around
+//   zipf:<s>       pages ranked by Zipf(s) popularity and scattered over
+//                  the pool, so a few hot pages take most of the traffic
+//   page           a uniform buffer, the SGE straddling a page boundary
+//
+// Random draws come from a per-endpoint seeded FastRand(), so a run is
+// reproducible. The MTT/MPT footprint is what the strategies control:
+// random and page touch many pages, zipf a hot set, seq and stride walk.
+
+// The zipf page tables, one per (s, pages of the pool). A table is as big
+// as the pool has pages, so the endpoints share it read-only: they all
+// see the same hot set and keep only their PRNG state.
+class rdma_zipf_tables {
+ private:
+  std::mutex lock_;
+  std::map<std::pair<double, size_t>, rdma_size_dist *> tables_;
+
+ public:
+  ~rdma_zipf_tables();
+  // Builds the table on first use, nullptr on failure
+  const rdma_size_dist *Get(double s, size_t pages);
+};
+
+class rdma_addr_picker {
+ private:
+  int mode_ = kSeqAddr;
+  size_t units_ = 0;
+  uint32_t unit_size_ = 0;
+  uint32_t page_ = 4096;
+  uint64_t rand_ = 1;
+  // seq and stride walk with these
+  size_t unit_ = 0;
+  uint32_t offset_ = 0;
+  size_t stride_units_ = 0;
+  uint32_t stride_rem_ = 0;
+  // zipf: over the pages of the pool
+  uint32_t pages_per_unit_ = 1;
+  const rdma_size_dist *zipf_ = nullptr;  // Shared, see rdma_zipf_tables
+
+  uint32_t Below(uint64_t n) {
+    return (uint32_t)(((FastRand(&rand_) >> 32) * n) >> 32);
+  }
+  uint32_t Fit(uint32_t offset, uint32_t length) {
+    if (length >= unit_size_) return 0;
+    return offset + length > unit_size_ ? unit_size_ - length : offset;
+  }
+
+ public:
+  // The seq cursor starts at seed % units, like the old rotation stagger.
+  // zipf takes its page table from tables.
+  int Init(const std::string &spec, size_t units, uint32_t unit_size,
+           uint64_t seed, rdma_zipf_tables *tables);
+  bool Ready() const { return units_ != 0; }
+
+  void Pick(uint32_t length, size_t *unit, uint32_t *offset) {
+    switch (mode_) {
+      case kSeqAddr:
+        *unit = unit_;
+        *offset = 0;
+        unit_ = (unit_ == units_ - 1) ? 0 : unit_ + 1;
+        return;
+      case kRandomAddr: {
+        *unit = Below(units_);
+        auto room = length < unit_size_ ? unit_size_ - length : 0;
+        *offset = Below(room / kAddrAlign + 1) * kAddrAlign;
+        return;
+      }
+      case kStrideAddr:
+        *unit = unit_;
+        *offset = Fit(offset_, length);
+        offset_ += stride_rem_;
+        unit_ += stride_units_;
+        if (offset_ >= unit_size_) {
+          offset_ -= unit_size_;
+          unit_++;
+        }
+        if (unit_ >= units_) unit_ -= units_;
+        return;
+      case kZipfAddr: {
+        auto page = zipf_->Sample(&rand_);
+        *unit = page / pages_per_unit_;
+        *offset = Fit(page % pages_per_unit_ * page_, length);
+        return;
+      }
+      default: {  // kPageAddr
+        *unit = Below(units_);
+        auto boundary = page_ * (1 + Below(pages_per_unit_ - 1));
+        *offset = Fit(boundary > length / 2 ? boundary - length / 2 : 0, length);
+        return;
+      }
+    }
+  }
+};
+
+}  // namespace Collie
+
+#endif
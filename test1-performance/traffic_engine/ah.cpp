@@ -0,0 +1,122 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+#include "ah.hpp"
+
+#include <tuple>
+
+namespace Collie {
+
+bool rdma_ah_cache::key::operator<(const key &other) const {
+  auto cmp = memcmp(dgid, other.dgid, sizeof(dgid));
+  if (cmp) return cmp < 0;
+  return std::tie(pd, dlid, sl, traffic_class, sgid_index) <
+         std::tie(other.pd, other.dlid, other.sl, other.traffic_class,
+                  other.sgid_index);
+}
+
+rdma_ah_cache::key rdma_ah_cache::MakeKey(struct ibv_pd *pd,
+                                          const struct ibv_ah_attr &attr) {
+  key k;
+  k.pd = pd;
+  memcpy(k.dgid, attr.grh.dgid.raw, sizeof(k.dgid));
+  k.dlid = attr.dlid;
+  k.sl = attr.sl;
+  k.traffic_class = attr.grh.traffic_class;
+  k.sgid_index = attr.grh.sgid_index;
+  return k;
+}
+
+rdma_ah_cache::~rdma_ah_cache() {
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    stop_ = true;
+  }
+  jobs_cv_.notify_all();
+  for (auto &t : threads_) t.join();
+  for (auto &it : ahs_)
+    if (it.second) ibv_destroy_ah(it.second);
+}
+
+void rdma_ah_cache::Start(int threads) {
+  for (int t = 0; t < threads; t++)
+    threads_.push_back(std::thread(&rdma_ah_cache::Run, this));
+}
+
+struct ibv_ah *rdma_ah_cache::Create(const key &k, struct ibv_ah_attr attr) {
+  auto start = Now64Ns();
+  auto ah = ibv_create_ah(k.pd, &attr);
+  auto ns = Now64Ns() - start;
+  if (!ah) PLOG(ERROR) << "ibv_create_ah() failed";
+  std::lock_guard<std::mutex> lock(lock_);
+  if (ah) {
+    ahs_[k] = ah;
+    created_++;
+    create_ns_ += ns;
+  } else {
+    // Whoever waits for it tries again
+    ahs_.erase(k);
+  }
+  created_cv_.notify_all();
+  return ah;
+}
+
+void rdma_ah_cache::Run() {
+  std::unique_lock<std::mutex> lock(lock_);
+  while (true) {
+    jobs_cv_.wait(lock, [this]() { return stop_ || !jobs_.empty(); });
+    if (stop_) return;
+    auto j = jobs_.front();
+    jobs_.pop_front();
+    lock.unlock();
+    Create(j.k, j.attr);
+    lock.lock();
+  }
+}
+
+void rdma_ah_cache::Prefetch(struct ibv_pd *pd,
+                             const std::vector<struct ibv_ah_attr> &attrs) {
+  if (threads_.empty()) return;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    for (auto &attr : attrs) {
+      auto k = MakeKey(pd, attr);
+      // Claim it, so neither a later Prefetch() nor Get() creates it again
+      if (!ahs_.emplace(k, nullptr).second) continue;
+      jobs_.push_back({k, attr});
+    }
+  }
+  jobs_cv_.notify_all();
+}
+
+struct ibv_ah *rdma_ah_cache::Get(struct ibv_pd *pd,
+                                  const struct ibv_ah_attr &attr) {
+  auto k = MakeKey(pd, attr);
+  {
+    std::unique_lock<std::mutex> lock(lock_);
+    lookups_++;
+    while (true) {
+      auto it = ahs_.find(k);
+      if (it == ahs_.end()) break;
+      if (it->second) return it->second;
+      created_cv_.wait(lock);
+    }
+    ahs_.emplace(k, nullptr);
+  }
+  return Create(k, attr);
+}
+
+void rdma_ah_cache::PrintStats() {
+  std::lock_guard<std::mutex> lock(lock_);
+  LOG(INFO) << "AH cache: " << created_ << " AHs for " << lookups_
+            << " endpoint lookups, "
+            << (created_ ? create_ns_ / 1000.0 / created_ : 0)
+            << " us per ibv_create_ah() on " << threads_.size()
+            << " helper threads";
+}
+
+}  // namespace Collie
@@ -0,0 +1,78 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+#ifndef RDMA_AH_HPP
+#define RDMA_AH_HPP
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "helper.hpp"
+
+namespace Collie {
+
+// UD endpoints reach their peer through an address handle, and
+// ibv_create_ah() may block (on RoCE the kernel resolves the destination
+// MAC). The cache shares one AH among all endpoints to a destination, and
+// Prefetch() hands the ones a batch of endpoints is about to need to a few
+// helper threads, so they are created in parallel while the handshake goes
+// on. Get() waits for an AH that is still being created.
+class rdma_ah_cache {
+ public:
+  struct key {
+    struct ibv_pd *pd;  // Without --share_pd, every endpoint has its own
+    uint8_t dgid[16];
+    uint16_t dlid;
+    uint8_t sl;
+    uint8_t traffic_class;
+    uint8_t sgid_index;
+    bool operator<(const key &other) const;
+  };
+
+ private:
+  struct job {
+    key k;
+    struct ibv_ah_attr attr;
+  };
+  std::mutex lock_;
+  std::condition_variable created_cv_;
+  std::condition_variable jobs_cv_;
+  // nullptr while the AH is being created
+  std::map<key, struct ibv_ah *> ahs_;
+  std::deque<job> jobs_;
+  std::vector<std::thread> threads_;
+  bool stop_ = false;
+
+  // Statistics, under lock_
+  uint64_t lookups_ = 0;
+  uint64_t created_ = 0;
+  uint64_t create_ns_ = 0;
+
+  static key MakeKey(struct ibv_pd *pd, const struct ibv_ah_attr &attr);
+  // Creates the AH of a key the caller has claimed, and publishes it
+  struct ibv_ah *Create(const key &k, struct ibv_ah_attr attr);
+  void Run();
+
+ public:
+  ~rdma_ah_cache();
+  // 0 threads creates every AH inline, in Get()
+  void Start(int threads);
+  // Queues the AHs that are not cached yet
+  void Prefetch(struct ibv_pd *pd,
+                const std::vector<struct ibv_ah_attr> &attrs);
+  // The shared AH of the destination, nullptr on failure
+  struct ibv_ah *Get(struct ibv_pd *pd, const struct ibv_ah_attr &attr);
+  void PrintStats();
+};
+
+}  // namespace Collie
+
+#endif
@@ -7,15 +7,29 @@
 
 #include "context.hpp"
 
+#include <fcntl.h>
 #include <malloc.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
 #include <thread>
 
 namespace Collie {
 
 std::vector<rdma_request> rdma_context::ParseRecvFromStr() {
-  std::stringstream ss(FLAGS_receive);
+  if (workload_ && !workload_->GetReceive().empty())
+    return ParseRecvFromStr(workload_->GetReceive());
+  return ParseRecvFromStr(FLAGS_receive);
+}
+
+std::vector<rdma_request> rdma_context::ParseRecvFromStr(
+    const std::string &str) {
+  std::stringstream ss(str);
   char c;
   int size;
   int sge_num;
@@ -33,12 +47,18 @@ std::vector<rdma_request> rdma_context::ParseRecvFromStr() {
     }
     req.sge_num = sge_num;
     requests.push_back(req);
+    if (ss.peek() == ',') ss.ignore();
   }
   return requests;
 }
 
 std::vector<rdma_request> rdma_context::ParseReqFromStr() {
-  std::stringstream ss(FLAGS_request);
+  return ParseReqFromStr(FLAGS_request);
+}
+
+std::vector<rdma_request> rdma_context::ParseReqFromStr(
+    const std::string &str) {
+  std::stringstream ss(str);
   char op;
   char c;
   int size;
@@ -57,7 +77,9 @@ std::vector<rdma_request> rdma_context::ParseReqFromStr() {
     switch (op) {
       case 'w':
         req.opcode = IBV_WR_RDMA_WRITE;
-        if (FLAGS_imm_data) req.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+        // The server can only answer a WRITE it gets notified of
+        if (FLAGS_imm_data || FLAGS_latency)
+          req.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
         break;
       case 'r':
         req.opcode = IBV_WR_RDMA_READ;
@@ -85,6 +107,37 @@ std::vector<rdma_request> rdma_context::ParseReqFromStr() {
   return requests;
 }
 
+int rdma_context::CheckRemoteBuffers(const std::vector<rdma_buffer *> &buffers,
+                                     const std::string &server) {
+  if (rdma_bytes_ < 0) {
+    std::vector<std::vector<rdma_request>> vectors;
+    if (FLAGS_trace_replay == "") vectors.push_back(ParseReqFromStr());
+    if (workload_)
+      for (auto &group : workload_->GetGroups())
+        for (auto &phase : group.phases) vectors.push_back(phase.requests);
+    rdma_bytes_ = 0;
+    for (auto &requests : vectors) {
+      for (auto &req : requests) {
+        if (req.opcode == IBV_WR_SEND) continue;
+        int64_t bytes = 0;
+        for (auto &sge : req.sglist) bytes += sge.length;
+        if (size_dist_) bytes = (int64_t)req.sge_num * size_dist_->GetMax();
+        rdma_bytes_ = std::max(rdma_bytes_, bytes);
+      }
+    }
+  }
+  if (buffers.empty()) return 0;
+  uint32_t size = buffers[0]->size_;
+  for (auto buf : buffers) size = std::min(size, buf->size_);
+  if (rdma_bytes_ > size) {
+    LOG(ERROR) << "The largest WRITE/READ is " << rdma_bytes_ << " bytes, but "
+               << server << " advertises " << size
+               << "-byte buffers; start it with --buf_size=" << rdma_bytes_;
+    return -1;
+  }
+  return 0;
+}
+
 std::string rdma_context::GidToIP(const union ibv_gid &gid) {
   std::string ip =
       std::to_string(gid.raw[12]) + "." + std::to_string(gid.raw[13]) + "." +
@@ -93,6 +146,7 @@ std::string rdma_context::GidToIP(const union ibv_gid &gid) {
 }
 
 int rdma_context::Init() {
+  lap_ts_ = Now64();
 #ifdef GDR
   if (InitCuda() < 0) {
     LOG(ERROR) << "InitCuda() failed";
@@ -103,14 +157,31 @@ int rdma_context::Init() {
     LOG(ERROR) << "InitDevice() failed";
     return -1;
   }
+  Lap("device");
   if (InitMemory() < 0) {
     LOG(ERROR) << "InitMemory() failed";
     return -1;
   }
+  if (FLAGS_workload != "" && InitWorkload() < 0) {
+    LOG(ERROR) << "InitWorkload() failed";
+    return -1;
+  }
+  if (FLAGS_srq && InitSrqs() < 0) {
+    LOG(ERROR) << "InitSrqs() failed";
+    return -1;
+  }
+  if (FLAGS_srq) Lap("srq");
   if (InitTransport() < 0) {
     LOG(ERROR) << "InitTransport() failed";
     return -1;
   }
+  Lap("qp");
+  if (FLAGS_qp_type == IBV_QPT_UD) ah_cache_.Start(FLAGS_ah_threads);
+  if (InitWorkers() < 0) {
+    LOG(ERROR) << "InitWorkers() failed";
+    return -1;
+  }
+  PrintStartup();
   return 0;
 }
 
@@ -140,6 +211,51 @@ int rdma_context::InitDevice() {
     PLOG(ERROR) << "ibv_open_device() failed";
     return -1;
   }
+  if (FLAGS_odp) {
+    struct ibv_device_attr_ex device_attrx;
+    if (ibv_query_device_ex(ctx_, nullptr, &device_attrx)) {
+      PLOG(ERROR) << "ibv_query_device_ex() failed";
+      return -1;
+    }
+    if (!(device_attrx.odp_caps.general_caps & IBV_ODP_SUPPORT)) {
+      LOG(ERROR) << "This device does not support on-demand paging";
+      return -1;
+    }
+    // The operations each transport may run on ODP memory. Without them
+    // the WRs would fail on page faults at runtime instead.
+    auto &caps = device_attrx.odp_caps.per_transport_caps;
+    uint32_t have = caps.rc_odp_caps;
+    uint32_t need = IBV_ODP_SUPPORT_SEND | IBV_ODP_SUPPORT_RECV |
+                    IBV_ODP_SUPPORT_WRITE | IBV_ODP_SUPPORT_READ;
+    if (FLAGS_qp_type == IBV_QPT_UC) {
+      have = caps.uc_odp_caps;
+      need &= ~IBV_ODP_SUPPORT_READ;
+    } else if (FLAGS_qp_type == IBV_QPT_UD) {
+      have = caps.ud_odp_caps;
+      need = IBV_ODP_SUPPORT_SEND | IBV_ODP_SUPPORT_RECV;
+    }
+    if ((have & need) != need) {
+      LOG(ERROR) << "This device does not support on-demand paging for "
+                 << (FLAGS_qp_type == IBV_QPT_RC
+                         ? "RC SEND/RECV/WRITE/READ"
+                         : FLAGS_qp_type == IBV_QPT_UC ? "UC SEND/RECV/WRITE"
+                                                       : "UD SEND/RECV")
+                 << " (caps 0x" << std::hex << have << std::dec << ")";
+      return -1;
+    }
+  }
+  if (FLAGS_mw_window) {
+    struct ibv_device_attr device_attr;
+    if (ibv_query_device(ctx_, &device_attr)) {
+      PLOG(ERROR) << "ibv_query_device() failed";
+      return -1;
+    }
+    if (!(device_attr.device_cap_flags & (IBV_DEVICE_MEM_WINDOW_TYPE_2A |
+                                          IBV_DEVICE_MEM_WINDOW_TYPE_2B))) {
+      LOG(ERROR) << "This device does not support type 2 memory windows";
+      return -1;
+    }
+  }
   if (FLAGS_hw_ts) {
     struct ibv_device_attr_ex device_attrx;
     if (ibv_query_device_ex(ctx_, nullptr, &device_attrx)) {
@@ -183,6 +299,10 @@ int rdma_context::InitIds() {
   for (int i = 0; i < num_of_qps; i++) {
     ids_.push(i);
   }
+  num_of_workers_ = FLAGS_threads;
+  if (num_of_workers_ <= 0)
+    num_of_workers_ = std::thread::hardware_concurrency();
+  num_of_workers_ = std::max(1, std::min(num_of_workers_, num_of_qps));
   return num_of_qps;
 }
 
@@ -243,40 +363,90 @@ int rdma_context::InitMemory() {
     }
     pds_.push_back(pd);
   }
+  Lap("pd");
 
   auto buf_size = FLAGS_buf_size;
+  if (FLAGS_size_dist != "") {
+    size_dist_ = new rdma_size_dist();
+    if (size_dist_->Init(FLAGS_size_dist)) return -1;
+    // Every buffer has to fit the largest size we may draw
+    if (size_dist_->GetMax() > (uint32_t)buf_size) {
+      LOG(INFO) << "Grow buffers from " << buf_size << " to "
+                << size_dist_->GetMax() << " bytes for --size_dist";
+      buf_size = size_dist_->GetMax();
+    }
+    LOG(INFO) << "Size distribution " << FLAGS_size_dist << ": mean "
+              << size_dist_->GetMean() << ", max " << size_dist_->GetMax();
+  }
+  if (FLAGS_trace_replay != "") {
+    if (InitTraces()) return -1;
+    for (auto trace : traces_) {
+      if (trace->GetMaxLength() > (uint32_t)buf_size) {
+        LOG(INFO) << "Grow buffers from " << buf_size << " to "
+                  << trace->GetMaxLength() << " bytes for --trace_replay";
+        buf_size = trace->GetMaxLength();
+      }
+    }
+  }
   // Allocate Memory and Register them
   if ((enum ibv_qp_type)FLAGS_qp_type == IBV_QPT_UD) {
     buf_size += kUdAddition;
   }
+  buf_size_ = buf_size;
+  auto nic_numa = ReadNicNuma();
+  int numa[2] = {FLAGS_send_numa, FLAGS_recv_numa};
+  for (auto &node : numa) {
+    if (node == -1) node = nic_numa;  // Unknown NIC node: no binding
+    if (node < -1) node = -1;
+  }
+  // Send and receive regions interleaved, in the order they used to be
+  // allocated one by one
+  std::vector<rdma_region *> regions;
   for (int i = 0; i < FLAGS_mr_num; i++) {
-    auto region =
-        new rdma_region(GetPd(i), buf_size, FLAGS_buf_num, FLAGS_memalign, 0);
-    if (region->Mallocate()) {
-      LOG(ERROR) << "Region Memory allocation failed";
-      break;
+    for (int idx = 0; idx < 2; idx++) {
+      regions.push_back(new rdma_region(GetPd(i), buf_size, FLAGS_buf_num,
+                                        FLAGS_memalign, numa[idx]));
     }
-    local_mempool_[0].push_back(region);
-    region =
-        new rdma_region(GetPd(i), buf_size, FLAGS_buf_num, FLAGS_memalign, 0);
-    if (region->Mallocate()) {
-      LOG(ERROR) << "Region Memory allocation failed";
-      break;
+  }
+  auto allocated = AllocateRegions(regions);
+  for (size_t k = 0; k < allocated; k++)
+    local_mempool_[k % 2].push_back(regions[k]);
+  if (allocated < regions.size())
+    LOG(ERROR) << "Region Memory allocation failed";
+  Lap("mr");
+  InitRotation(0);
+  InitRotation(1);
+  if (FLAGS_odp) {
+    page_map_ = new rdma_page_map();
+    page_map_->Init(local_mempool_[0]);
+  }
+  ReportMemory(nic_numa);
+
+  // One completion channel per worker, when workers may sleep
+  if (ParsePollMode(FLAGS_poll_mode) != kBusyPoll) {
+    for (int i = 0; i < num_of_workers_; i++) {
+      auto channel = ibv_create_comp_channel(ctx_);
+      if (!channel) {
+        PLOG(ERROR) << "ibv_create_comp_channel() failed";
+        return -1;
+      }
+      channels_.push_back(channel);
     }
-    local_mempool_[1].push_back(region);
   }
 
   // Allocate Send/Recv Completion Queue
-  auto cqn = share_cq_ ? 1 : num_of_hosts_ * num_per_host_;
+  auto cqn = share_cq_ ? num_of_workers_ : num_of_hosts_ * num_per_host_;
   for (int i = 0; i < cqn; i++) {
     union collie_cq send_cq;
     union collie_cq recv_cq;
+    struct ibv_comp_channel *channel = nullptr;
+    if (!channels_.empty()) channel = channels_[share_cq_ ? i : WorkerOf(i)];
     if (FLAGS_hw_ts) {
       struct ibv_cq_init_attr_ex send_attr_ex, recv_attr_ex;
       memset(&send_attr_ex, 0, sizeof(ibv_cq_init_attr_ex));
       memset(&recv_attr_ex, 0, sizeof(ibv_cq_init_attr_ex));
       send_attr_ex.cqe = recv_attr_ex.cqe = FLAGS_cq_depth / cqn;
-      send_attr_ex.channel = recv_attr_ex.channel = nullptr;
+      send_attr_ex.channel = recv_attr_ex.channel = channel;
       send_attr_ex.cq_context = recv_attr_ex.cq_context = nullptr;
       send_attr_ex.comp_vector = recv_attr_ex.comp_vector = 0;
       send_attr_ex.wc_flags = recv_attr_ex.wc_flags =
@@ -294,13 +464,13 @@ int rdma_context::InitMemory() {
       }
     } else {
       send_cq.cq =
-          ibv_create_cq(ctx_, FLAGS_cq_depth / cqn, nullptr, nullptr, 0);
+          ibv_create_cq(ctx_, FLAGS_cq_depth / cqn, nullptr, channel, 0);
       if (!send_cq.cq) {
         PLOG(ERROR) << "ibv_create_cq() failed";
         return -1;
       }
       recv_cq.cq =
-          ibv_create_cq(ctx_, FLAGS_cq_depth / cqn, nullptr, nullptr, 0);
+          ibv_create_cq(ctx_, FLAGS_cq_depth / cqn, nullptr, channel, 0);
       if (!recv_cq.cq) {
         PLOG(ERROR) << "ibv_create_cq() failed";
         return -1;
@@ -309,6 +479,142 @@ int rdma_context::InitMemory() {
     send_cqs_.push_back(send_cq);
     recv_cqs_.push_back(recv_cq);
   }
+  Lap("cq");
+  return 0;
+}
+
+size_t rdma_context::AllocateRegions(
+    const std::vector<rdma_region *> &regions) {
+  // ibv_reg_mr() pins and maps the whole buffer, so registration time grows
+  // with the pool. The calls are independent: spread them over threads.
+  size_t threads = FLAGS_reg_threads;
+  if (FLAGS_reg_threads <= 0) threads = std::thread::hardware_concurrency();
+#ifdef GDR
+  // The CUDA context is only current on this thread
+  if (FLAGS_use_cuda) threads = 1;
+#endif
+  threads = std::max<size_t>(1, std::min(threads, regions.size()));
+  std::vector<int> ret(regions.size(), -1);  // -1 until tried
+  std::atomic<size_t> next(0);
+  std::atomic<bool> failed(false);
+  auto work = [&]() {
+    // Stop handing out regions after a failure, as the serial loop did
+    for (auto k = next++; k < regions.size() && !failed; k = next++) {
+      ret[k] = regions[k]->Mallocate();
+      if (ret[k]) failed = true;
+    }
+  };
+  std::vector<std::thread> pool;
+  for (size_t t = 1; t < threads; t++) pool.push_back(std::thread(work));
+  work();
+  for (auto &t : pool) t.join();
+  // Keep the regions before the first failure. Those other threads got
+  // through behind it would stay pinned: give them back.
+  size_t k = 0;
+  while (k < regions.size() && !ret[k]) k++;
+  for (auto j = k; j < regions.size(); j++) {
+    if (!ret[j]) regions[j]->Free();
+    delete regions[j];
+  }
+  return k;
+}
+
+void rdma_context::Lap(const char *phase) {
+  auto now = Now64();
+  laps_.push_back({phase, now - lap_ts_});
+  lap_ts_ = now;
+}
+
+void rdma_context::PrintStartup() {
+  std::stringstream ss;
+  uint64_t total = 0;
+  ss << std::fixed << std::setprecision(1);
+  for (auto &lap : laps_) {
+    ss << lap.first << " " << lap.second / 1000.0 << ", ";
+    total += lap.second;
+  }
+  ss << "total " << total / 1000.0;
+  LOG(INFO) << "Startup (ms): " << ss.str();
+}
+
+int rdma_context::ReadNicNuma() {
+  std::string path = "/sys/class/infiniband/" +
+                     std::string(ibv_get_device_name(ctx_->device)) +
+                     "/device/numa_node";
+  std::ifstream file(path);
+  int node = -1;
+  if (!(file >> node)) LOG(WARNING) << "Cannot read " << path;
+  return node;
+}
+
+void rdma_context::ReportMemory(int nic_numa) {
+  const char *pools[2] = {"send", "receive"};
+  for (int idx = 0; idx < 2; idx++) {
+    size_t remote = 0, unknown = 0, pages = 0, max_pages = 0, page_size = 0;
+    for (auto region : local_mempool_[idx]) {
+      auto node = region->GetNode();
+      if (node < 0)
+        unknown++;
+      else if (nic_numa >= 0 && node != nic_numa)
+        remote++;
+      pages += region->GetPages();
+      max_pages = std::max(max_pages, region->GetPages());
+      page_size = region->GetPageSize();
+    }
+    auto total = local_mempool_[idx].size();
+    if (pages)
+      LOG(INFO) << "Each " << pools[idx] << " MR pins up to " << max_pages
+                << " pages of " << page_size / 1024 << " KiB, " << pages
+                << " in " << total << " MRs";
+    if (remote)
+      LOG(WARNING) << remote << "/" << total << " " << pools[idx]
+                   << " MRs are remote from " << devname_ << " on node "
+                   << nic_numa;
+    else if (nic_numa >= 0 && unknown < total)
+      LOG(INFO) << "All " << pools[idx] << " MRs with a known node are local "
+                << "to " << devname_ << " on node " << nic_numa;
+  }
+}
+
+void rdma_context::InitRotation(int idx) {
+  // Round-robin over MRs, FIFO inside each MR: one full period of that
+  // walk visits every buffer of the pool exactly once.
+  auto &pool = local_mempool_[idx];
+  std::vector<size_t> cursor(pool.size(), 0);
+  size_t period = 0;
+  for (auto region : pool) period += region->GetBufferNum();
+  rotation_[idx].clear();
+  for (size_t k = 0; k < period; k++) {
+    auto r = k % pool.size();
+    auto buf = pool[r]->GetBuffer(cursor[r]);
+    cursor[r] = (cursor[r] + 1) % pool[r]->GetBufferNum();
+    rotation_[idx].push_back({buf->addr_, buf->local_K_});
+  }
+}
+
+int rdma_context::InitSrqs() {
+  auto reqs = ParseRecvFromStr();
+  auto num_of_srqs = num_of_workers_ * FLAGS_srq_num;
+  for (int i = 0; i < num_of_srqs; i++) {
+    auto srq = new rdma_srq(i, FLAGS_recv_wq_depth, FLAGS_srq_limit,
+                            &rotation_[1]);
+    if (srq->Create(GetPd(0))) {
+      delete srq;
+      return -1;
+    }
+    // Fill it up before any QP is attached
+    if (srq->Refill(reqs, std::max(FLAGS_recv_batch, 1), true)) {
+      LOG(ERROR) << "Post the first batch to SRQ " << i << " failed";
+      return -1;
+    }
+    srqs_.push_back(srq);
+  }
+  LOG(INFO) << num_of_srqs << " SRQs hold "
+            << (int64_t)num_of_srqs * FLAGS_recv_wq_depth
+            << " receive WQEs for " << num_of_hosts_ * num_per_host_
+            << " QPs (" << (int64_t)num_of_hosts_ * num_per_host_ *
+                               FLAGS_recv_wq_depth
+            << " without SRQ)";
   return 0;
 }
 
@@ -321,7 +627,14 @@ int rdma_context::InitTransport() {
     if (endpoints_[id]) delete endpoints_[id];
     struct ibv_qp_init_attr qp_init_attr = MakeQpInitAttr(
         GetSendCq(id), GetRecvCq(id), FLAGS_send_wq_depth, FLAGS_recv_wq_depth);
-    auto qp = ibv_create_qp(GetPd(id), &qp_init_attr);
+    if (FLAGS_srq) qp_init_attr.srq = srqs_[SrqIndex(id)]->GetSrq();
+    struct ibv_qp *qp = nullptr;
+    if (FLAGS_qp_ex) {
+      auto qp_init_attr_ex = MakeQpInitAttrEx(qp_init_attr, GetPd(id));
+      qp = ibv_create_qp_ex(ctx_, &qp_init_attr_ex);
+    } else {
+      qp = ibv_create_qp(GetPd(id), &qp_init_attr);
+    }
     if (!qp) {
       PLOG(ERROR) << "ibv_create_qp() failed";
       delete ep;
@@ -329,11 +642,56 @@ int rdma_context::InitTransport() {
     }
     ep = new rdma_endpoint(id, qp);
     ep->SetMaster(this);
+    // Receives are posted to the SRQ, never to the QP itself
+    if (FLAGS_srq) ep->SetRecvCredits(0);
     endpoints_[id] = ep;
   }
   return 0;
 }
 
+int rdma_context::InitWorkload() {
+  workload_ = new rdma_workload();
+  return workload_->Load(FLAGS_workload, [this](const std::string &str) {
+    return ParseReqFromStr(str);
+  });
+}
+
+int rdma_context::InitTraces() {
+  // Loaded before the memory, so the buffers fit the largest recorded SGE
+  for (int i = 0; i < num_of_workers_; i++) {
+    auto trace = new rdma_trace_reader();
+    if (trace->Open(FLAGS_trace_replay + "." + std::to_string(i))) return -1;
+    traces_.push_back(trace);
+  }
+  return 0;
+}
+
+int rdma_context::InitWorkers() {
+  for (int i = 0; i < num_of_workers_; i++) {
+    workers_.push_back(new rdma_worker(i, this));
+  }
+  for (size_t id = 0; id < endpoints_.size(); id++) {
+    auto cq = CqIndex(id);
+    workers_[WorkerOf(id)]->AddEndpoint(endpoints_[id], send_cqs_[cq],
+                                        recv_cqs_[cq]);
+  }
+  for (size_t i = 0; i < srqs_.size(); i++) {
+    workers_[i / FLAGS_srq_num]->AddSrq(srqs_[i]);
+  }
+  for (size_t i = 0; i < channels_.size(); i++) {
+    workers_[i]->SetChannel(channels_[i]);
+  }
+  if (workload_) {
+    for (size_t id = 0; id < endpoints_.size(); id++)
+      endpoints_[id]->SetGroup(workload_->GroupOf(id));
+    for (auto w : workers_) w->SetWorkload(workload_);
+  }
+  for (size_t i = 0; i < traces_.size(); i++) workers_[i]->SetTrace(traces_[i]);
+  LOG(INFO) << endpoints_.size() << " endpoints on " << num_of_workers_
+            << " datapath threads";
+  return 0;
+}
+
 int rdma_context::Listen() {
   struct addrinfo *res, *t;
   struct addrinfo hints;
@@ -343,15 +701,16 @@ int rdma_context::Listen() {
   hints.ai_socktype = SOCK_STREAM;
   char *service;
   int sockfd = -1, err, n;
-  int *connfd;
   if (asprintf(&service, "%d", port_) < 0) return -1;
-  if (getaddrinfo(nullptr, service, &hints, &res)) {
+  n = getaddrinfo(nullptr, service, &hints, &res);
+  if (n) {
     LOG(ERROR) << gai_strerror(n) << " for port " << port_;
     free(service);
     return -1;
   }
   for (t = res; t; t = t->ai_next) {
-    sockfd = socket(t->ai_family, t->ai_socktype, t->ai_protocol);
+    sockfd = socket(t->ai_family, t->ai_socktype | SOCK_NONBLOCK,
+                    t->ai_protocol);
     if (sockfd >= 0) {
       n = 1;
       setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &n, sizeof(n));
@@ -372,22 +731,99 @@ int rdma_context::Listen() {
     PLOG(ERROR) << "listen() failed";
     return -1;
   }
+  int epfd = epoll_create1(0);
+  if (epfd < 0) {
+    PLOG(ERROR) << "epoll_create1() failed";
+    return -1;
+  }
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = nullptr;  // The listening socket
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev)) {
+    PLOG(ERROR) << "epoll_ctl() failed";
+    return -1;
+  }
+  // QP bring-up (Activate() and the first receives) would serialize all
+  // clients behind the acceptor: it runs on a small pool instead, which
+  // hands the connections back through an eventfd
+  accept_wake_ = eventfd(0, EFD_NONBLOCK);
+  if (accept_wake_ < 0) {
+    PLOG(ERROR) << "eventfd() failed";
+    return -1;
+  }
+  auto wake_tag = (void *)&accept_wake_;
+  ev.data.ptr = wake_tag;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, accept_wake_, &ev)) {
+    PLOG(ERROR) << "epoll_ctl() failed";
+    return -1;
+  }
+  for (int t = 0; t < kActivateThreads; t++)
+    std::thread(&rdma_context::ActivateAccepted, this).detach();
+  auto step = [&](rdma_accept *conn) {
+    auto ret = StepAccept(conn);
+    if (ret == 2) {
+      {
+        std::lock_guard<std::mutex> lock(accept_lock_);
+        to_activate_.push_back(conn);
+      }
+      accept_cv_.notify_one();
+    } else if (ret <= 0) {
+      // Done or failed: the epoll entry goes with the socket
+      close(conn->fd);
+      delete conn;
+    }
+  };
   LOG(INFO) << "Server listen thread starts";
+  // One thread accepts and runs every handshake as a state machine. The
+  // kernel backlog is the backpressure when many clients start at once.
+  struct epoll_event events[kCqPollDepth];
   while (true) {
-    connfd = (int *)malloc(sizeof(int));
-    *connfd = accept(sockfd, nullptr, 0);
-    if (*connfd < 0) {
-      PLOG(ERROR) << "Accept Error";
+    n = epoll_wait(epfd, events, kCqPollDepth, -1);
+    if (n < 0 && errno != EINTR) {
+      PLOG(ERROR) << "epoll_wait() failed";
       break;
     }
-    // [TODO] connection handler
-    std::thread handler =
-        std::thread(&rdma_context::AcceptHandler, this, *connfd);
-    handler.detach();
-    free(connfd);
+    for (int i = 0; i < n; i++) {
+      auto conn = (rdma_accept *)events[i].data.ptr;
+      if (conn == wake_tag) {
+        uint64_t count;
+        if (read(accept_wake_, &count, sizeof(count)) < 0 && errno != EAGAIN)
+          PLOG(ERROR) << "read() from the activation pool failed";
+        std::deque<rdma_accept *> back;
+        {
+          std::lock_guard<std::mutex> lock(accept_lock_);
+          back.swap(activated_);
+        }
+        for (auto c : back) step(c);
+        continue;
+      }
+      if (conn) {
+        step(conn);
+        continue;
+      }
+      while (true) {
+        int connfd = accept4(sockfd, nullptr, 0, SOCK_NONBLOCK);
+        if (connfd < 0) {
+          if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            PLOG(ERROR) << "Accept Error";
+          break;
+        }
+        conn = new rdma_accept();
+        conn->fd = connfd;
+        conn->epfd = epfd;
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, connfd, &ev)) {
+          PLOG(ERROR) << "epoll_ctl() failed";
+          close(connfd);
+          delete conn;
+        }
+      }
+    }
   }
   // The loop shall never end.
-  free(connfd);
+  close(epfd);
   close(sockfd);
   return -1;
 }
@@ -424,6 +860,16 @@ void rdma_context::GetEndpointInfo(rdma_endpoint *endpoint,
   }
 }
 
+struct ibv_mr *rdma_context::FindMr(int idx, uint64_t addr) {
+  for (auto region : local_mempool_[idx]) {
+    auto mr = region->GetMr();
+    if (mr && addr >= (uint64_t)mr->addr &&
+        addr < (uint64_t)mr->addr + mr->length)
+      return mr;
+  }
+  return nullptr;
+}
+
 rdma_buffer *rdma_context::CreateBufferFromInfo(struct connect_info *info) {
   uint64_t remote_addr = (info->info.memory.remote_addr);
   uint32_t rkey = (info->info.memory.remote_K);
@@ -440,542 +886,1091 @@ void rdma_context::SetInfoByBuffer(struct connect_info *info,
   return;
 }
 
-int rdma_context::AcceptHandler(int connfd) {
-  int n, number_of_qp, number_of_mem, left, right;
-  char *conn_buf = (char *)malloc(sizeof(connect_info));
-  connect_info *info = (connect_info *)conn_buf;
-  union ibv_gid gid;
+int rdma_context::ServeHello(rdma_accept *conn,
+                             std::vector<connect_info> &hello) {
+  std::vector<connect_info> reply;
+  connect_info info;
   std::vector<rdma_buffer *> buffers;
-  auto reqs = ParseRecvFromStr();
-  int rbuf_id = -1;
-  if (!conn_buf) {
-    LOG(ERROR) << "Malloc for exchange buffer failed";
-    return -1;
-  }
-  n = read(connfd, conn_buf, sizeof(connect_info));
-  if (n != sizeof(connect_info)) {
-    PLOG(ERROR) << "Server Read";
-    LOG(ERROR) << n << "/" << (int)sizeof(connect_info)
-               << ": Couldn't read remote address";
-    goto out;
-  }
-  if ((info->type) != kHostInfoKey) {
-    LOG(ERROR) << "The first exchange type should be " << kHostInfoKey;
-    goto out;
-  }
-  number_of_qp = (info->info.host.number_of_qp);
-  number_of_mem = (info->info.host.number_of_mem);
-  if (number_of_qp <= 0) {
-    LOG(ERROR) << "The number of qp should be positive";
-    goto out;
-  }
-  numlock_.lock();
-  if (num_of_recv_ + number_of_qp > num_per_host_ * num_of_hosts_) {
-    LOG(ERROR) << "QP Overflow, request rejected";
-    numlock_.unlock();
-    memset(info, 0, sizeof(connect_info));
-    if (write(connfd, conn_buf, sizeof(connect_info)) != sizeof(connect_info))
-      PLOG(ERROR) << "Write Error";
-    goto out;
-  }
-  left = num_of_recv_;
-  num_of_recv_ += number_of_qp;
-  numlock_.unlock();
-  right = left + number_of_qp;
+  if (hello.empty() || hello[0].type != kHostInfoKey) {
+    LOG(ERROR) << "The hello should start with the host info";
+    return -1;
+  }
+  int number_of_qp = hello[0].info.host.number_of_qp;
+  int number_of_mem = hello[0].info.host.number_of_mem;
+  if (number_of_qp <= 0 || number_of_mem < 0 ||
+      hello.size() != (size_t)(1 + number_of_mem + number_of_qp)) {
+    LOG(ERROR) << "Bad hello: " << hello.size() << " records for "
+               << number_of_mem << " buffers and " << number_of_qp << " QPs";
+    return -1;
+  }
+  int left = ReserveEndpoints(number_of_qp);
+  if (left < 0) {
+    conn->out = PackHandshake(kRejectMsg, reply);
+    return 0;
+  }
+  conn->left = left;
+  conn->right = left + number_of_qp;
   // Copy the remote gid.
-  memcpy(&gid, &info->info.host.gid, sizeof(union ibv_gid));
+  memcpy(&conn->gid, &hello[0].info.host.gid, sizeof(union ibv_gid));
 
-  // Put local info to connect_info and send
-  memset(info, 0, sizeof(connect_info));
-  info->type = (kHostInfoKey);
-  memcpy(&info->info.host.gid, &local_gid_, sizeof(union ibv_gid));
-  info->info.host.number_of_qp = (number_of_qp);
-  if (write(connfd, conn_buf, sizeof(connect_info)) != sizeof(connect_info)) {
-    LOG(ERROR) << "Couldn't send local address";
-    goto out;
-  }
+  memset(&info, 0, sizeof(connect_info));
+  info.type = kHostInfoKey;
+  memcpy(&info.info.host.gid, &local_gid_, sizeof(union ibv_gid));
+  info.info.host.number_of_qp = number_of_qp;
+  info.info.host.number_of_mem = number_of_mem;
+  reply.push_back(info);
 
-  // Get the memory info from remote
+  // One of our buffers for each of theirs
   for (int i = 0; i < number_of_mem; i++) {
-    n = read(connfd, conn_buf, sizeof(connect_info));
-    if (n != sizeof(connect_info)) {
-      PLOG(ERROR) << "Server read";
-      LOG(ERROR) << n << "/" << (int)sizeof(connect_info) << ": Read " << i
-                 << " mem's info failed";
-      goto out;
-    }
-    if ((info->type) != kMemInfoKey) {
+    if (hello[1 + i].type != kMemInfoKey) {
       LOG(ERROR) << "Exchange MemInfo failed. Type received is "
-                 << (info->type);
-      goto out;
+                 << hello[1 + i].type;
+      return -1;
     }
-    auto remote_buf = CreateBufferFromInfo(info);
-    buffers.push_back(remote_buf);
+    buffers.push_back(CreateBufferFromInfo(&hello[1 + i]));
     auto buf = PickNextBuffer(1);
     if (!buf) {
       LOG(ERROR) << "Server using buffer error";
-      goto out;
-    }
-    SetInfoByBuffer(info, buf);
-    if (write(connfd, conn_buf, sizeof(connect_info)) != sizeof(connect_info)) {
-      LOG(ERROR) << "Couldn't send " << i << " memory's info";
-      goto out;
+      return -1;
     }
+    if (FLAGS_mw_window) conn->targets.push_back(BindTarget(buf));
+    SetInfoByBuffer(&info, buf);
+    reply.push_back(info);
   }
 
   rmem_lock_.lock();
   remote_mempools_.push_back(buffers);
-  rbuf_id = remote_mempools_.size() - 1;
+  conn->rbuf_id = remote_mempools_.size() - 1;
   rmem_lock_.unlock();
 
-  // Get the connection channel info from remote
+  for (int i = conn->left; i < conn->right; i++) {
+    auto ep = (rdma_endpoint *)endpoints_[i];
+    auto &channel = hello[1 + number_of_mem + i - conn->left];
+    if (channel.type != kChannelInfoKey) {
+      LOG(ERROR) << "Exchange data failed. Type Error: " << channel.type;
+      return -1;
+    }
+    SetEndpointInfo(ep, &channel);
+    GetEndpointInfo(ep, &info);
+    reply.push_back(info);
+  }
+  // Created while the reply and the ready message are on the wire
+  PrefetchAhs(conn->left, conn->right, conn->gid);
+  conn->out = PackHandshake(kReplyMsg, reply);
+  return 1;
+}
+
+int rdma_context::ReserveEndpoints(int n) {
+  int left = num_of_recv_.load();
+  do {
+    if (left + n > num_per_host_ * num_of_hosts_) {
+      LOG(ERROR) << "QP Overflow, request rejected";
+      return -1;
+    }
+  } while (!num_of_recv_.compare_exchange_weak(left, left + n));
+  return left;
+}
 
-  for (int i = left; i < right; i++) {
+struct ibv_mw_bind_info rdma_context::BindTarget(rdma_buffer *buf) {
+  struct ibv_mw_bind_info target;
+  target.mr = FindMr(1, buf->addr_);
+  target.addr = buf->addr_;
+  target.length = buf->size_;
+  target.mw_access_flags = IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ;
+  return target;
+}
+
+int rdma_context::PrepareReceiver(
+    int i, const std::vector<rdma_request> &reqs,
+    const std::vector<struct ibv_mw_bind_info> &targets) {
+  auto ep = endpoints_[i];
+  if (FLAGS_mw_window && ep->InitWindow(GetPd(i), targets)) {
+    LOG(ERROR) << "Memory window of endpoint " << i << " failed";
+    return -1;
+  }
+  // Post The first batch
+  int first_batch = FLAGS_recv_wq_depth;
+  int batch_size = FLAGS_recv_batch;
+  while (ep->GetRecvCredits() > 0) {
+    auto num_to_post = std::min(first_batch, batch_size);
+    if (ep->PostRecv(reqs, num_to_post)) {
+      LOG(ERROR) << "The " << i << " Receiver Post first batch error";
+      return -1;
+    }
+    first_batch -= num_to_post;
+  }
+  return 0;
+}
+
+int rdma_context::StartAccepted(rdma_accept *conn) {
+  auto reqs = ParseRecvFromStr();
+  for (int i = conn->left; i < conn->right; i++) {
     auto ep = (rdma_endpoint *)endpoints_[i];
-    n = read(connfd, conn_buf, sizeof(connect_info));
-    if (n != sizeof(connect_info)) {
-      PLOG(ERROR) << "Server read";
-      LOG(ERROR) << n << "/" << (int)sizeof(connect_info) << ": Read " << i
-                 << " endpoint's info failed";
-      goto out;
-    }
-    if ((info->type) != kChannelInfoKey) {
-      LOG(ERROR) << "Exchange data failed. Type Error: " << (info->type);
-      goto out;
-    }
-    SetEndpointInfo(ep, info);
-    GetEndpointInfo(ep, info);
-    if (write(connfd, conn_buf, sizeof(connect_info)) != sizeof(connect_info)) {
-      LOG(ERROR) << "Couldn't send " << i << " endpoint's info";
-      goto out;
-    }
-    if (ep->Activate(gid)) {
+    if (ep->Activate(conn->gid)) {
       LOG(ERROR) << "Activate Recv Endpoint " << i << " failed";
-      goto out;
-    }
-    // Post The first batch
-    int first_batch = FLAGS_recv_wq_depth;
-    int batch_size = FLAGS_recv_batch;
-    size_t idx = 0;
-    while (ep->GetRecvCredits() > 0) {
-      auto num_to_post = std::min(first_batch, batch_size);
-      if (ep->PostRecv(reqs, idx, num_to_post)) {
-        LOG(ERROR) << "The " << i << " Receiver Post first batch error";
-        goto out;
-      }
-      first_batch -= num_to_post;
+      return -1;
     }
+    if (PrepareReceiver(i, reqs, conn->targets)) return -1;
+    ep->SetMemId(conn->rbuf_id);
+    ep->SetServer(GidToIP(conn->gid));
+    // Hand the endpoint over to its worker. Nothing here touches it after.
     ep->SetActivated(true);
-    ep->SetMemId(rbuf_id);
-    ep->SetServer(GidToIP(gid));
+    workers_[WorkerOf(i)]->Join();
     LOG(INFO) << "Endpoint " << i << " has started";
   }
+  if (FLAGS_qp_type == IBV_QPT_UD &&
+      conn->right == num_per_host_ * num_of_hosts_)
+    ah_cache_.PrintStats();
+  return 0;
+}
 
-  // After connection setup. Tell remote that they can send.
-  n = read(connfd, conn_buf, sizeof(connect_info));
-  if (n != sizeof(connect_info)) {
-    PLOG(ERROR) << "Server read";
-    LOG(ERROR) << n << "/" << (int)sizeof(connect_info)
-               << ": Read Send request failed";
-    goto out;
-  }
-  if ((info->type) != kGoGoKey) {
-    LOG(ERROR) << "GOGO request failed";
-    goto out;
+void rdma_context::ActivateAccepted() {
+  while (true) {
+    rdma_accept *conn;
+    {
+      std::unique_lock<std::mutex> lock(accept_lock_);
+      accept_cv_.wait(lock, [this]() { return !to_activate_.empty(); });
+      conn = to_activate_.front();
+      to_activate_.pop_front();
+    }
+    conn->activated = StartAccepted(conn);
+    {
+      std::lock_guard<std::mutex> lock(accept_lock_);
+      activated_.push_back(conn);
+    }
+    uint64_t one = 1;
+    if (write(accept_wake_, &one, sizeof(one)) < 0)
+      PLOG(ERROR) << "write() to the acceptor failed";
   }
-  memset(info, 0, sizeof(connect_info));
-  info->type = (kGoGoKey);
-  if (write(connfd, conn_buf, sizeof(connect_info)) != sizeof(connect_info)) {
-    LOG(ERROR) << "Couldn't send GOGO!!";
-    goto out;
+}
+
+int rdma_context::StepAccept(rdma_accept *conn) {
+  std::vector<connect_info> records;
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.data.ptr = conn;
+  switch (conn->state) {
+    case rdma_accept::kHello: {
+      auto ret = conn->reader.Feed(conn->fd);
+      if (ret < 0) return -1;
+      if (!ret) return 1;  // Wait for the socket
+      if (conn->reader.Parse(kHelloMsg, &records)) return -1;
+      ret = ServeHello(conn, records);
+      if (ret < 0) return -1;
+      conn->state = ret ? rdma_accept::kReply : rdma_accept::kReject;
+      ev.events = EPOLLOUT;
+      if (epoll_ctl(conn->epfd, EPOLL_CTL_MOD, conn->fd, &ev)) return -1;
+    }
+    // Fall through: the socket most likely takes the reply right away
+    case rdma_accept::kReply:
+    case rdma_accept::kReject: {
+      auto ret = FlushHandshake(conn->fd, conn->out, &conn->sent);
+      if (ret < 0) return -1;
+      if (!ret) return 1;  // Wait for the socket
+      if (conn->state == rdma_accept::kReject) return 0;
+      // The client brings its QPs up meanwhile and waits for the ready.
+      // Ours go up on the pool, so the acceptor only does socket I/O.
+      if (epoll_ctl(conn->epfd, EPOLL_CTL_DEL, conn->fd, nullptr)) return -1;
+      conn->state = rdma_accept::kActivate;
+      return 2;
+    }
+    case rdma_accept::kActivate:
+      // Back from the pool
+      if (conn->activated) return -1;
+      ev.events = EPOLLOUT;
+      if (epoll_ctl(conn->epfd, EPOLL_CTL_ADD, conn->fd, &ev)) return -1;
+      conn->out = PackHandshake(kReadyMsg, {});
+      conn->sent = 0;
+      conn->state = rdma_accept::kReady;
+    // Fall through
+    case rdma_accept::kReady: {
+      auto ret = FlushHandshake(conn->fd, conn->out, &conn->sent);
+      if (ret < 0) return -1;
+      if (!ret) return 1;  // Wait for the socket
+      return 0;
+    }
   }
-  close(connfd);
-  free(conn_buf);
-  return 0;
-out:
-  close(connfd);
-  free(conn_buf);
   return -1;
 }
 
-int rdma_context::ConnectionSetup(const char *server, int port) {
-  struct addrinfo *res, *t;
-  struct addrinfo hints;
-  memset(&hints, 0, sizeof(hints));
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
-  char *service;
-  int n;
-  int sockfd = -1;
-  int err;
-  if (asprintf(&service, "%d", port) < 0) return -1;
-  n = getaddrinfo(server, service, &hints, &res);
-  if (n < 0) {
-    LOG(ERROR) << gai_strerror(n) << " for " << server << ":" << port;
-    free(service);
-    return -1;
-  }
-  for (t = res; t; t = t->ai_next) {
-    sockfd = socket(t->ai_family, t->ai_socktype, t->ai_protocol);
-    if (sockfd >= 0) {
-      if (!connect(sockfd, t->ai_addr, t->ai_addrlen)) break;
-      close(sockfd);
-      sockfd = -1;
+int rdma_context::BuildHello(int connid, std::vector<connect_info> *hello) {
+  connect_info info;
+  memset(&info, 0, sizeof(connect_info));
+  info.type = kHostInfoKey;
+  info.info.host.number_of_qp = num_per_host_;
+  info.info.host.number_of_mem = FLAGS_buf_num;
+  memcpy(&info.info.host.gid, &local_gid_, sizeof(union ibv_gid));
+  hello->push_back(info);
+  for (int i = 0; i < FLAGS_buf_num; i++) {
+    auto buf = PickNextBuffer(1);
+    if (!buf) {
+      LOG(ERROR) << "Client using buffer error";
+      return -1;
     }
+    SetInfoByBuffer(&info, buf);
+    hello->push_back(info);
   }
-  freeaddrinfo(res);
-  free(service);
-  if (sockfd < 0) {
-    LOG(ERROR) << "Couldn't connect to " << server << ":" << port;
-    return -1;
+  for (int i = 0; i < num_per_host_; i++) {
+    GetEndpointInfo(endpoints_[i + connid * num_per_host_], &info);
+    hello->push_back(info);
   }
-  return sockfd;
+  return 0;
 }
 
-int rdma_context::Connect(const char *server, int port, int connid) {
-  int sockfd = -1;
-  for (int i = 0; i < kMaxConnRetry; i++) {
-    sockfd = ConnectionSetup(server, port);
-    if (sockfd > 0) break;
-    LOG(INFO) << "Try connect to " << server << ":" << port << " failed for "
-              << i + 1 << " times...";
-    sleep(1);
-  }
-  if (sockfd < 0) return -1;
-  rdma_endpoint *ep;
-  union ibv_gid remote_gid;
-  char *conn_buf = (char *)malloc(sizeof(connect_info));
-  if (!conn_buf) {
-    LOG(ERROR) << "Malloc for metadata failed";
+int rdma_context::AcceptReply(int connid, std::vector<connect_info> &reply,
+                              union ibv_gid *remote_gid) {
+  std::vector<rdma_buffer *> buffers;
+  if (reply.size() != (size_t)(1 + FLAGS_buf_num + num_per_host_) ||
+      reply[0].type != kHostInfoKey ||
+      reply[0].info.host.number_of_qp != num_per_host_) {
+    LOG(ERROR) << "Bad reply: " << reply.size() << " records for "
+               << FLAGS_buf_num << " buffers and " << num_per_host_ << " QPs";
     return -1;
   }
-  connect_info *info = (connect_info *)conn_buf;
-  int number_of_qp, n = 0, rbuf_id = -1;
-  std::vector<rdma_buffer *> buffers;
-  memset(info, 0, sizeof(connect_info));
-  info->info.host.number_of_qp = (num_per_host_);
-  info->info.host.number_of_mem = (FLAGS_buf_num);
-  memcpy(&info->info.host.gid, &local_gid_, sizeof(union ibv_gid));
-  if (write(sockfd, conn_buf, sizeof(connect_info)) != sizeof(connect_info)) {
-    LOG(ERROR) << "Couldn't send local address";
-    n = -1;
-    goto out;
-  }
-  n = read(sockfd, conn_buf, sizeof(connect_info));
-  if (n != sizeof(connect_info)) {
-    PLOG(ERROR) << "client read";
-    LOG(ERROR) << "Read only " << n << "/" << sizeof(connect_info) << " bytes";
-    goto out;
-  }
-  if (info->type != kHostInfoKey) {
-    LOG(ERROR) << "The First exchange should be host info";
-    goto out;
-  }
-  number_of_qp = (info->info.host.number_of_qp);
-  if (number_of_qp != num_per_host_) {
-    LOG(ERROR) << "Receiver does not support " << num_per_host_ << " senders";
-    goto out;
-  }
-  memcpy(&remote_gid, &info->info.host.gid, sizeof(union ibv_gid));
+  memcpy(remote_gid, &reply[0].info.host.gid, sizeof(union ibv_gid));
   for (int i = 0; i < FLAGS_buf_num; i++) {
-    auto buf = PickNextBuffer(1);
-    if (!buf) {
-      LOG(ERROR) << "Client using buffer error";
-      goto out;
-    }
-    SetInfoByBuffer(info, buf);
-    if (write(sockfd, conn_buf, sizeof(connect_info)) != sizeof(connect_info)) {
-      LOG(ERROR) << "Couldn't send " << i << " memory's info";
-      goto out;
-    }
-    n = read(sockfd, conn_buf, sizeof(connect_info));
-    if (n != sizeof(connect_info)) {
-      PLOG(ERROR) << "Client read";
-      LOG(ERROR) << n << "/" << (int)sizeof(connect_info) << ": Read " << i
-                 << " mem's info failed";
-      goto out;
-    }
-    if ((info->type) != kMemInfoKey) {
+    if (reply[1 + i].type != kMemInfoKey) {
       LOG(ERROR) << "Exchange MemInfo failde. Type received is "
-                 << (info->type);
-      goto out;
+                 << reply[1 + i].type;
+      return -1;
     }
-    auto remote_buf = CreateBufferFromInfo(info);
-    buffers.push_back(remote_buf);
+    buffers.push_back(CreateBufferFromInfo(&reply[1 + i]));
   }
+  if (CheckRemoteBuffers(buffers, GidToIP(*remote_gid))) return -1;
 
   rmem_lock_.lock();
-  rbuf_id = remote_mempools_.size();
+  int rbuf_id = remote_mempools_.size();
   remote_mempools_.push_back(buffers);
   rmem_lock_.unlock();
 
+  int left = connid * num_per_host_;
   for (int i = 0; i < num_per_host_; i++) {
-    ep = endpoints_[i + connid * num_per_host_];
-    GetEndpointInfo(ep, info);
-    if (write(sockfd, conn_buf, sizeof(connect_info)) != sizeof(connect_info)) {
-      LOG(ERROR) << "Couldn't send " << i << "endpoint's info";
-      goto out;
-    }
-    n = read(sockfd, conn_buf, sizeof(connect_info));
-    if (n != sizeof(connect_info)) {
-      PLOG(ERROR) << "Client Read";
-      LOG(ERROR) << "Read only " << n << "/" << sizeof(connect_info)
-                 << " bytes";
-      goto out;
-    }
-    if ((info->type) != kChannelInfoKey) {
-      LOG(ERROR) << "Exchange Data Failed. Type Received is " << (info->type)
+    auto &channel = reply[1 + FLAGS_buf_num + i];
+    if (channel.type != kChannelInfoKey) {
+      LOG(ERROR) << "Exchange Data Failed. Type Received is " << channel.type
                  << ", expected " << kChannelInfoKey;
-      goto out;
+      return -1;
     }
-    SetEndpointInfo(ep, info);
-    if (ep->Activate(remote_gid)) {
+    SetEndpointInfo(endpoints_[left + i], &channel);
+  }
+  // The AHs get created while the QPs go to RTS
+  PrefetchAhs(left, left + num_per_host_, *remote_gid);
+  // The server activates its side meanwhile
+  for (int i = 0; i < num_per_host_; i++) {
+    auto ep = endpoints_[left + i];
+    if (ep->Activate(*remote_gid)) {
       LOG(ERROR) << "Activate " << i << " endpoint failed";
-      goto out;
+      return -1;
     }
+    ep->SetServer(GidToIP(*remote_gid));
+    ep->SetMemId(rbuf_id);
   }
-  memset(info, 0, sizeof(connect_info));
-  info->type = (kGoGoKey);
-  if (write(sockfd, conn_buf, sizeof(connect_info)) != sizeof(connect_info)) {
-    LOG(ERROR) << "Ask GOGO send failed";
-    goto out;
-  }
-  n = read(sockfd, conn_buf, sizeof(connect_info));
-  if (n != sizeof(connect_info)) {
-    PLOG(ERROR) << "Client Read";
-    LOG(ERROR) << "Read only " << n << " / " << sizeof(connect_info)
-               << " bytes";
-    goto out;
-  }
-  if ((info->type) != kGoGoKey) {
-    LOG(ERROR) << "Ask to Send failed. Receiver reply with " << (info->type)
-               << " But we expect " << kGoGoKey;
-    goto out;
+  return 0;
+}
+
+void rdma_context::PrefetchAhs(int left, int right,
+                               const union ibv_gid &remote_gid) {
+  if (FLAGS_qp_type != IBV_QPT_UD) return;
+  std::vector<struct ibv_ah_attr> attrs;
+  for (int i = left; i < right; i++) {
+    attrs.push_back(endpoints_[i]->MakeAhAttr(remote_gid));
+    // Without --share_pd every endpoint has a PD, and an AH, of its own
+    if (!share_pd_) {
+      ah_cache_.Prefetch(GetPd(i), attrs);
+      attrs.clear();
+    }
   }
+  if (!attrs.empty()) ah_cache_.Prefetch(GetPd(left), attrs);
+}
+
+void rdma_context::StartEndpoints(int connid) {
   for (int i = 0; i < num_per_host_; i++) {
-    auto ep = endpoints_[i + connid * num_per_host_];
-    ep->SetActivated(true);
-    ep->SetServer(GidToIP(remote_gid));
-    ep->SetMemId(rbuf_id);
+    auto id = i + connid * num_per_host_;
+    endpoints_[id]->SetActivated(true);
+    workers_[WorkerOf(id)]->Join();
   }
-  close(sockfd);
-  free(conn_buf);
-  return 0;
-out:
-  close(sockfd);
-  free(conn_buf);
-  return -1;
 }
 
-inline int rdma_context::ParseEachEx(struct ibv_cq_ex *cq_ex) {
-  if (cq_ex->status != IBV_WC_SUCCESS) {
-    LOG(ERROR) << "God bad completion status with " << cq_ex->status;
+namespace {
+
+// One peer of ConnectAll()
+struct rdma_dial {
+  enum { kBackoff, kConnecting, kHello, kReply, kReady, kDone, kFailed };
+  int state = kBackoff;
+  int fd = -1;
+  int attempts = 0;
+  uint64_t retry_at = 0;  // Now64() of the next attempt, in kBackoff
+  uint64_t start = 0;
+  struct addrinfo *addrs = nullptr;
+  struct addrinfo *next_addr = nullptr;
+  std::vector<char> hello;
+  size_t sent = 0;
+  handshake_reader reader;
+};
+
+}  // namespace
+
+int rdma_context::ConnectAll(const std::vector<std::string> &servers,
+                             int port) {
+  std::vector<rdma_dial> dials(servers.size());
+  uint64_t rand = SeedRand(Now64());
+  int epfd = epoll_create1(0);
+  if (epfd < 0) {
+    PLOG(ERROR) << "epoll_create1() failed";
     return -1;
   }
-  auto opcode = cq_ex->read_opcode(cq_ex);
-  auto ep = reinterpret_cast<rdma_endpoint *>(cq_ex->wr_id);
-  switch (opcode) {
-    case IBV_WC_RDMA_WRITE:
-    case IBV_WC_RDMA_READ:
-    case IBV_WC_SEND:
-      // Client Handle CQE
-      ep->SendHandler(nullptr);
-      break;
-    case IBV_WC_RECV:
-    case IBV_WC_RECV_RDMA_WITH_IMM:
-      // Server Handle CQE
-      ep->RecvHandler(nullptr);
-      break;
-    default:
-      LOG(ERROR) << "Unknown opcode " << opcode;
+  auto close_fd = [&](rdma_dial &d) {
+    if (d.fd < 0) return;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, d.fd, nullptr);
+    close(d.fd);
+    d.fd = -1;
+  };
+  auto fail = [&](size_t i) {
+    LOG(ERROR) << "Collie client connect to " << servers[i] << " failed";
+    close_fd(dials[i]);
+    dials[i].state = rdma_dial::kFailed;
+  };
+  // Slow servers (large or hugepage pools to register) get until then
+  auto deadline = Now64() + FLAGS_connect_timeout * 1000000ULL;
+  auto backoff = [&](size_t i) {
+    auto &d = dials[i];
+    close_fd(d);
+    auto ms = ConnBackoffMs(++d.attempts, &rand);
+    if (Now64() + ms * 1000 > deadline) return fail(i);
+    LOG(INFO) << "Try connect to " << servers[i] << ":" << port
+              << " failed for " << d.attempts << " times, again in " << ms
+              << " ms";
+    d.next_addr = d.addrs;
+    d.retry_at = Now64() + ms * 1000;
+    d.state = rdma_dial::kBackoff;
+  };
+  auto watch = [&](size_t i, uint32_t events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u64 = i;
+    return epoll_ctl(epfd, EPOLL_CTL_MOD, dials[i].fd, &ev);
+  };
+  // Next address of the peer, or backoff once all of them failed
+  auto dial = [&](size_t i) {
+    auto &d = dials[i];
+    for (; d.next_addr; d.next_addr = d.next_addr->ai_next) {
+      auto t = d.next_addr;
+      d.fd = socket(t->ai_family, t->ai_socktype | SOCK_NONBLOCK,
+                    t->ai_protocol);
+      if (d.fd < 0) continue;
+      struct epoll_event ev;
+      memset(&ev, 0, sizeof(ev));
+      ev.events = EPOLLOUT;
+      ev.data.u64 = i;
+      if (epoll_ctl(epfd, EPOLL_CTL_ADD, d.fd, &ev)) {
+        PLOG(ERROR) << "epoll_ctl() failed";
+        close(d.fd);
+        d.fd = -1;
+        continue;
+      }
+      if (!connect(d.fd, t->ai_addr, t->ai_addrlen) || errno == EINPROGRESS) {
+        d.next_addr = t->ai_next;
+        d.state = rdma_dial::kConnecting;
+        return;
+      }
+      close_fd(d);
+    }
+    backoff(i);
+  };
+  // Moves the peer on as far as its socket lets it
+  auto step = [&](size_t i) {
+    auto &d = dials[i];
+    if (d.state == rdma_dial::kConnecting) {
+      int err = 0;
+      socklen_t len = sizeof(err);
+      getsockopt(d.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+      if (err) {
+        close_fd(d);
+        return dial(i);
+      }
+      d.state = rdma_dial::kHello;
+    }
+    if (d.state == rdma_dial::kHello) {
+      auto ret = FlushHandshake(d.fd, d.hello, &d.sent);
+      if (ret < 0) return fail(i);
+      if (!ret) return;
+      d.state = rdma_dial::kReply;
+      if (watch(i, EPOLLIN)) return fail(i);
+    }
+    std::vector<connect_info> records;
+    if (d.state == rdma_dial::kReply) {
+      auto ret = d.reader.Feed(d.fd);
+      if (ret < 0) return fail(i);
+      if (!ret) return;
+      bool rejected = false;
+      if (d.reader.Parse(kReplyMsg, &records, &rejected)) return fail(i);
+      if (rejected) {
+        LOG(ERROR) << "Receiver does not support " << num_per_host_
+                   << " senders";
+        return fail(i);
+      }
+      union ibv_gid remote_gid;
+      if (AcceptReply(i, records, &remote_gid)) return fail(i);
+      d.reader.Reset();
+      d.state = rdma_dial::kReady;
+    }
+    if (d.state == rdma_dial::kReady) {
+      auto ret = d.reader.Feed(d.fd);
+      if (ret < 0) return fail(i);
+      if (!ret) return;
+      if (d.reader.Parse(kReadyMsg, &records)) return fail(i);
+      StartEndpoints(i);
+      LOG(INFO) << "Connected " << num_per_host_ << " QPs to " << servers[i]
+                << " in " << (Now64() - d.start) / 1000.0 << " ms";
+      close_fd(d);
+      d.state = rdma_dial::kDone;
+    }
+  };
+
+  auto service = std::to_string(port);
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  for (size_t i = 0; i < servers.size(); i++) {
+    auto &d = dials[i];
+    d.start = Now64();
+    std::vector<connect_info> hello;
+    auto n = getaddrinfo(servers[i].c_str(), service.c_str(), &hints, &d.addrs);
+    if (n) {
+      LOG(ERROR) << gai_strerror(n) << " for " << servers[i] << ":" << port;
+      d.addrs = nullptr;
+      fail(i);
+      continue;
+    }
+    // Built once: it picks the buffers we advertise
+    if (BuildHello(i, &hello)) {
+      fail(i);
+      continue;
+    }
+    d.hello = PackHandshake(kHelloMsg, hello);
+    d.next_addr = d.addrs;
+    dial(i);
+  }
+
+  struct epoll_event events[kCqPollDepth];
+  while (true) {
+    size_t pending = 0;
+    uint64_t now = Now64(), wake = UINT64_MAX;
+    for (size_t i = 0; i < dials.size(); i++) {
+      auto &d = dials[i];
+      if (d.state == rdma_dial::kBackoff && d.retry_at <= now) dial(i);
+      if (d.state == rdma_dial::kBackoff) wake = std::min(wake, d.retry_at);
+      if (d.state != rdma_dial::kDone && d.state != rdma_dial::kFailed)
+        pending++;
+    }
+    if (!pending) break;
+    int timeout = -1;
+    if (wake != UINT64_MAX) timeout = wake > now ? (wake - now + 999) / 1000 : 0;
+    auto n = epoll_wait(epfd, events, kCqPollDepth, timeout);
+    if (n < 0 && errno != EINTR) {
+      PLOG(ERROR) << "epoll_wait() failed";
       break;
+    }
+    for (int j = 0; j < n; j++) step(events[j].data.u64);
   }
-  auto nic_clock_cycles = ibv_wc_read_completion_ts(cq_ex);
-  auto nic_wall_ts = ibv_wc_read_completion_wallclock_ns(cq_ex);
-  auto cpu_wall_ts = Now64Ns();
-  struct mlx5dv_clock_info clock_info;
-  int ret = mlx5dv_get_clock_info(ctx_, &clock_info);
-  if (ret < 0) {
-    PLOG(ERROR) << "mlx5dv_get_clock_info() failed";
+
+  int connected = 0;
+  for (size_t i = 0; i < dials.size(); i++) {
+    if (dials[i].state == rdma_dial::kDone) connected++;
+    close_fd(dials[i]);
+    if (dials[i].addrs) freeaddrinfo(dials[i].addrs);
+  }
+  close(epfd);
+  if (FLAGS_qp_type == IBV_QPT_UD) ah_cache_.PrintStats();
+  return connected;
+}
+
+int rdma_context::ListenCm() {
+  auto channel = rdma_create_event_channel();
+  if (!channel) {
+    PLOG(ERROR) << "rdma_create_event_channel() failed";
+    return -1;
   }
-  struct ibv_values_ex values_ex;
-  memset(&values_ex, 0, sizeof(struct ibv_values_ex));
-  values_ex.comp_mask = IBV_VALUES_MASK_RAW_CLOCK;
-  ret = ibv_query_rt_values_ex(ctx_, &values_ex);
-  if (ret < 0) {
-    PLOG(ERROR) << "ibv_query_rt_values_ex() failed";
+  struct rdma_cm_id *listen_id = nullptr;
+  if (rdma_create_id(channel, &listen_id, nullptr, RDMA_PS_TCP)) {
+    PLOG(ERROR) << "rdma_create_id() failed";
+    return -1;
+  }
+  struct addrinfo *res, *t;
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_flags = AI_PASSIVE;
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  auto service = std::to_string(port_);
+  auto n = getaddrinfo(nullptr, service.c_str(), &hints, &res);
+  if (n) {
+    LOG(ERROR) << gai_strerror(n) << " for port " << port_;
+    return -1;
   }
-  auto cqe_wall_ts = mlx5dv_ts_to_ns(&clock_info, values_ex.raw_clock.tv_nsec);
-  nic_process_time_.push_back(cqe_wall_ts - nic_wall_ts);
-  if (nic_process_time_.size() >= 200000) {
-    std::sort(nic_process_time_.begin(), nic_process_time_.end());
-    LOG(INFO) << "The size of the vector " << nic_process_time_.size();
-    LOG(INFO) << "The min: " << nic_process_time_[0]
-              << ", median: " << nic_process_time_[nic_process_time_.size() / 2]
-              << ", p95: "
-              << nic_process_time_[(int)(nic_process_time_.size() * 0.95)]
-              << ", p99: "
-              << nic_process_time_[(int)(nic_process_time_.size() * 0.99)]
-              << ", max: " << nic_process_time_[nic_process_time_.size() - 1];
-    nic_process_time_.clear();
+  for (t = res; t; t = t->ai_next)
+    if (!rdma_bind_addr(listen_id, t->ai_addr)) break;
+  freeaddrinfo(res);
+  if (!t) {
+    LOG(ERROR) << "Couldn't listen to port " << port_ << " with RDMA-CM";
+    return -1;
+  }
+  if (rdma_listen(listen_id, 1024)) {
+    PLOG(ERROR) << "rdma_listen() failed";
+    return -1;
+  }
+  LOG(INFO) << "About to listen on port " << port_ << " with RDMA-CM";
+  auto reqs = ParseRecvFromStr();
+  int expected = num_per_host_ * num_of_hosts_;
+  int established = 0;
+  uint64_t first = 0;
+  while (true) {
+    struct rdma_cm_event *event;
+    if (rdma_get_cm_event(channel, &event)) {
+      PLOG(ERROR) << "rdma_get_cm_event() failed";
+      break;
+    }
+    auto id = event->id;
+    bool rejected = false;
+    switch (event->event) {
+      case RDMA_CM_EVENT_CONNECT_REQUEST:
+        if (!first) first = Now64();
+        rejected = ServeCmRequest(event, reqs) < 0;
+        break;
+      case RDMA_CM_EVENT_ESTABLISHED:
+        if (++established == expected) {
+          auto us = std::max<uint64_t>(Now64() - first, 1);
+          LOG(INFO) << "Accepted " << established << " RDMA-CM connections in "
+                    << us / 1000.0 << " ms (" << established * 1e6 / us
+                    << " conn/s)";
+        }
+        break;
+      case RDMA_CM_EVENT_DISCONNECTED:
+        LOG(WARNING) << "Endpoint "
+                     << ((rdma_endpoint *)event->id->context)->GetId()
+                     << " disconnected";
+        break;
+      default:
+        LOG(INFO) << "Got RDMA-CM event " << rdma_event_str(event->event);
+        break;
+    }
+    rdma_ack_cm_event(event);
+    if (rejected) rdma_destroy_id(id);
   }
+  return -1;
+}
+
+int rdma_context::ServeCmRequest(struct rdma_cm_event *event,
+                                 const std::vector<rdma_request> &reqs) {
+  auto id = event->id;
+  cm_private req, rep;
+  // Always with our payload: the client retries a bare reject, thinking
+  // the server is not up yet
+  InitCmPrivate(&rep, kRejectMsg);
+  auto reject = [&]() {
+    rdma_reject(id, &rep, CmPrivateLen(0));
+    return -1;
+  };
+  if (ParseCmPrivate(event->param.conn.private_data,
+                     event->param.conn.private_data_len, kHelloMsg, &req) ||
+      !req.count || req.wanted > kCmMaxMem) {
+    LOG(ERROR) << "Bad RDMA-CM connection request, rejected";
+    return reject();
+  }
+  // Our QPs belong to --dev: a request that came in on another device
+  // cannot drive them
+  if (strcmp(ibv_get_device_name(id->verbs->device),
+             ibv_get_device_name(ctx_->device))) {
+    LOG(ERROR) << "RDMA-CM connection request on "
+               << ibv_get_device_name(id->verbs->device) << ", not --dev "
+               << ibv_get_device_name(ctx_->device) << ", rejected";
+    return reject();
+  }
+  int i;
+  if (!cm_spare_.empty()) {
+    i = cm_spare_.back();
+    cm_spare_.pop_back();
+  } else {
+    i = ReserveEndpoints(1);
+    if (i < 0) return reject();
+  }
+  auto ep = endpoints_[i];
+  // Failures from here on give the endpoint back for the next request
+  auto release = [&]() {
+    id->context = nullptr;
+    if (ep->Reset() == 0) cm_spare_.push_back(i);
+    InitCmPrivate(&rep, kRejectMsg);
+    return reject();
+  };
+  id->context = ep;
+
+  // One of our buffers for each one asked for
+  InitCmPrivate(&rep, kReplyMsg);
+  std::vector<struct ibv_mw_bind_info> targets;
+  for (; rep.count < req.wanted; rep.count++) {
+    auto buf = PickNextBuffer(1);
+    if (!buf) {
+      LOG(ERROR) << "Server using buffer error";
+      return release();
+    }
+    rep.mem[rep.count].addr = buf->addr_;
+    rep.mem[rep.count].rkey = buf->remote_K_;
+    rep.mem[rep.count].size = buf->size_;
+    if (FLAGS_mw_window) targets.push_back(BindTarget(buf));
+  }
+  uint8_t initiator =
+      std::min<int>(FLAGS_max_qp_rd_atom, event->param.conn.responder_resources);
+  uint8_t responder =
+      std::min<int>(FLAGS_max_qp_rd_atom, event->param.conn.initiator_depth);
+  // Receives go up before the accept, so the client may send right away
+  if (ep->ActivateCm(id, initiator, responder) ||
+      PrepareReceiver(i, reqs, targets)) {
+    LOG(ERROR) << "Activate Recv Endpoint " << i << " failed";
+    return release();
+  }
+  ep->SetServer(GidToIP(ep->GetRemoteGid()));
+  struct rdma_conn_param param;
+  memset(&param, 0, sizeof(param));
+  param.private_data = &rep;
+  param.private_data_len = CmPrivateLen(rep.count);
+  param.responder_resources = responder;
+  param.initiator_depth = initiator;
+  param.rnr_retry_count = FLAGS_rnr_retry;
+  param.qp_num = ep->GetQpn();
+  if (::rdma_accept(id, &param)) {
+    PLOG(ERROR) << "rdma_accept() failed";
+    return release();
+  }
+  // The client's buffers, only once the connection is ours
+  std::vector<rdma_buffer *> buffers;
+  for (int j = 0; j < req.count; j++)
+    buffers.push_back(new rdma_buffer(req.mem[j].addr, req.mem[j].size, 0,
+                                      req.mem[j].rkey));
+  rmem_lock_.lock();
+  remote_mempools_.push_back(buffers);
+  int rbuf_id = remote_mempools_.size() - 1;
+  rmem_lock_.unlock();
+  ep->SetMemId(rbuf_id);
+  // Hand the endpoint over to its worker. Nothing here touches it after.
+  ep->SetActivated(true);
+  workers_[WorkerOf(i)]->Join();
   return 0;
 }
 
-int rdma_context::PollEachEx(struct ibv_cq_ex *cq_ex) {
-  struct ibv_poll_cq_attr attr = {};
-  int ret = ENOENT;
-  ret = ibv_start_poll(cq_ex, &attr);
-  if (ret == ENOENT) return 0;
-  if (ret && ret != ENOENT) {
-    LOG(ERROR) << "ibv_start_poll() failed with " << ret;
-    return ret;
-  }
-  // Then we parse the completion
-  if (ParseEachEx(cq_ex)) {
-    ibv_end_poll(cq_ex);
+namespace {
+
+// One QP of ConnectCm()
+struct rdma_cm_dial {
+  struct rdma_cm_id *id = nullptr;
+  int attempts = 0;
+  uint64_t retry_at = 0;  // Now64() of the next attempt, 0 for none
+  uint64_t start = 0;
+  bool done = false;
+  bool failed = false;
+};
+
+}  // namespace
+
+int rdma_context::ConnectCm(const std::vector<std::string> &servers,
+                            int port) {
+  // The ids and their channel live as long as the connections
+  auto channel = rdma_create_event_channel();
+  if (!channel) {
+    PLOG(ERROR) << "rdma_create_event_channel() failed";
     return -1;
   }
-  while (true) {
-    ret = ibv_next_poll(cq_ex);
-    if (ret) break;
-    if (ret = ParseEachEx(cq_ex)) break;
+  int flags = fcntl(channel->fd, F_GETFL);
+  if (fcntl(channel->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    PLOG(ERROR) << "fcntl() failed";
+    return -1;
   }
-  ibv_end_poll(cq_ex);
-  if (ret == ENOENT)
+  size_t total = servers.size() * num_per_host_;
+  std::vector<rdma_cm_dial> dials(total);
+  std::vector<cm_private> hellos(total);
+  std::vector<struct sockaddr_storage> addrs(servers.size());
+  collie_histogram setup;
+  uint64_t rand = SeedRand(Now64());
+
+  auto fail = [&](size_t e) {
+    auto &d = dials[e];
+    if (d.id) rdma_destroy_id(d.id);
+    d.id = nullptr;
+    d.failed = true;
+    LOG(ERROR) << "RDMA-CM connection of endpoint " << e << " to "
+               << servers[e / num_per_host_] << " failed";
+  };
+  auto deadline = Now64() + FLAGS_connect_timeout * 1000000ULL;
+  auto retry = [&](size_t e) {
+    auto &d = dials[e];
+    if (d.id) rdma_destroy_id(d.id);
+    d.id = nullptr;
+    d.retry_at = Now64() + ConnBackoffMs(++d.attempts, &rand) * 1000;
+    if (d.retry_at > deadline) {
+      d.retry_at = 0;
+      fail(e);
+    }
+  };
+  auto dial = [&](size_t e) {
+    auto &d = dials[e];
+    d.retry_at = 0;
+    if (rdma_create_id(channel, &d.id, (void *)e, RDMA_PS_TCP)) {
+      PLOG(ERROR) << "rdma_create_id() failed";
+      d.id = nullptr;
+      return fail(e);
+    }
+    if (rdma_resolve_addr(d.id, nullptr,
+                          (struct sockaddr *)&addrs[e / num_per_host_],
+                          kCmTimeoutMs)) {
+      PLOG(WARNING) << "rdma_resolve_addr() failed";
+      retry(e);
+    }
+  };
+  auto connect = [&](size_t e, struct rdma_cm_id *id) {
+    struct rdma_conn_param param;
+    memset(&param, 0, sizeof(param));
+    param.private_data = &hellos[e];
+    param.private_data_len = CmPrivateLen(hellos[e].count);
+    param.responder_resources = FLAGS_max_qp_rd_atom;
+    param.initiator_depth = FLAGS_max_qp_rd_atom;
+    param.retry_count = FLAGS_retry_cnt;
+    param.rnr_retry_count = FLAGS_rnr_retry;
+    param.qp_num = endpoints_[e]->GetQpn();
+    return rdma_connect(id, &param);
+  };
+  // The server took the endpoint: its buffers, then our QP up
+  auto established = [&](size_t e, struct rdma_cm_event *event) {
+    cm_private rep;
+    if (ParseCmPrivate(event->param.conn.private_data,
+                       event->param.conn.private_data_len, kReplyMsg, &rep))
+      return -1;
+    if (rep.count != FLAGS_buf_num) {
+      LOG(ERROR) << "Got " << rep.count << " buffers for " << FLAGS_buf_num;
+      return -1;
+    }
+    std::vector<rdma_buffer *> buffers;
+    for (int j = 0; j < rep.count; j++)
+      buffers.push_back(new rdma_buffer(rep.mem[j].addr, rep.mem[j].size, 0,
+                                        rep.mem[j].rkey));
+    if (CheckRemoteBuffers(buffers, servers[e / num_per_host_])) return -1;
+    rmem_lock_.lock();
+    int rbuf_id = remote_mempools_.size();
+    remote_mempools_.push_back(buffers);
+    rmem_lock_.unlock();
+    auto ep = endpoints_[e];
+    uint8_t initiator = std::min<int>(FLAGS_max_qp_rd_atom,
+                                      event->param.conn.responder_resources);
+    uint8_t responder =
+        std::min<int>(FLAGS_max_qp_rd_atom, event->param.conn.initiator_depth);
+    if (ep->ActivateCm(event->id, initiator, responder)) return -1;
+    if (rdma_establish(event->id)) {
+      PLOG(ERROR) << "rdma_establish() failed";
+      return -1;
+    }
+    ep->SetServer(servers[e / num_per_host_]);
+    ep->SetMemId(rbuf_id);
+    ep->SetActivated(true);
+    workers_[WorkerOf(e)]->Join();
     return 0;
-  else
-    return ret;
-}
+  };
 
-int rdma_context::PollEach(struct ibv_cq *cq) {
-  int n = 0, ret = 0;
-  struct ibv_wc wc[kCqPollDepth];
-  do {
-    n = ibv_poll_cq(cq, kCqPollDepth, wc);
-    if (n < 0) {
-      PLOG(ERROR) << "ibv_poll_cq() failed";
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  auto service = std::to_string(port);
+  auto start = Now64();
+  for (size_t e = 0; e < total; e++) {
+    // Built once: it picks the buffer we advertise
+    InitCmPrivate(&hellos[e], kHelloMsg);
+    hellos[e].wanted = FLAGS_buf_num;
+    auto buf = PickNextBuffer(1);
+    if (!buf) {
+      LOG(ERROR) << "Client using buffer error";
       return -1;
     }
-    for (int i = 0; i < n; i++) {
-      if (wc[i].status != IBV_WC_SUCCESS) {
-        LOG(ERROR) << "Got bad completion status with " << wc[i].status;
-        return -1;
-      }
-      auto ep = reinterpret_cast<rdma_endpoint *>(wc[i].wr_id);
-      switch (wc[i].opcode) {
-        case IBV_WC_RDMA_WRITE:
-        case IBV_WC_RDMA_READ:
-        case IBV_WC_SEND:
-          // Client Handle CQE
-          ep->SendHandler(&wc[i]);
+    hellos[e].count = 1;
+    hellos[e].mem[0].addr = buf->addr_;
+    hellos[e].mem[0].rkey = buf->remote_K_;
+    hellos[e].mem[0].size = buf->size_;
+  }
+  for (size_t h = 0; h < servers.size(); h++) {
+    struct addrinfo *res;
+    auto n = getaddrinfo(servers[h].c_str(), service.c_str(), &hints, &res);
+    if (!n) {
+      memcpy(&addrs[h], res->ai_addr, res->ai_addrlen);
+      freeaddrinfo(res);
+    } else {
+      LOG(ERROR) << gai_strerror(n) << " for " << servers[h] << ":" << port;
+    }
+    for (int q = 0; q < num_per_host_; q++) {
+      auto e = h * num_per_host_ + q;
+      dials[e].start = start;
+      if (n)
+        fail(e);
+      else
+        dial(e);
+    }
+  }
+
+  while (true) {
+    size_t pending = 0;
+    uint64_t now = Now64(), wake = UINT64_MAX;
+    for (size_t e = 0; e < total; e++) {
+      auto &d = dials[e];
+      if (d.retry_at && d.retry_at <= now) dial(e);
+      if (d.retry_at) wake = std::min(wake, d.retry_at);
+      if (!d.done && !d.failed) pending++;
+    }
+    if (!pending) break;
+    int timeout = -1;
+    if (wake != UINT64_MAX) timeout = wake > now ? (wake - now + 999) / 1000 : 0;
+    struct pollfd pfd;
+    pfd.fd = channel->fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, timeout) < 0 && errno != EINTR) {
+      PLOG(ERROR) << "poll() failed";
+      break;
+    }
+    struct rdma_cm_event *event;
+    while (!rdma_get_cm_event(channel, &event)) {
+      auto e = (size_t)event->id->context;
+      bool lost = false, again = false;
+      switch (event->event) {
+        case RDMA_CM_EVENT_ADDR_RESOLVED:
+          // Our QPs, PDs and CQs belong to --dev
+          if (strcmp(ibv_get_device_name(event->id->verbs->device),
+                     ibv_get_device_name(ctx_->device))) {
+            LOG(ERROR) << "The route to " << servers[e / num_per_host_]
+                       << " goes through "
+                       << ibv_get_device_name(event->id->verbs->device)
+                       << ", not --dev";
+            lost = true;
+          } else {
+            again = rdma_resolve_route(event->id, kCmTimeoutMs);
+          }
           break;
-        case IBV_WC_RECV:
-        case IBV_WC_RECV_RDMA_WITH_IMM:
-          // Server Handle CQE
-          ep->RecvHandler(&wc[i]);
+        case RDMA_CM_EVENT_ROUTE_RESOLVED:
+          again = connect(e, event->id);
+          break;
+        case RDMA_CM_EVENT_CONNECT_RESPONSE:
+          lost = established(e, event);
+          if (!lost) {
+            dials[e].done = true;
+            setup.Record((Now64() - dials[e].start) * 1000);
+          }
+          break;
+        case RDMA_CM_EVENT_REJECTED: {
+          // Ours when the server is full, the CM's when it is not up yet
+          auto data = (const cm_private *)event->param.conn.private_data;
+          lost = data &&
+                 event->param.conn.private_data_len >= CmPrivateLen(0) &&
+                 data->magic == kHandshakeMagic;
+          if (lost)
+            LOG(ERROR) << "Receiver does not support " << num_per_host_
+                       << " senders";
+          again = !lost;
+          break;
+        }
+        case RDMA_CM_EVENT_ADDR_ERROR:
+        case RDMA_CM_EVENT_ROUTE_ERROR:
+        case RDMA_CM_EVENT_UNREACHABLE:
+        case RDMA_CM_EVENT_CONNECT_ERROR:
+          LOG(WARNING) << rdma_event_str(event->event) << " for endpoint " << e
+                       << ", status " << event->status;
+          again = true;
+          break;
+        case RDMA_CM_EVENT_DISCONNECTED:
+          LOG(WARNING) << "Endpoint " << e << " disconnected";
           break;
         default:
-          LOG(ERROR) << "Unknown opcode " << wc[i].opcode;
-          return -1;
+          LOG(INFO) << "Got RDMA-CM event " << rdma_event_str(event->event);
+          break;
       }
+      // Ids go only once their event is acked
+      rdma_ack_cm_event(event);
+      if (lost)
+        fail(e);
+      else if (again)
+        retry(e);
     }
-    ret += n;
-  } while (n);
-  return ret;
+  }
+
+  int connected = 0;
+  size_t qps = 0;
+  for (size_t h = 0; h < servers.size(); h++) {
+    int up = 0;
+    for (int q = 0; q < num_per_host_; q++)
+      up += dials[h * num_per_host_ + q].done;
+    qps += up;
+    if (up == num_per_host_) connected++;
+  }
+  auto us = std::max<uint64_t>(Now64() - start, 1);
+  LOG(INFO) << "Established " << qps << " of " << total
+            << " RDMA-CM connections in " << us / 1000.0 << " ms ("
+            << qps * 1e6 / us << " conn/s)";
+  LOG(INFO) << "RDMA-CM connection setup (ns) " << setup.Summary();
+  return connected;
 }
 
-int rdma_context::ServerDatapath() {
-  int batch_size = FLAGS_recv_batch;
-  auto reqs = ParseRecvFromStr();
-  size_t idx = 0;
+int rdma_context::AsyncEventHandler() {
+  struct ibv_async_event event;
   while (true) {
-    // Replenesh Recv Buffer
-    for (auto ep : endpoints_) {
-      if (!ep || !ep->GetActivated() || ep->GetRecvCredits() <= 0) continue;
-      auto credits = ep->GetRecvCredits();
-      while (credits > 0) {
-        auto toPostRecv = std::min(credits, batch_size);
-        for (auto &req : reqs) {
-          for (int i = 0; i < req.sge_num; i++) {
-            auto buf = PickNextBuffer(1);
-            req.sglist[i].addr = buf->addr_;
-            req.sglist[i].lkey = buf->local_K_;
-          }
-        }
-        if (ep->PostRecv(reqs, idx, toPostRecv)) {
-          LOG(ERROR) << "PostRecv() failed";
-          break;
-        }
-        credits -= toPostRecv;
-      }
+    if (ibv_get_async_event(ctx_, &event)) {
+      PLOG(ERROR) << "ibv_get_async_event() failed";
+      return -1;
     }
-    // Poll out the possible completion
-    for (auto cq : recv_cqs_) {
-      if (FLAGS_hw_ts) {
-        if (PollEachEx(cq.cq_ex) != 0) {
-          LOG(ERROR) << "PollEachEx() failed";
-          exit(0);
-        }
-      } else {
-        if (PollEach(cq.cq) < 0) {
-          LOG(ERROR) << "PollEach() failed";
-          exit(0);
-        }
-      }
+    switch (event.event_type) {
+      case IBV_EVENT_SRQ_LIMIT_REACHED:
+        ((rdma_srq *)event.element.srq->srq_context)->LimitReached();
+        break;
+      default:
+        LOG(WARNING) << "Got async event "
+                     << ibv_event_type_str(event.event_type);
+        break;
     }
+    ibv_ack_async_event(&event);
   }
   // Never reach here
   return 0;
 }
 
-int rdma_context::ClientDatapath() {
-  auto req_vec = ParseReqFromStr();
-  uint32_t batch_size = FLAGS_send_batch;
-  size_t j = 0;
-  int iterations_left = FLAGS_iters;
-  bool run_infinitely = FLAGS_run_infinitely;
+int rdma_context::RefreshNicClock() {
+  struct mlx5dv_clock_info clock_info;
+  if (mlx5dv_get_clock_info(ctx_, &clock_info)) {
+    PLOG(ERROR) << "mlx5dv_get_clock_info() failed";
+    return -1;
+  }
+  struct ibv_values_ex values_ex;
+  memset(&values_ex, 0, sizeof(struct ibv_values_ex));
+  values_ex.comp_mask = IBV_VALUES_MASK_RAW_CLOCK;
+  if (ibv_query_rt_values_ex(ctx_, &values_ex)) {
+    PLOG(ERROR) << "ibv_query_rt_values_ex() failed";
+    return -1;
+  }
+  auto cpu_ts = Now64Ns();
+  auto nic_ts = mlx5dv_ts_to_ns(&clock_info, values_ex.raw_clock.tv_nsec);
+  nic_clock_offset_.store((int64_t)(nic_ts - cpu_ts),
+                          std::memory_order_relaxed);
+  return 0;
+}
+
+int rdma_context::ClockHandler() {
+  uint64_t last_report = Now64();
+  uint64_t last_count = 0;
   while (true) {
-    if (!run_infinitely && iterations_left <= 0) break;
-    iterations_left--;
-    for (auto ep : endpoints_) {
-      if (!ep) continue;                  // Ignore those dead ones
-      if (!ep->GetActivated()) continue;  // YOU ARE NOT PREPARED!
-      if (batch_size > ep->GetSendCredits()) continue;  // YOU DON'T HAVE MONEY!
-      size_t i = 0;
-      // Shuffle the buffer that is used.
-      for (auto &req : req_vec) {
-        for (int i = 0; i < req.sge_num; i++) {
-          auto buf = PickNextBuffer(0);
-          req.sglist[i].addr = buf->addr_;
-          req.sglist[i].lkey = buf->local_K_;
-        }
-      }
-      ep->PostSend(req_vec, j, batch_size, remote_mempools_[ep->GetMemId()]);
-    }
-    for (auto cq : send_cqs_) {
-      if (FLAGS_hw_ts) {
-        if (PollEachEx(cq.cq_ex) != 0) {
-          LOG(ERROR) << "PollEachEx() failed";
-          exit(1);
-        }
-      } else {
-        if (PollEach(cq.cq) < 0) {
-          LOG(ERROR) << "PollEach() failed";
-          exit(1);
-        }
-      }
-    }
-    auto ts = Now64();
-    if (_print_thp)
-      for (auto ep : endpoints_) {
-        if (!ep) continue;                  // Ignore those dead ones
-        if (!ep->GetActivated()) continue;  // YOU ARE NOT PREPARED!
-        ep->PrintThroughput(ts);
-      }
+    std::this_thread::sleep_for(std::chrono::milliseconds(kClockRefreshMs));
+    if (RefreshNicClock()) return -1;
+    auto now = Now64();
+    if (now - last_report < 1000000) continue;  // report every 1s.
+    last_report = now;
+    collie_histogram snapshot;
+    for (auto w : workers_) snapshot.Merge(w->GetNicProcessTime());
+    if (snapshot.Count() == last_count) continue;
+    last_count = snapshot.Count();
+    LOG(INFO) << "NIC process time (ns) over " << snapshot.Count()
+              << " completions, " << snapshot.Summary();
+  }
+  // Never reach here
+  return 0;
+}
+
+int rdma_context::ServerDatapath() {
+  std::vector<std::thread> threads;
+  if (FLAGS_srq && FLAGS_srq_event) {
+    std::thread handler = std::thread(&rdma_context::AsyncEventHandler, this);
+    handler.detach();
+  }
+  if (FLAGS_hw_ts) {
+    if (RefreshNicClock()) return -1;
+    std::thread clock = std::thread(&rdma_context::ClockHandler, this);
+    clock.detach();
+  }
+  for (auto w : workers_) w->SetRequests(ParseRecvFromStr());
+  for (auto w : workers_) {
+    if (!w->GetEndpointNum()) continue;
+    threads.push_back(std::thread(&rdma_worker::ServerDatapath, w));
   }
-  // Never reach here.
+  for (auto &t : threads) t.join();
+  // Never reach here
+  return 0;
+}
+
+int rdma_context::ClientDatapath() {
+  std::vector<std::thread> threads;
+  if (FLAGS_hw_ts) {
+    if (RefreshNicClock()) return -1;
+    std::thread clock = std::thread(&rdma_context::ClockHandler, this);
+    clock.detach();
+  }
+  for (auto w : workers_) w->SetRequests(ParseReqFromStr());
+  if (FLAGS_latency || FLAGS_mw_window) {
+    // Pongs and grants land in the receive buffers we told the server about
+    for (auto w : workers_) w->SetRecvRequests(ParseRecvFromStr());
+  }
+  auto start = Now64();
+  for (auto w : workers_) {
+    if (!w->GetEndpointNum()) continue;
+    if (FLAGS_mw_window)
+      threads.push_back(std::thread(&rdma_worker::WindowDatapath, w));
+    else if (FLAGS_latency)
+      threads.push_back(std::thread(&rdma_worker::LatencyDatapath, w));
+    else if (FLAGS_trace_replay != "")
+      threads.push_back(std::thread(&rdma_worker::ReplayDatapath, w));
+    else
+      threads.push_back(std::thread(&rdma_worker::ClientDatapath, w));
+  }
+  for (auto &t : threads) t.join();
+  if (FLAGS_latency) PrintLatency();
+  if (FLAGS_mw_window) PrintWindows(Now64() - start);
+  if (FLAGS_odp) PrintOdp();
   return 0;
 }
 
+void rdma_context::PrintWindows(uint64_t elapsed_us) {
+  collie_histogram wait;
+  uint64_t msgs = 0, bytes = 0, windows = 0;
+  for (auto ep : endpoints_) {
+    if (!ep || !ep->GetGrantWait()) continue;
+    msgs += ep->GetMsgs();
+    bytes += ep->GetBytes();
+    windows += ep->GetWindows();
+    wait.Merge(*ep->GetGrantWait());
+  }
+  if (!elapsed_us) elapsed_us = 1;
+  LOG(INFO) << msgs << " requests in " << windows << " windows of "
+            << FLAGS_mw_window << " (--mw_inv=" << FLAGS_mw_inv << "): "
+            << msgs * 1.0 / elapsed_us << " Mrps, " << bytes * 8.0 / elapsed_us
+            << " Mbps, " << windows * 1000.0 / elapsed_us << " K binds/s";
+  LOG(INFO) << "Window turnaround, from giving one back to the next grant "
+               "(ns) "
+            << wait.Summary();
+}
+
+void rdma_context::PrintOdp() {
+  collie_histogram cold, warm;
+  for (auto ep : endpoints_) {
+    if (!ep || !ep->GetOdpLatency(true)) continue;
+    cold.Merge(*ep->GetOdpLatency(true));
+    warm.Merge(*ep->GetOdpLatency(false));
+  }
+  LOG(INFO) << cold.Count() << " first-touch batches, latency (ns) "
+            << cold.Summary();
+  LOG(INFO) << warm.Count() << " warm batches, latency (ns) "
+            << warm.Summary();
+}
+
+void rdma_context::PrintLatency() {
+  collie_histogram total;
+  for (auto ep : endpoints_) {
+    if (!ep || !ep->GetLatency()) continue;
+    LOG(INFO) << "conn " << ep->GetId() << " latency (ns) "
+              << ep->GetLatency()->Summary();
+    total.Merge(*ep->GetLatency());
+  }
+  LOG(INFO) << "All " << total.Count() << " round trips, latency (ns) "
+            << total.Summary();
+}
+
 }  // namespace Collie
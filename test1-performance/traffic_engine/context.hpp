@@ -7,23 +7,28 @@
 
 #ifndef RDMA_CONTEXT_HPP
 #define RDMA_CONTEXT_HPP
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <mutex>
 #include <queue>
 #include <sstream>
 #include <string>
 #include <vector>
 
+#include "ah.hpp"
+#include "distribution.hpp"
 #include "endpoint.hpp"
+#include "handshake.hpp"
 #include "helper.hpp"
 #include "memory.hpp"
+#include "odp.hpp"
+#include "trace.hpp"
+#include "worker.hpp"
+#include "workload.hpp"
 
 namespace Collie {
 
-union collie_cq {
-  struct ibv_cq *cq;
-  struct ibv_cq_ex *cq_ex;
-};
-
 class rdma_context {
  private:
   void *master_ = nullptr;
@@ -45,6 +50,9 @@ class rdma_context {
   std::vector<struct ibv_pd *> pds_;
   std::vector<std::vector<rdma_region *>> local_mempool_ =
       std::vector<std::vector<rdma_region *>>(2);
+  // The order PickNextBuffer() walks each pool in, flattened once so the
+  // datapath only moves a cursor. 0 for send buffers, 1 for recv buffers.
+  std::vector<rdma_slot> rotation_[2];
   std::vector<std::vector<rdma_buffer *>> remote_mempools_;
   std::mutex rmem_lock_;
   // For each remote host, we have a single mempool for it
@@ -52,8 +60,41 @@ class rdma_context {
   // Transportation
   std::vector<union collie_cq> send_cqs_;
   std::vector<union collie_cq> recv_cqs_;
-  // For hardware timestamp
-  std::vector<uint64_t> nic_process_time_;
+  // Completion channels, one per worker unless --poll_mode=busy
+  std::vector<struct ibv_comp_channel *> channels_;
+  // With --srq, each worker owns FLAGS_srq_num SRQs
+  std::vector<rdma_srq *> srqs_;
+
+  // Startup time of each phase of Init(), in us
+  std::vector<std::pair<const char *, uint64_t>> laps_;
+  uint64_t lap_ts_ = 0;
+  void Lap(const char *phase);
+  void PrintStartup();
+
+  // --local_addr/--remote_addr zipf page tables, shared by the endpoints
+  rdma_zipf_tables zipf_tables_;
+  // UD address handles, shared by the endpoints to one peer
+  rdma_ah_cache ah_cache_;
+  // Queues the AHs of endpoints [left, right) to the peer
+  void PrefetchAhs(int left, int right, const union ibv_gid &remote_gid);
+
+  // --odp: the send pages the datapath has touched
+  rdma_page_map *page_map_ = nullptr;
+  // Size of every local buffer, after InitMemory() grew it
+  uint32_t buf_size_ = 0;
+  // --size_dist, shared read-only by the endpoints
+  rdma_size_dist *size_dist_ = nullptr;
+  // Compiled --workload file, shared read-only by the workers
+  rdma_workload *workload_ = nullptr;
+  // --trace_replay, one trace per worker
+  std::vector<rdma_trace_reader *> traces_;
+
+  // Datapath threads. Each worker owns a contiguous range of endpoints.
+  std::vector<rdma_worker *> workers_;
+  int num_of_workers_ = 1;
+
+  // NIC clock minus Now64Ns(), refreshed by ClockHandler() with --hw_ts
+  std::atomic<int64_t> nic_clock_offset_{0};
 
   std::vector<rdma_endpoint *> endpoints_;
   std::vector<int> request_size_;
@@ -64,11 +105,22 @@ class rdma_context {
   bool share_pd_ = false;
   enum ibv_wr_opcode opcode_ = IBV_WR_RDMA_WRITE;
 
-  int num_of_recv_ = 0;
-  std::mutex numlock_;
+  // Largest WRITE/READ of the client, -1 until CheckRemoteBuffers() needs it
+  int64_t rdma_bytes_ = -1;
+
+  // Endpoints handed out to clients so far, reserved by CAS
+  std::atomic<int> num_of_recv_{0};
+  // The activation pool of Listen(): accepted connections waiting for
+  // StartAccepted() and those back from it, signalled on accept_wake_
+  std::mutex accept_lock_;
+  std::condition_variable accept_cv_;
+  std::deque<rdma_accept *> to_activate_;
+  std::deque<rdma_accept *> activated_;
+  int accept_wake_ = -1;
 
   bool _print_thp;
   uint32_t current_buf_id_ = 0;
+  std::mutex buf_lock_;
   rdma_buffer *CreateBufferFromInfo(struct connect_info *info);
   void SetInfoByBuffer(struct connect_info *info, rdma_buffer *buf);
   void SetEndpointInfo(rdma_endpoint *endpoint, struct connect_info *info);
@@ -83,20 +135,76 @@ class rdma_context {
   int InitCuda();
 #endif
   int InitMemory();
+  // Allocates and registers the regions in parallel (--reg_threads).
+  // Returns how many succeeded before the first failure; the regions from
+  // there on are freed and deleted.
+  size_t AllocateRegions(const std::vector<rdma_region *> &regions);
+  void InitRotation(int idx);
+  // -1 when the device does not tell
+  int ReadNicNuma();
+  // Pages pinned per MR, and MRs that ended up on another node than the NIC
+  void ReportMemory(int nic_numa);
+  int InitSrqs();
+  int InitWorkload();
+  int InitTraces();
   int InitTransport();
+  int InitWorkers();
 
-  int ConnectionSetup(const char *server, int port);
-  int AcceptHandler(int connfd);
-
-  int PollEach(struct ibv_cq *cq);
-  int PollEachEx(struct ibv_cq_ex *cq_ex);
-  int ParseEachEx(struct ibv_cq_ex *cq_ex);
-  int PollCompletion();
+  // Steps of the client handshake, see ConnectAll()
+  int BuildHello(int connid, std::vector<connect_info> *hello);
+  // Takes the buffers and QPs of the reply and activates our QPs
+  int AcceptReply(int connid, std::vector<connect_info> &reply,
+                  union ibv_gid *remote_gid);
+  // The server is ready: hand the endpoints over to their workers
+  void StartEndpoints(int connid);
+  // Steps of the server handshake, driven by the acceptor in Listen().
+  // StepAccept() returns 1 while the handshake goes on, 0 once it is done,
+  // -1 on failures and 2 when the QPs are to be brought up: the connection
+  // is then off the epoll set until ActivateAccepted() is through with it.
+  int StepAccept(rdma_accept *conn);
+  // A thread of the activation pool
+  void ActivateAccepted();
+  // Reserves the endpoints and packs the reply (1) or a reject (0)
+  int ServeHello(rdma_accept *conn, std::vector<connect_info> &hello);
+  int StartAccepted(rdma_accept *conn);
+  // The first of n endpoints handed to a client, -1 when there are not
+  // enough left
+  int ReserveEndpoints(int n);
+  // For --mw_window, a local buffer we advertise
+  struct ibv_mw_bind_info BindTarget(rdma_buffer *buf);
+  // The memory window and first receives of server endpoint i, once its
+  // QP is up
+  int PrepareReceiver(int i, const std::vector<rdma_request> &reqs,
+                      const std::vector<struct ibv_mw_bind_info> &targets);
+  // --cm: endpoints whose connection request failed after they were
+  // reserved, handed out again first. Only the ListenCm() thread uses it.
+  std::vector<int> cm_spare_;
+  // --cm: server side of one connection request
+  int ServeCmRequest(struct rdma_cm_event *event,
+                     const std::vector<rdma_request> &reqs);
+  int AsyncEventHandler();
+  // --hw_ts: keeps nic_clock_offset_ fresh and reports NIC process time
+  int RefreshNicClock();
+  int ClockHandler();
+  // --latency: per-QP and aggregated round-trip time at the end of a run
+  void PrintLatency();
+  void PrintOdp();
+  void PrintWindows(uint64_t elapsed_us);
+  // The MR of pool idx that holds addr
+  struct ibv_mr *FindMr(int idx, uint64_t addr);
 
   std::string GidToIP(
       const union ibv_gid &gid);  // Translate local gid to a IP string.
+  // Without an argument: --request, and --receive unless the workload
+  // file has its own
   std::vector<rdma_request> ParseReqFromStr();
+  // Fails unless the largest WRITE/READ we may post (--request, --workload,
+  // --size_dist) fits the smallest of the buffers a server advertised
+  int CheckRemoteBuffers(const std::vector<rdma_buffer *> &buffers,
+                         const std::string &server);
   std::vector<rdma_request> ParseRecvFromStr();
+  std::vector<rdma_request> ParseReqFromStr(const std::string &str);
+  std::vector<rdma_request> ParseRecvFromStr(const std::string &str);
 
  public:
   rdma_context(const char *dev_name, int gid_idx, int num_of_hosts,
@@ -110,17 +218,25 @@ class rdma_context {
 
   // Connection Setup: Server side
   int Listen();
+  // --cm: accepts RDMA-CM connections instead
+  int ListenCm();
   int ServerDatapath();
 
   // Connection Setup: Client side
-  int Connect(const char *server, int port, int connid);
+  // Dials all servers at once, server i getting the endpoints of connid i.
+  // Failed peers do not hold up the others. Returns how many connected.
+  int ConnectAll(const std::vector<std::string> &servers, int port);
+  // --cm: the same with one RDMA-CM connection per QP
+  int ConnectCm(const std::vector<std::string> &servers, int port);
   int ClientDatapath();
 
-  // Assitant function: Randomly choose a buffer
+  // Assitant function: choose buffers round-robin over MRs
   // 0 indicates send buffer
   // 1 indicates recv buffer
+  // Only for connection setup. The datapath walks rotation_ instead.
   rdma_buffer *PickNextBuffer(int idx) {
     if (idx != 0 && idx != 1) return nullptr;
+    std::lock_guard<std::mutex> guard(buf_lock_);
     if (local_mempool_[idx].empty()) return nullptr;
     auto buf = local_mempool_[idx][current_buf_id_]->GetBuffer();
     current_buf_id_++;
@@ -128,15 +244,25 @@ class rdma_context {
     return buf;
   }
 
+  // Endpoints are split into contiguous ranges, one per worker
+  int WorkerOf(int id) {
+    return (int64_t)id * num_of_workers_ / (num_of_hosts_ * num_per_host_);
+  }
+  // With --share_cq, the endpoints of one worker share a CQ
+  int CqIndex(int id) { return share_cq_ ? WorkerOf(id) : id; }
+  int SrqIndex(int id) {
+    return WorkerOf(id) * FLAGS_srq_num + id % FLAGS_srq_num;
+  }
+
   struct ibv_cq *GetSendCq(int id) {
-    if (share_cq_) id = 0;
+    id = CqIndex(id);
     if (FLAGS_hw_ts)
       return ibv_cq_ex_to_cq(send_cqs_[id].cq_ex);
     else
       return send_cqs_[id].cq;
   }
   struct ibv_cq *GetRecvCq(int id) {
-    if (share_cq_) id = 0;
+    id = CqIndex(id);
     if (FLAGS_hw_ts)
       return ibv_cq_ex_to_cq(recv_cqs_[id].cq_ex);
     else
@@ -146,6 +272,20 @@ class rdma_context {
     if (share_pd_) return pds_[0];
     return pds_[id];
   }
+  const std::vector<rdma_slot> &GetRotation(int idx) { return rotation_[idx]; }
+  const std::vector<rdma_buffer *> &GetRemoteMempool(int id) {
+    return remote_mempools_[id];
+  }
+  struct ibv_context *GetContext() { return ctx_; }
+  const rdma_size_dist *GetSizeDist() { return size_dist_; }
+  uint32_t GetBufSize() { return buf_size_; }
+  rdma_page_map *GetPageMap() { return page_map_; }
+  rdma_ah_cache *GetAhCache() { return &ah_cache_; }
+  rdma_zipf_tables *GetZipfTables() { return &zipf_tables_; }
+  int64_t GetNicClockOffset() {
+    return nic_clock_offset_.load(std::memory_order_relaxed);
+  }
+  bool GetPrintThp() { return _print_thp; }
   std::string GetIp() { return local_ip_; }
 };
 }  // namespace Collie
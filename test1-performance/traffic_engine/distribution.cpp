@@ -0,0 +1,167 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+#include "distribution.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+
+namespace Collie {
+
+// Log-uniform: this many ranges per power of 2
+static constexpr int kLogSteps = 8;
+
+int rdma_size_dist::Init(const std::string &spec) {
+  std::vector<uint32_t> lo, hi;
+  std::vector<double> weights;
+  auto kind = spec.substr(0, spec.find(':'));
+  auto args = spec.substr(kind.size() + (kind.size() < spec.size()));
+  if (kind == "cdf") {
+    if (LoadCdf(args, &lo, &hi, &weights)) return -1;
+    return Build(lo, hi, weights);
+  }
+  std::vector<double> values;
+  std::stringstream ss(args);
+  double value;
+  while (ss >> value) {
+    values.push_back(value);
+    if (ss.peek() == ':') ss.ignore();
+  }
+  double zipf_s = 0;
+  if (kind == "zipf" && values.size() == 3) {
+    zipf_s = values[0];
+    values.erase(values.begin());
+  }
+  if (values.size() != 2 || values[0] < 1 || values[1] < values[0]) {
+    LOG(ERROR) << "Bad size distribution " << spec;
+    return -1;
+  }
+  uint32_t min = values[0], max = values[1];
+  if (kind == "uniform") {
+    lo.push_back(min);
+    hi.push_back(max);
+    weights.push_back(1);
+  } else if (kind == "loguniform") {
+    // Equal weight per equal log width
+    auto step = std::pow(2.0, 1.0 / kLogSteps);
+    for (double a = min; a < max + 1.0;) {
+      double b = std::min<double>(a * step, max + 1.0);
+      auto l = (uint32_t)std::ceil(a), h = (uint32_t)std::ceil(b) - 1;
+      if (h >= l) {
+        lo.push_back(l);
+        hi.push_back(h);
+        weights.push_back(std::log(b / a));
+      }
+      a = b;
+    }
+  } else if (kind == "zipf") {
+    // Powers of 2 only, so round min up to the first of them
+    uint64_t first = 1;
+    while (first < min) first *= 2;
+    if (first > max) {
+      LOG(ERROR) << "No power of 2 in [" << min << ", " << max << "] for "
+                 << spec;
+      return -1;
+    }
+    int rank = 1;
+    for (uint64_t size = first; size <= max; size *= 2, rank++) {
+      lo.push_back(size);
+      hi.push_back(size);
+      weights.push_back(1.0 / std::pow(rank, zipf_s));
+    }
+  } else {
+    LOG(ERROR) << "Unknown size distribution " << kind;
+    return -1;
+  }
+  return Build(lo, hi, weights);
+}
+
+int rdma_size_dist::InitIndex(const std::vector<double> &weights) {
+  std::vector<uint32_t> index(weights.size());
+  for (size_t i = 0; i < index.size(); i++) index[i] = i;
+  return Build(index, index, weights);
+}
+
+int rdma_size_dist::LoadCdf(const std::string &path, std::vector<uint32_t> *lo,
+                            std::vector<uint32_t> *hi,
+                            std::vector<double> *weights) {
+  std::ifstream file(path);
+  if (!file) {
+    PLOG(ERROR) << "Cannot open size CDF " << path;
+    return -1;
+  }
+  std::string line;
+  double prev_size = 0, prev_cdf = 0;
+  while (std::getline(file, line)) {
+    std::stringstream ss(line);
+    double size, cdf;
+    if (line.empty() || line[0] == '#' || !(ss >> size >> cdf)) continue;
+    if (size < 1 || size < prev_size || cdf < prev_cdf) {
+      LOG(ERROR) << "The CDF in " << path << " is not monotonic at " << line;
+      return -1;
+    }
+    if (cdf > prev_cdf) {
+      // The mass between two points spreads over (prev_size, size]
+      lo->push_back(prev_size ? prev_size + 1 : size);
+      hi->push_back(size);
+      weights->push_back(cdf - prev_cdf);
+    }
+    prev_size = size;
+    prev_cdf = cdf;
+  }
+  if (lo->empty()) {
+    LOG(ERROR) << "No CDF points in " << path;
+    return -1;
+  }
+  return 0;
+}
+
+int rdma_size_dist::Build(const std::vector<uint32_t> &lo,
+                          const std::vector<uint32_t> &hi,
+                          const std::vector<double> &weights) {
+  auto n = weights.size();
+  double total = 0;
+  for (auto w : weights) total += w;
+  if (!n || total <= 0) {
+    LOG(ERROR) << "The size distribution is empty";
+    return -1;
+  }
+  // Vose's alias method
+  table_.assign(n, entry());
+  std::vector<double> scaled(n);
+  std::vector<uint32_t> small, large;
+  max_ = 0;
+  mean_ = 0;
+  for (size_t i = 0; i < n; i++) {
+    table_[i].lo = lo[i];
+    table_[i].span = hi[i] - lo[i] + 1;
+    table_[i].alias = i;
+    scaled[i] = weights[i] * n / total;
+    (scaled[i] < 1 ? small : large).push_back(i);
+    max_ = std::max(max_, hi[i]);
+    mean_ += weights[i] / total * (lo[i] + hi[i]) / 2.0;
+  }
+  while (!small.empty() && !large.empty()) {
+    auto s = small.back(), l = large.back();
+    small.pop_back();
+    table_[s].prob = (uint32_t)(scaled[s] * 4294967296.0);
+    table_[s].alias = l;
+    scaled[l] -= 1 - scaled[s];
+    if (scaled[l] < 1) {
+      large.pop_back();
+      small.push_back(l);
+    }
+  }
+  // Leftovers are 1 up to rounding: always keep them
+  for (auto i : small) table_[i].prob = UINT32_MAX;
+  for (auto i : large) table_[i].prob = UINT32_MAX;
+  return 0;
+}
+
+}  // namespace Collie
@@ -0,0 +1,66 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+#ifndef RDMA_DISTRIBUTION_HPP
+#define RDMA_DISTRIBUTION_HPP
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "helper.hpp"
+
+namespace Collie {
+
+// A message size distribution for --size_dist. The sizes are cut into
+// ranges (one for uniform, several per octave for log-uniform, one per size
+// for Zipf, one per CDF step for a trace) and an alias table picks a range
+// in O(1); the size is then uniform inside the range. A draw is two PRNG
+// calls and two table loads.
+//
+//   uniform:<min>:<max>
+//   loguniform:<min>:<max>
+//   zipf:<s>:<min>:<max>   sizes are the powers of 2 in [min, max], the
+//                          smallest being the most popular
+//   cdf:<file>             "<size> <cdf>" per line, e.g., websearch/Hadoop
+//
+// InitIndex() builds a plain discrete distribution instead: Sample() then
+// returns i with probability weights[i] / sum(weights).
+class rdma_size_dist {
+ private:
+  struct entry {
+    uint32_t prob;   // Keep this range if the coin is below prob / 2^32
+    uint32_t alias;  // Otherwise take this one
+    uint32_t lo;
+    uint32_t span;  // hi - lo + 1
+  };
+  std::vector<entry> table_;
+  uint32_t max_ = 0;
+  double mean_ = 0;
+
+  int Build(const std::vector<uint32_t> &lo, const std::vector<uint32_t> &hi,
+            const std::vector<double> &weights);
+  int LoadCdf(const std::string &path, std::vector<uint32_t> *lo,
+              std::vector<uint32_t> *hi, std::vector<double> *weights);
+
+ public:
+  int Init(const std::string &spec);
+  int InitIndex(const std::vector<double> &weights);
+
+  uint32_t Sample(uint64_t *state) const {
+    auto r = FastRand(state);
+    auto idx = (uint32_t)(((r >> 32) * table_.size()) >> 32);
+    auto &e = table_[idx];
+    auto &range = ((uint32_t)r < e.prob) ? e : table_[e.alias];
+    return range.lo + (uint32_t)(((FastRand(state) >> 32) * range.span) >> 32);
+  }
+  uint32_t GetMax() const { return max_; }
+  double GetMean() const { return mean_; }
+};
+
+}  // namespace Collie
+
+#endif
@@ -7,70 +7,294 @@
 
 #include "endpoint.hpp"
 
+#include <arpa/inet.h>
+
+#include <algorithm>
+
 #include "context.hpp"
 
 namespace Collie {
-int rdma_endpoint::PostSend(const std::vector<rdma_request> &requests,
-                            size_t &req_idx, uint32_t batch_size,
-                            const std::vector<rdma_buffer *> &remote_buffer) {
-  struct ibv_send_wr wr_list[kMaxBatch];
-  struct ibv_sge sgs[kMaxBatch][kMaxSge];
-  size_t rbuf_idx = 0;
-  for (uint32_t i = 0; i < batch_size; i++) {
+// The ring holds at least kMaxBatch WRs and a whole number of request
+// vectors, so slot i always carries request i % requests.size() and a batch
+// never laps itself.
+static size_t RingSize(size_t num_of_requests) {
+  auto laps = (kMaxBatch + num_of_requests - 1) / num_of_requests;
+  return num_of_requests * laps;
+}
+
+static bool CanInline(enum ibv_wr_opcode opcode, uint32_t size) {
+#ifdef GDR
+  return size <= kInlineThresh && opcode != IBV_WR_RDMA_READ &&
+         !FLAGS_use_cuda;
+#else
+  return size <= kInlineThresh && opcode != IBV_WR_RDMA_READ;
+#endif
+}
+
+int rdma_endpoint::BuildSendRing(const std::vector<rdma_request> &requests) {
+  if (requests.empty()) {
+    LOG(ERROR) << "The send request vector is empty";
+    return -1;
+  }
+  auto n = RingSize(requests.size());
+  send_ring_.assign(n, ibv_send_wr());
+  send_sges_.assign(n * kMaxSge, ibv_sge());
+  send_bytes_.assign(n, 0);
+  for (size_t i = 0; i < n; i++) {
+    auto &req = requests[i % requests.size()];
+    auto &wr = send_ring_[i];
+    if (req.sge_num > kMaxSge) {
+      LOG(ERROR) << "Too many SGEs in one request: " << req.sge_num << " > "
+                 << kMaxSge;
+      return -1;
+    }
     int wr_size = 0;
-    auto &req = requests[req_idx];
+    wr.sg_list = &send_sges_[i * kMaxSge];
     for (int j = 0; j < req.sge_num; j++) {
-      sgs[i][j].addr = req.sglist[j].addr;
-      sgs[i][j].lkey = req.sglist[j].lkey;
-      sgs[i][j].length = req.sglist[j].length;
-      bytes_sent_now_ += sgs[i][j].length;
-      wr_size += sgs[i][j].length;
-    }
-    memset(&wr_list[i], 0, sizeof(struct ibv_send_wr));
-    wr_list[i].num_sge = req.sge_num;
-    wr_list[i].opcode = (enum ibv_wr_opcode)req.opcode;
-    switch (wr_list[i].opcode) {
+      wr.sg_list[j] = req.sglist[j];
+      wr_size += req.sglist[j].length;
+    }
+    send_bytes_[i] = wr_size;
+    wr.num_sge = req.sge_num;
+    wr.opcode = (enum ibv_wr_opcode)req.opcode;
+    switch (wr.opcode) {
       case IBV_WR_RDMA_WRITE_WITH_IMM:
-        wr_list[i].imm_data = 0xdeadbeaf;
+        wr.imm_data = 0xdeadbeaf;
       case IBV_WR_RDMA_WRITE:
       case IBV_WR_RDMA_READ:
-        wr_list[i].wr.rdma.remote_addr = remote_buffer[rbuf_idx]->addr_;
-        wr_list[i].wr.rdma.rkey = remote_buffer[rbuf_idx]->remote_K_;
         break;
       case IBV_WR_SEND_WITH_IMM:
-        wr_list[i].imm_data = 0xfeedbeee;
+        wr.imm_data = 0xfeedbeee;
       case IBV_WR_SEND:
         if (qp_type_ == IBV_QPT_UD) {
-          wr_list[i].wr.ud.remote_qkey = 0;
-          wr_list[i].wr.ud.remote_qpn = remote_qpn_;
-          wr_list[i].wr.ud.ah = (ibv_ah *)context_;
+          wr.wr.ud.remote_qkey = 0;
+          wr.wr.ud.remote_qpn = remote_qpn_;
+          wr.wr.ud.ah = (ibv_ah *)context_;
         }
         break;
       default:
         LOG(ERROR) << "Currently not supporting other operation type: "
-                   << wr_list[i].opcode;
+                   << wr.opcode;
         return -1;
     }
-    wr_list[i].send_flags = (i == batch_size - 1) ? IBV_SEND_SIGNALED : 0;
     // Inline if we can
-#ifdef GDR
-    if (wr_size <= kInlineThresh && wr_list[i].opcode != IBV_WR_RDMA_READ &&
-        !FLAGS_use_cuda)
-      wr_list[i].send_flags |= IBV_SEND_INLINE;
-#else
-    if (wr_size <= kInlineThresh && wr_list[i].opcode != IBV_WR_RDMA_READ)
-      wr_list[i].send_flags |= IBV_SEND_INLINE;
-#endif
-    wr_list[i].wr_id = (uint64_t)this;
-    wr_list[i].sg_list = sgs[i];
-    wr_list[i].next = (i == batch_size - 1) ? nullptr : &wr_list[i + 1];
-    msgs_sent_now_++;
-    rbuf_idx = (rbuf_idx == remote_buffer.size() - 1) ? 0 : rbuf_idx + 1;
-    req_idx = (req_idx == requests.size() - 1) ? 0 : req_idx + 1;
+    if (CanInline(wr.opcode, wr_size)) wr.send_flags |= IBV_SEND_INLINE;
+    wr.wr_id = (uint64_t)this;
+    wr.next = &send_ring_[(i + 1) % n];
+  }
+  send_pos_ = 0;
+  if (InitSendSlots()) return -1;
+  size_dist_ = ((rdma_context *)master_)->GetSizeDist();
+  size_rand_ = SeedRand(id_);
+  // The ring is (re)built lazily and after every Activate(): restart the
+  // prefetch cursor on it
+  if (prefetch_) StartPrefetch();
+  return 0;
+}
+
+int rdma_endpoint::InitSendSlots() {
+  // Stagger the endpoints so they do not walk the buffers in lockstep
+  auto &rotation = ((rdma_context *)master_)->GetRotation(0);
+  if (rotation.empty()) {
+    LOG(ERROR) << "No send buffer to post from";
+    return -1;
+  }
+  send_slots_ = rotation.data();
+  pages_ = ((rdma_context *)master_)->GetPageMap();
+  return local_addr_.Init(FLAGS_local_addr, rotation.size(),
+                          ((rdma_context *)master_)->GetBufSize(), id_,
+                          ((rdma_context *)master_)->GetZipfTables());
+}
+
+void rdma_endpoint::SetPrefetcher(rdma_prefetcher *prefetch) {
+  prefetch_ = prefetch;
+  if (!send_ring_.empty()) StartPrefetch();
+}
+
+void rdma_endpoint::StartPrefetch() {
+  // Same state and cursor: ahead_ picks what local_addr_ will pick
+  ahead_ = local_addr_;
+  ahead_pos_ = send_pos_;
+  for (int i = 0; i < FLAGS_prefetch_window; i++) PrefetchAhead();
+}
+
+void rdma_endpoint::PrefetchAhead() {
+  // The lengths are those of the template, which --size_dist overwrites
+  // later, so the offsets of some strategies are approximate
+  auto &wr = send_ring_[ahead_pos_];
+  ahead_pos_ = (ahead_pos_ == send_ring_.size() - 1) ? 0 : ahead_pos_ + 1;
+  size_t unit;
+  uint32_t offset;
+  for (int j = 0; j < wr.num_sge; j++) {
+    ahead_.Pick(wr.sg_list[j].length, &unit, &offset);
+    prefetch_->Push(send_slots_[unit].addr + offset, wr.sg_list[j].length,
+                    send_slots_[unit].lkey);
+  }
+}
+
+int rdma_endpoint::InitRemoteAddr(
+    const std::vector<rdma_buffer *> &remote_buffer) {
+  if (remote_buffer.empty()) {
+    LOG(ERROR) << "No remote buffer to post to";
+    return -1;
+  }
+  // Offsets must fit the smallest buffer the peer told us about
+  uint32_t size = remote_buffer[0]->size_;
+  for (auto buf : remote_buffer) size = std::min(size, buf->size_);
+  // Or a WRITE/READ would run past it, whatever the offset
+  uint64_t largest = 0;
+  for (size_t i = 0; i < send_ring_.size(); i++) {
+    auto &wr = send_ring_[i];
+    if (wr.opcode == IBV_WR_SEND || wr.opcode == IBV_WR_SEND_WITH_IMM) continue;
+    uint64_t bytes = send_bytes_[i];
+    if (size_dist_) bytes = (uint64_t)wr.num_sge * size_dist_->GetMax();
+    largest = std::max(largest, bytes);
+  }
+  if (largest > size) {
+    LOG(ERROR) << "Endpoint " << id_ << " may WRITE/READ " << largest
+               << " bytes, but the remote buffers hold " << size
+               << "; give the server --buf_size=" << largest;
+    return -1;
+  }
+  return remote_addr_.Init(FLAGS_remote_addr, remote_buffer.size(), size,
+                           id_ + 1, ((rdma_context *)master_)->GetZipfTables());
+}
+
+void rdma_endpoint::DrawSizes(struct ibv_send_wr *wr) {
+  uint32_t bytes = 0;
+  for (int j = 0; j < wr->num_sge; j++) {
+    wr->sg_list[j].length = size_dist_->Sample(&size_rand_);
+    bytes += wr->sg_list[j].length;
+  }
+  if (CanInline(wr->opcode, bytes))
+    wr->send_flags |= IBV_SEND_INLINE;
+  else
+    wr->send_flags &= ~IBV_SEND_INLINE;
+  send_bytes_[send_pos_] = bytes;
+}
+
+int rdma_recv_ring::Build(const std::vector<rdma_request> &requests,
+                          const std::vector<rdma_slot> &rotation,
+                          size_t start, uint64_t wr_id) {
+  if (requests.empty()) {
+    LOG(ERROR) << "The receive request vector is empty";
+    return -1;
+  }
+  if (rotation.empty()) {
+    LOG(ERROR) << "No receive buffer to post into";
+    return -1;
   }
+  auto n = RingSize(requests.size());
+  wrs_.assign(n, ibv_recv_wr());
+  sges_.assign(n * kMaxSge, ibv_sge());
+  for (size_t i = 0; i < n; i++) {
+    auto &req = requests[i % requests.size()];
+    auto &wr = wrs_[i];
+    if (req.sge_num > kMaxSge) {
+      LOG(ERROR) << "Too many SGEs in one request: " << req.sge_num << " > "
+                 << kMaxSge;
+      return -1;
+    }
+    wr.sg_list = &sges_[i * kMaxSge];
+    for (int j = 0; j < req.sge_num; j++) {
+      wr.sg_list[j] = req.sglist[j];
+      wr.sg_list[j].length = req.sglist[j].length + kUdAddition;
+    }
+    wr.num_sge = req.sge_num;
+    wr.wr_id = wr_id;
+    wr.next = &wrs_[(i + 1) % n];
+  }
+  pos_ = 0;
+  slots_ = rotation.data();
+  slot_num_ = rotation.size();
+  slot_ = start % slot_num_;
+  return 0;
+}
+
+struct ibv_recv_wr *rdma_recv_ring::Cut(uint32_t batch_size) {
+  struct ibv_recv_wr *head = &wrs_[pos_];
+  for (uint32_t i = 0; i < batch_size; i++) {
+    tail_ = &wrs_[pos_];
+    for (int j = 0; j < tail_->num_sge; j++) {
+      auto &slot = slots_[slot_];
+      tail_->sg_list[j].addr = slot.addr;
+      tail_->sg_list[j].lkey = slot.lkey;
+      slot_ = (slot_ == slot_num_ - 1) ? 0 : slot_ + 1;
+    }
+    pos_ = (pos_ == wrs_.size() - 1) ? 0 : pos_ + 1;
+  }
+  tail_next_ = tail_->next;
+  tail_->next = nullptr;
+  return head;
+}
+
+uint64_t rdma_endpoint::NextBatchBytes(
+    const std::vector<rdma_request> &requests, uint32_t batch_size) {
+  if (send_ring_.empty() && BuildSendRing(requests)) return 0;
+  uint64_t bytes = 0;
+  auto pos = send_pos_;
+  for (uint32_t i = 0; i < batch_size; i++) {
+    bytes += send_bytes_[pos];
+    pos = (pos == send_ring_.size() - 1) ? 0 : pos + 1;
+  }
+  return bytes;
+}
+
+int rdma_endpoint::PostSend(const std::vector<rdma_request> &requests,
+                            uint32_t batch_size,
+                            const std::vector<rdma_buffer *> &remote_buffer) {
+  if (!batch_size) return 0;
+  if (send_ring_.empty() && BuildSendRing(requests)) return -1;
+  if (!remote_addr_.Ready() && InitRemoteAddr(remote_buffer)) return -1;
+  struct ibv_send_wr *head = &send_ring_[send_pos_];
+  struct ibv_send_wr *tail = nullptr;
+  uint64_t now = trace_ ? NowCycles() : 0;
+  uint32_t dyn_count = 0;
+  bool cold = false;
+  for (uint32_t i = 0; i < batch_size; i++) {
+    tail = &send_ring_[send_pos_];
+    // Sizes first: the strategies leave room for the SGE behind the offset
+    if (size_dist_) DrawSizes(tail);
+    size_t unit = 0;
+    uint32_t offset = 0;
+    for (int j = 0; j < tail->num_sge; j++) {
+      if (dyn_) {
+        rdma_dyn_buf buf;
+        if (dyn_->Acquire(&tail->sg_list[j], &buf)) return -1;
+        dyn_bufs_.push(buf);
+        continue;
+      }
+      local_addr_.Pick(tail->sg_list[j].length, &unit, &offset);
+      tail->sg_list[j].addr = send_slots_[unit].addr + offset;
+      tail->sg_list[j].lkey = send_slots_[unit].lkey;
+      if (pages_)
+        cold |= pages_->Touch(tail->sg_list[j].addr, tail->sg_list[j].length);
+    }
+    if (prefetch_ && !dyn_) PrefetchAhead();
+    dyn_count += dyn_ ? tail->num_sge : 0;
+    unit = 0;
+    offset = 0;
+    if (tail->opcode != IBV_WR_SEND && tail->opcode != IBV_WR_SEND_WITH_IMM) {
+      remote_addr_.Pick(send_bytes_[send_pos_], &unit, &offset);
+      // The granted window covers one buffer, the server's turn
+      if (mw_rkey_) unit = (windows_ - 1) % remote_buffer.size();
+      tail->wr.rdma.remote_addr = remote_buffer[unit]->addr_ + offset;
+      tail->wr.rdma.rkey = mw_rkey_ ? mw_rkey_ : remote_buffer[unit]->remote_K_;
+    }
+    if (trace_ && trace_->Record(now, id_, tail, unit, offset,
+                                 i == batch_size - 1))
+      return -1;
+    bytes_sent_now_ += send_bytes_[send_pos_];
+    send_pos_ = (send_pos_ == send_ring_.size() - 1) ? 0 : send_pos_ + 1;
+  }
+  msgs_sent_now_ += batch_size;
+  // Cut the ring behind the tail and signal it, then restore the template
+  auto tail_next = tail->next;
+  tail->next = nullptr;
+  tail->send_flags |= IBV_SEND_SIGNALED;
   struct ibv_send_wr *bad_wr = nullptr;
 #ifdef DEBUG
-  auto wr_p = &wr_list[0];
+  auto wr_p = head;
   int wr_cnt = 0;
   while (wr_p) {
     for (auto i = 0; i < wr_p->num_sge; i++) {
@@ -84,42 +308,155 @@ int rdma_endpoint::PostSend(const std::vector<rdma_request> &requests,
     wr_cnt++;
   }
 #endif
-  if (ibv_post_send(qp_, wr_list, &bad_wr)) {
+  auto ret = qpx_ ? PostSendEx(head) : ibv_post_send(qp_, head, &bad_wr);
+  tail->next = tail_next;
+  tail->send_flags &= ~IBV_SEND_SIGNALED;
+  if (ret) {
     PLOG(ERROR) << "ibv_post_send() failed";
     return -1;
   }
   send_credits_ -= batch_size;
   send_batch_size_.push(batch_size);
+  if (dyn_) dyn_batch_bufs_.push(dyn_count);
+  if (pages_) send_cold_.push(cold);
+  if (FLAGS_print_thp || pages_) send_post_ts_.push(Now64Ns());
   return 0;
 }
 
+int rdma_endpoint::PostReplay(const trace_wr *const *records, uint32_t n,
+                              const std::vector<rdma_buffer *> &remote_buffer) {
+  if (!n) return 0;
+  if (!send_slots_ && InitSendSlots()) return -1;
+  struct ibv_send_wr wrs[kMaxBatch];
+  struct ibv_sge sges[kMaxBatch * kMaxSge];
+  memset(wrs, 0, sizeof(struct ibv_send_wr) * n);
+  for (uint32_t i = 0; i < n; i++) {
+    auto rec = records[i];
+    auto &wr = wrs[i];
+    uint32_t bytes = 0;
+    wr.sg_list = &sges[i * kMaxSge];
+    wr.num_sge = rec->num_sge;
+    for (int j = 0; j < wr.num_sge; j++) {
+      size_t unit;
+      uint32_t offset;
+      local_addr_.Pick(rec->Lengths()[j], &unit, &offset);
+      wr.sg_list[j].addr = send_slots_[unit].addr + offset;
+      wr.sg_list[j].lkey = send_slots_[unit].lkey;
+      wr.sg_list[j].length = rec->Lengths()[j];
+      bytes += rec->Lengths()[j];
+    }
+    wr.opcode = (enum ibv_wr_opcode)rec->opcode;
+    switch (wr.opcode) {
+      case IBV_WR_RDMA_WRITE_WITH_IMM:
+        wr.imm_data = 0xdeadbeaf;
+      case IBV_WR_RDMA_WRITE:
+      case IBV_WR_RDMA_READ: {
+        auto rbuf = remote_buffer[rec->rbuf_idx % remote_buffer.size()];
+        // The server of the replay may have smaller buffers than the one
+        // of the recording
+        if ((uint64_t)rec->roffset + bytes > rbuf->size_) {
+          LOG(ERROR) << "Trace WR of " << bytes << " bytes at offset "
+                     << rec->roffset << " overruns a " << rbuf->size_
+                     << "-byte remote buffer";
+          return -1;
+        }
+        wr.wr.rdma.remote_addr = rbuf->addr_ + rec->roffset;
+        wr.wr.rdma.rkey = rbuf->remote_K_;
+        break;
+      }
+      case IBV_WR_SEND_WITH_IMM:
+        wr.imm_data = 0xfeedbeee;
+      case IBV_WR_SEND:
+        if (qp_type_ == IBV_QPT_UD) {
+          wr.wr.ud.remote_qkey = 0;
+          wr.wr.ud.remote_qpn = remote_qpn_;
+          wr.wr.ud.ah = (ibv_ah *)context_;
+        }
+        break;
+      default:
+        LOG(ERROR) << "Unknown opcode " << wr.opcode << " in the trace";
+        return -1;
+    }
+    if (CanInline(wr.opcode, bytes)) wr.send_flags |= IBV_SEND_INLINE;
+    wr.wr_id = (uint64_t)this;
+    wr.next = (i == n - 1) ? nullptr : &wrs[i + 1];
+    bytes_sent_now_ += bytes;
+  }
+  wrs[n - 1].send_flags |= IBV_SEND_SIGNALED;
+  msgs_sent_now_ += n;
+  struct ibv_send_wr *bad_wr = nullptr;
+  if (qpx_ ? PostSendEx(wrs) : ibv_post_send(qp_, wrs, &bad_wr)) {
+    PLOG(ERROR) << "ibv_post_send() failed";
+    return -1;
+  }
+  send_credits_ -= n;
+  send_batch_size_.push(n);
+  if (FLAGS_print_thp) send_post_ts_.push(Now64Ns());
+  return 0;
+}
+
+int rdma_endpoint::PostSendEx(struct ibv_send_wr *head) {
+  struct ibv_data_buf inline_bufs[kMaxSge];
+  ibv_wr_start(qpx_);
+  for (auto wr = head; wr; wr = wr->next) {
+    qpx_->wr_id = wr->wr_id;
+    qpx_->wr_flags = wr->send_flags & ~IBV_SEND_INLINE;
+    switch (wr->opcode) {
+      case IBV_WR_RDMA_WRITE:
+        ibv_wr_rdma_write(qpx_, wr->wr.rdma.rkey, wr->wr.rdma.remote_addr);
+        break;
+      case IBV_WR_RDMA_WRITE_WITH_IMM:
+        ibv_wr_rdma_write_imm(qpx_, wr->wr.rdma.rkey, wr->wr.rdma.remote_addr,
+                              wr->imm_data);
+        break;
+      case IBV_WR_RDMA_READ:
+        ibv_wr_rdma_read(qpx_, wr->wr.rdma.rkey, wr->wr.rdma.remote_addr);
+        break;
+      case IBV_WR_SEND:
+        ibv_wr_send(qpx_);
+        break;
+      case IBV_WR_SEND_WITH_IMM:
+        ibv_wr_send_imm(qpx_, wr->imm_data);
+        break;
+      default:
+        LOG(ERROR) << "Currently not supporting other operation type: "
+                   << wr->opcode;
+        ibv_wr_abort(qpx_);
+        return -1;
+    }
+    if (qp_type_ == IBV_QPT_UD)
+      ibv_wr_set_ud_addr(qpx_, wr->wr.ud.ah, wr->wr.ud.remote_qpn,
+                         wr->wr.ud.remote_qkey);
+    if (wr->send_flags & IBV_SEND_INLINE) {
+      for (int j = 0; j < wr->num_sge; j++) {
+        inline_bufs[j].addr = (void *)wr->sg_list[j].addr;
+        inline_bufs[j].length = wr->sg_list[j].length;
+      }
+      ibv_wr_set_inline_data_list(qpx_, wr->num_sge, inline_bufs);
+    } else {
+      ibv_wr_set_sge_list(qpx_, wr->num_sge, wr->sg_list);
+    }
+  }
+  return ibv_wr_complete(qpx_);
+}
+
 int rdma_endpoint::PostRecv(const std::vector<rdma_request> &requests,
-                            size_t &req_idx, uint32_t batch_size) {
-  rdma_context *ctx = (rdma_context *)master_;
+                            uint32_t batch_size) {
   if (recv_credits_ < batch_size) {
     LOG(ERROR) << "PostRecv() failed. Credit not available: " << recv_credits_
                << " is less than " << batch_size;
     return -1;
   }
-  struct ibv_sge sg[kMaxBatch][kMaxSge];
-  struct ibv_recv_wr wr[kMaxBatch];
+  if (!batch_size) return 0;
+  // Stagger the endpoints so they do not walk the buffers in lockstep
+  if (recv_ring_.Empty() &&
+      recv_ring_.Build(requests, ((rdma_context *)master_)->GetRotation(1),
+                       id_, reinterpret_cast<uint64_t>(this)))
+    return -1;
+  struct ibv_recv_wr *head = recv_ring_.Cut(batch_size);
   struct ibv_recv_wr *bad_wr;
-  for (uint32_t i = 0; i < batch_size; i++) {
-    auto &req = requests[req_idx];
-    for (int j = 0; j < req.sge_num; j++) {
-      sg[i][j].addr = req.sglist[j].addr;
-      sg[i][j].lkey = req.sglist[j].lkey;
-      sg[i][j].length = req.sglist[j].length + kUdAddition;
-    }
-    memset(&wr[i], 0, sizeof(struct ibv_recv_wr));
-    wr[i].num_sge = req.sge_num;
-    wr[i].sg_list = sg[i];
-    wr[i].next = (i == batch_size - 1) ? nullptr : &wr[i + 1];
-    wr[i].wr_id = reinterpret_cast<uint64_t>(this);
-    req_idx = (req_idx == requests.size() - 1) ? 0 : req_idx + 1;
-  }
 #ifdef DEBUG
-  // struct ibv_recv_wr *wr_list = wr;
+  // struct ibv_recv_wr *wr_list = head;
   // int cnt = 0;
   // while (wr_list != nullptr) {
   //     int num_sge = wr_list->num_sge;
@@ -136,7 +473,9 @@ int rdma_endpoint::PostRecv(const std::vector<rdma_request> &requests,
   // }
 
 #endif
-  if (auto ret = ibv_post_recv(qp_, wr, &bad_wr)) {
+  auto ret = ibv_post_recv(qp_, head, &bad_wr);
+  recv_ring_.Mend();
+  if (ret) {
     PLOG(ERROR) << "ibv_post_recv() failed";
     LOG(ERROR) << "Return value is " << ret;
     return -1;
@@ -147,6 +486,22 @@ int rdma_endpoint::PostRecv(const std::vector<rdma_request> &requests,
   return 0;
 }
 
+int rdma_endpoint::Reset() {
+  struct ibv_qp_attr attr;
+  memset(&attr, 0, sizeof(struct ibv_qp_attr));
+  attr.qp_state = IBV_QPS_RESET;
+  if (ibv_modify_qp(qp_, &attr, IBV_QP_STATE)) {
+    PLOG(ERROR) << "Failed to reset QP " << id_;
+    return -1;
+  }
+  // RESET drops the posted receives without completions
+  recv_credits_ = FLAGS_srq ? 0 : FLAGS_recv_wq_depth;
+  if (mw_) ibv_dealloc_mw(mw_);
+  mw_ = nullptr;
+  mw_rkey_ = 0;
+  return 0;
+}
+
 int rdma_endpoint::RestoreFromERR() {
   struct ibv_qp_attr attr;
   int attr_mask;
@@ -167,6 +522,9 @@ int rdma_endpoint::RestoreFromERR() {
 
 int rdma_endpoint::Activate(const union ibv_gid &remote_gid) {
   remote_gid_ = remote_gid;
+  // The templates carry remote info (e.g., the UD address handle)
+  send_ring_.clear();
+  recv_ring_.Clear();
   struct ibv_qp_attr attr;
   int attr_mask;
   attr = MakeQpAttr(IBV_QPS_INIT, qp_type_, 0, remote_gid, &attr_mask);
@@ -185,23 +543,66 @@ int rdma_endpoint::Activate(const union ibv_gid &remote_gid) {
     return -1;
   }
   if (qp_type_ == IBV_QPT_UD) {
-    struct ibv_ah_attr ah_attr;
-    memset(&ah_attr, 0, sizeof(ah_attr));
+    // Shared with the other endpoints to the peer, usually prefetched
     auto master_ctx = (rdma_context *)master_;
-    ah_attr.dlid = dlid_;
-    ah_attr.is_global = 1;
-    memcpy(&ah_attr.grh.dgid, &remote_gid, sizeof(union ibv_gid));
-    ah_attr.grh.flow_label = 0;
-    ah_attr.grh.sgid_index = FLAGS_gid;
-    ah_attr.grh.hop_limit = FLAGS_hop_limit;
-    ah_attr.grh.traffic_class = FLAGS_tos;
-    ah_attr.sl = remote_sl_;
-    ah_attr.src_path_bits = 0;
-    ah_attr.port_num = 1;
-    // [SEVERE TODO]: when scales up, ibv_create_ah may block and failed.
-    context_ = (void *)ibv_create_ah(master_ctx->GetPd(id_), &ah_attr);
+    context_ = (void *)master_ctx->GetAhCache()->Get(master_ctx->GetPd(id_),
+                                                     MakeAhAttr(remote_gid));
     if (!context_) {
-      PLOG(ERROR) << "ibv_create_ah() failed";
+      LOG(ERROR) << "No address handle for endpoint " << id_;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+struct ibv_ah_attr rdma_endpoint::MakeAhAttr(const union ibv_gid &remote_gid) {
+  struct ibv_ah_attr ah_attr;
+  memset(&ah_attr, 0, sizeof(ah_attr));
+  ah_attr.dlid = dlid_;
+  ah_attr.is_global = 1;
+  memcpy(&ah_attr.grh.dgid, &remote_gid, sizeof(union ibv_gid));
+  ah_attr.grh.flow_label = 0;
+  ah_attr.grh.sgid_index = FLAGS_gid;
+  ah_attr.grh.hop_limit = FLAGS_hop_limit;
+  ah_attr.grh.traffic_class = FLAGS_tos;
+  ah_attr.sl = remote_sl_;
+  ah_attr.src_path_bits = 0;
+  ah_attr.port_num = 1;
+  return ah_attr;
+}
+
+int rdma_endpoint::ActivateCm(struct rdma_cm_id *id, uint8_t initiator_depth,
+                              uint8_t responder_resources) {
+  send_ring_.clear();
+  recv_ring_.Clear();
+  const enum ibv_qp_state states[] = {IBV_QPS_INIT, IBV_QPS_RTR, IBV_QPS_RTS};
+  for (auto state : states) {
+    struct ibv_qp_attr attr;
+    int attr_mask;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = state;
+    if (rdma_init_qp_attr(id, &attr, &attr_mask)) {
+      PLOG(ERROR) << "rdma_init_qp_attr() failed";
+      return -1;
+    }
+    switch (state) {
+      case IBV_QPS_INIT:
+        attr.qp_access_flags |= IBV_ACCESS_REMOTE_WRITE |
+                                IBV_ACCESS_REMOTE_READ |
+                                IBV_ACCESS_REMOTE_ATOMIC;
+        break;
+      case IBV_QPS_RTR:
+        attr.max_dest_rd_atomic = responder_resources;
+        // Kept for RestoreFromERR(), which goes through Activate()
+        remote_gid_ = attr.ah_attr.grh.dgid;
+        remote_qpn_ = attr.dest_qp_num;
+        break;
+      default:
+        attr.max_rd_atomic = initiator_depth;
+        break;
+    }
+    if (ibv_modify_qp(qp_, &attr, attr_mask)) {
+      PLOG(ERROR) << "Failed to modify QP to " << state << " with RDMA-CM";
       return -1;
     }
   }
@@ -212,6 +613,25 @@ int rdma_endpoint::SendHandler(struct ibv_wc *wc) {
   auto update_credits = send_batch_size_.front();
   send_batch_size_.pop();
   send_credits_ += update_credits;
+  if (dyn_) {
+    // The whole batch is done, its buffers may go back
+    for (auto n = dyn_batch_bufs_.front(); n; n--) {
+      dyn_->Release(dyn_bufs_.front());
+      dyn_bufs_.pop();
+    }
+    dyn_batch_bufs_.pop();
+  }
+  if (!send_post_ts_.empty()) {
+    auto lat = Now64Ns() - send_post_ts_.front();
+    lat_sum_ns_ += lat;
+    lat_cnt_++;
+    send_post_ts_.pop();
+    if (!send_cold_.empty()) {
+      (send_cold_.front() ? odp_cold_ : odp_warm_)->Record(lat);
+      send_cold_.pop();
+    }
+  }
+  if (ping_start_ns_ && ping_read_) return PingDone();
   return 0;
 }
 
@@ -221,9 +641,180 @@ int rdma_endpoint::RecvHandler(struct ibv_wc *wc) {
   // recv_batch_size_.pop();
   // recv_credits_ += update_credits;
   recv_credits_++;
+  if (FLAGS_mw_window) {
+    if (mw_) return PostGrant(wc);  // Server: a window is asked for
+    // Client: the grant carries the new rkey
+    if (!(wc->wc_flags & IBV_WC_WITH_IMM)) return 0;
+    mw_rkey_ = ntohl(wc->imm_data);
+    mw_left_ = FLAGS_mw_window;
+    mw_waiting_ = false;
+    windows_++;
+    grant_wait_->Record(Now64Ns() - mw_ask_ns_);
+    return 0;
+  }
+  if (!FLAGS_latency) return 0;
+  if (ping_start_ns_) return PingDone();  // Client: this is the pong
+  return PostPong(wc);                     // Server: answer the ping
+}
+
+int rdma_endpoint::PostPing(const std::vector<rdma_request> &requests,
+                            const std::vector<rdma_buffer *> &remote_buffer) {
+  if (send_ring_.empty() && BuildSendRing(requests)) return -1;
+  ping_read_ = (send_ring_[send_pos_].opcode == IBV_WR_RDMA_READ);
+  ping_start_ns_ = Now64Ns();
+  if (PostSend(requests, 1, remote_buffer)) {
+    ping_start_ns_ = 0;
+    return -1;
+  }
+  return 0;
+}
+
+int rdma_endpoint::PingDone() {
+  latency_->Record(Now64Ns() - ping_start_ns_);
+  ping_start_ns_ = 0;
+  pings_++;
+  return 0;
+}
+
+int rdma_endpoint::PostPong(struct ibv_wc *wc) {
+  if (!send_credits_) {
+    LOG(ERROR) << "No send credit left to answer a ping on conn " << id_;
+    return -1;
+  }
+  auto &rotation = ((rdma_context *)master_)->GetRotation(0);
+  auto &slot = rotation[id_ % rotation.size()];
+  struct ibv_sge sge;
+  sge.addr = slot.addr;
+  sge.lkey = slot.lkey;
+  sge.length = wc->byte_len;
+  if (qp_type_ == IBV_QPT_UD) sge.length -= kUdAddition;  // Skip the GRH
+  struct ibv_send_wr wr, *bad_wr = nullptr;
+  memset(&wr, 0, sizeof(wr));
+  wr.wr_id = (uint64_t)this;
+  wr.sg_list = &sge;
+  wr.num_sge = 1;
+  wr.send_flags = IBV_SEND_SIGNALED;
+  if (sge.length <= kInlineThresh) wr.send_flags |= IBV_SEND_INLINE;
+  if (wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+    auto &remote_buffer = ((rdma_context *)master_)->GetRemoteMempool(rmem_id_);
+    wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+    wr.imm_data = 0xdeadbeaf;
+    wr.wr.rdma.remote_addr = remote_buffer[0]->addr_;
+    wr.wr.rdma.rkey = remote_buffer[0]->remote_K_;
+  } else {
+    wr.opcode = IBV_WR_SEND;
+    if (qp_type_ == IBV_QPT_UD) {
+      wr.wr.ud.remote_qkey = 0;
+      wr.wr.ud.remote_qpn = remote_qpn_;
+      wr.wr.ud.ah = (ibv_ah *)context_;
+    }
+  }
+  auto ret = qpx_ ? PostSendEx(&wr) : ibv_post_send(qp_, &wr, &bad_wr);
+  if (ret) {
+    PLOG(ERROR) << "ibv_post_send() failed";
+    return -1;
+  }
+  send_credits_--;
+  send_batch_size_.push(1);
+  return 0;
+}
+
+int rdma_endpoint::InitWindow(
+    struct ibv_pd *pd, const std::vector<struct ibv_mw_bind_info> &targets) {
+  if (targets.empty()) {
+    LOG(ERROR) << "No buffer to bind a memory window over";
+    return -1;
+  }
+  mw_targets_ = targets;
+  mw_ = ibv_alloc_mw(pd, IBV_MW_TYPE_2);
+  if (!mw_) {
+    PLOG(ERROR) << "ibv_alloc_mw() failed";
+    return -1;
+  }
+  mw_rkey_ = mw_->rkey;
+  return 0;
+}
+
+int rdma_endpoint::PostGrant(struct ibv_wc *wc) {
+  if (send_credits_ < 3) {
+    LOG(ERROR) << "No send credit left to grant a window on conn " << id_;
+    return -1;
+  }
+  struct ibv_send_wr wrs[3], *bad_wr = nullptr;
+  memset(wrs, 0, sizeof(wrs));
+  int n = 0;
+  if (mw_bound_) {
+    if (!(wc->wc_flags & IBV_WC_WITH_INV)) {
+      // --mw_inv=local: a type-2 window has to be invalid to be bound
+      wrs[n].opcode = IBV_WR_LOCAL_INV;
+      wrs[n].invalidate_rkey = mw_rkey_;
+      n++;
+    } else if (wc->invalidated_rkey != mw_rkey_) {
+      LOG(ERROR) << "conn " << id_ << " invalidated rkey 0x" << std::hex
+                 << wc->invalidated_rkey << " instead of 0x" << mw_rkey_;
+      return -1;
+    }
+  }
+  mw_rkey_ = ibv_inc_rkey(mw_rkey_);
+  wrs[n].opcode = IBV_WR_BIND_MW;
+  wrs[n].bind_mw.mw = mw_;
+  wrs[n].bind_mw.rkey = mw_rkey_;
+  wrs[n].bind_mw.bind_info = mw_targets_[windows_ % mw_targets_.size()];
+  n++;
+  // Zero-length: the rkey rides in the immediate
+  wrs[n].opcode = IBV_WR_SEND_WITH_IMM;
+  wrs[n].imm_data = htonl(mw_rkey_);
+  wrs[n].send_flags = IBV_SEND_SIGNALED;
+  n++;
+  for (int i = 0; i < n; i++) {
+    wrs[i].wr_id = (uint64_t)this;
+    wrs[i].next = (i == n - 1) ? nullptr : &wrs[i + 1];
+  }
+  if (ibv_post_send(qp_, wrs, &bad_wr)) {
+    PLOG(ERROR) << "ibv_post_send() failed";
+    return -1;
+  }
+  mw_bound_ = true;
+  windows_++;
+  send_credits_ -= n;
+  send_batch_size_.push(n);
+  return 0;
+}
+
+int rdma_endpoint::PostWindowRequest() {
+  struct ibv_send_wr wr, *bad_wr = nullptr;
+  memset(&wr, 0, sizeof(wr));
+  wr.wr_id = (uint64_t)this;
+  wr.send_flags = IBV_SEND_SIGNALED;
+  if (mw_rkey_ && FLAGS_mw_inv == "send") {
+    wr.opcode = IBV_WR_SEND_WITH_INV;
+    wr.invalidate_rkey = mw_rkey_;
+  } else {
+    wr.opcode = IBV_WR_SEND;
+  }
+  if (ibv_post_send(qp_, &wr, &bad_wr)) {
+    PLOG(ERROR) << "ibv_post_send() failed";
+    return -1;
+  }
+  mw_rkey_ = 0;
+  mw_waiting_ = true;
+  mw_ask_ns_ = Now64Ns();
+  send_credits_--;
+  send_batch_size_.push(1);
   return 0;
 }
 
+int rdma_endpoint::PostWindow(const std::vector<rdma_request> &requests,
+                              uint32_t batch_size,
+                              const std::vector<rdma_buffer *> &remote_buffer) {
+  if (mw_waiting_ || !send_credits_) return 0;
+  if (!mw_left_) return PostWindowRequest() ? -1 : 0;
+  auto batch = std::min({batch_size, mw_left_, send_credits_});
+  if (PostSend(requests, batch, remote_buffer)) return -1;
+  mw_left_ -= batch;
+  return batch;
+}
+
 void rdma_endpoint::PrintThroughput(uint64_t timestamp) {
   if (bytes_sent_last_ == 0) {
     timestamp_ = timestamp;
@@ -245,6 +836,16 @@ void rdma_endpoint::PrintThroughput(uint64_t timestamp) {
     LOG(INFO) << "\t\t\t\t"
               << " Message rate is " << qps << " Krps (" << qps / 1000.0
               << " Mrps)";
+    if (latency_ && latency_->Count()) {
+      LOG(INFO) << "\t\t\t\t"
+                << " Round trip latency (ns) " << latency_->Summary();
+    }
+    if (lat_cnt_) {
+      LOG(INFO) << "\t\t\t\t"
+                << " Completion latency is " << lat_sum_ns_ / lat_cnt_ / 1000.0
+                << " us on average";
+      lat_sum_ns_ = lat_cnt_ = 0;
+    }
     bytes_sent_last_ = bytes_sent_now_;
     msgs_sent_last_ = msgs_sent_now_;
   }
@@ -7,13 +7,23 @@
 
 #ifndef RDMA_ENDPOINT_HPP
 #define RDMA_ENDPOINT_HPP
+#include <atomic>
+#include <memory>
 #include <queue>
 
+#include "address.hpp"
 #include "helper.hpp"
+#include "histogram.hpp"
 #include "memory.hpp"
+#include "odp.hpp"
+#include "regcache.hpp"
+#include "trace.hpp"
 
 namespace Collie {
 
+class rdma_pacer;
+class rdma_size_dist;
+
 class rdma_request {
  public:
   enum ibv_wr_opcode opcode;  // Opcode of this request
@@ -21,9 +31,36 @@ class rdma_request {
   std::vector<struct ibv_sge> sglist;
 };
 
+// Prebuilt receive WR/SGE chain linked into a ring. Used by endpoints for
+// their own RQ and by SRQs, which have no endpoint to post through.
+class rdma_recv_ring {
+ private:
+  std::vector<struct ibv_recv_wr> wrs_;
+  std::vector<struct ibv_sge> sges_;
+  size_t pos_ = 0;
+  struct ibv_recv_wr *tail_ = nullptr;
+  struct ibv_recv_wr *tail_next_ = nullptr;
+  const rdma_slot *slots_ = nullptr;
+  size_t slot_num_ = 0;
+  size_t slot_ = 0;
+
+ public:
+  int Build(const std::vector<rdma_request> &requests,
+            const std::vector<rdma_slot> &rotation, size_t start,
+            uint64_t wr_id);
+  bool Empty() { return wrs_.empty(); }
+  void Clear() { wrs_.clear(); }
+  // Patch the next batch_size WRs and cut the ring behind them
+  struct ibv_recv_wr *Cut(uint32_t batch_size);
+  // Link the ring again after the batch has been posted
+  void Mend() { tail_->next = tail_next_; }
+};
+
 class rdma_endpoint {
  private:
   struct ibv_qp *qp_ = nullptr;
+  // Only with --qp_ex, then sends go through the ibv_wr_* API
+  struct ibv_qp_ex *qpx_ = nullptr;
   uint32_t id_ = 0;
   enum ibv_qp_type qp_type_;
   union ibv_gid remote_gid_;
@@ -41,7 +78,26 @@ class rdma_endpoint {
   std::queue<int> send_batch_size_;
   std::queue<int> recv_batch_size_;
 
-  bool activated_ = false;
+  // Prebuilt WR/SGE chains, one slot per request position and linked into a
+  // ring. Built on the first post; afterwards only addresses, the signaled
+  // bit and the tail's next link are patched.
+  std::vector<struct ibv_send_wr> send_ring_;
+  std::vector<struct ibv_sge> send_sges_;
+  std::vector<uint32_t> send_bytes_;
+  size_t send_pos_ = 0;
+  rdma_recv_ring recv_ring_;
+  // Local buffers come from the context's rotation tables (read-only).
+  // Each endpoint picks its own slots and offsets with --local_addr and
+  // remote buffers and offsets with --remote_addr.
+  const rdma_slot *send_slots_ = nullptr;
+  rdma_addr_picker local_addr_;
+  rdma_addr_picker remote_addr_;
+  // With --size_dist, SGE lengths are drawn on every post
+  const rdma_size_dist *size_dist_ = nullptr;
+  uint64_t size_rand_ = 0;
+
+  // Published by the connection handler, read by the owning worker
+  std::atomic<bool> activated_{false};
   void *master_ = nullptr;
   void *context_ = nullptr;
 
@@ -51,43 +107,167 @@ class rdma_endpoint {
   uint64_t msgs_sent_last_ = 0;
   uint64_t msgs_sent_now_ = 0;
   uint64_t timestamp_ = 0;
+  // Post time of each outstanding signaled batch, with --print_thp
+  std::queue<uint64_t> send_post_ts_;
+  uint64_t lat_sum_ns_ = 0;
+  uint64_t lat_cnt_ = 0;
+
+  // Ping-pong state with --latency. A ping is in flight while
+  // ping_start_ns_ is set; it ends with the pong or, for READ, its own CQE.
+  uint64_t ping_start_ns_ = 0;
+  bool ping_read_ = false;
+  uint64_t pings_ = 0;
+  std::unique_ptr<collie_histogram> latency_;
+
+  // Open-loop pacing, owned by the worker. Null when closed loop.
+  rdma_pacer *pacer_ = nullptr;
+  // Group in the --workload file, -1 if none
+  int group_ = -1;
+  // Owned by the worker, set with --trace_record
+  rdma_trace_writer *trace_ = nullptr;
+  // Owned by the worker, set with --dynamic_buf. The buffers of each
+  // posted batch wait in dyn_bufs_ until its completion.
+  rdma_dyn_memory *dyn_ = nullptr;
+  std::queue<rdma_dyn_buf> dyn_bufs_;
+  std::queue<uint32_t> dyn_batch_bufs_;
+  // --odp: whether each outstanding batch touched a new page, and the
+  // latency of such first-touch batches and of warm ones
+  rdma_page_map *pages_ = nullptr;
+  std::queue<bool> send_cold_;
+  std::unique_ptr<collie_histogram> odp_cold_;
+  std::unique_ptr<collie_histogram> odp_warm_;
+  // --prefetch_window: a copy of local_addr_ running that many WRs ahead
+  rdma_prefetcher *prefetch_ = nullptr;
+  rdma_addr_picker ahead_;
+  size_t ahead_pos_ = 0;
+  // --mw_window. The server rebinds mw_ over its advertised buffers in
+  // turn and grants each new rkey with a SEND_WITH_IMM; the client spends
+  // mw_left_ requests on the grant, then hands the window back.
+  struct ibv_mw *mw_ = nullptr;
+  std::vector<struct ibv_mw_bind_info> mw_targets_;
+  bool mw_bound_ = false;
+  bool mw_waiting_ = false;  // Client: asked for a window, no grant yet
+  uint32_t mw_rkey_ = 0;
+  uint32_t mw_left_ = 0;
+  uint64_t windows_ = 0;
+  uint64_t mw_ask_ns_ = 0;
+  std::unique_ptr<collie_histogram> grant_wait_;
+
+  int BuildSendRing(const std::vector<rdma_request> &requests);
+  int InitSendSlots();
+  int InitRemoteAddr(const std::vector<rdma_buffer *> &remote_buffer);
+  // Pushes the SGEs of the WR ahead_ is at to the prefetcher
+  void PrefetchAhead();
+  // Primes the prefetcher --prefetch_window WRs ahead of send_pos_
+  void StartPrefetch();
+  // Draws the SGE lengths of the WR in the current ring slot
+  void DrawSizes(struct ibv_send_wr *wr);
+  // Replays a cut chain of the send ring through ibv_wr_*
+  int PostSendEx(struct ibv_send_wr *head);
+  int PingDone();
+  // Server side: answer a ping with the same length and kind of operation
+  int PostPong(struct ibv_wc *wc);
+  // Server side of --mw_window: invalidate if needed, rebind and grant
+  int PostGrant(struct ibv_wc *wc);
+  // Client side of --mw_window: give the window back and ask for the next
+  int PostWindowRequest();
 
  public:
   rdma_endpoint(uint32_t id, ibv_qp *qp)
       : qp_(qp),
+        qpx_(FLAGS_qp_ex ? ibv_qp_to_qp_ex(qp) : nullptr),
         id_(id),
         qp_type_((enum ibv_qp_type)FLAGS_qp_type),
         send_credits_(FLAGS_send_wq_depth),
-        recv_credits_(FLAGS_recv_wq_depth) {}
+        recv_credits_(FLAGS_recv_wq_depth) {
+    if (FLAGS_latency) latency_.reset(new collie_histogram());
+    if (FLAGS_mw_window) grant_wait_.reset(new collie_histogram());
+    if (FLAGS_odp) {
+      odp_cold_.reset(new collie_histogram());
+      odp_warm_.reset(new collie_histogram());
+    }
+  }
   ~rdma_endpoint() {
     if (qp_) ibv_destroy_qp(qp_);
+    if (mw_) ibv_dealloc_mw(mw_);
   }
 
  public:
-  int PostSend(const std::vector<rdma_request> &requests, size_t &req_idx,
-               uint32_t batch_size,
+  int PostSend(const std::vector<rdma_request> &requests, uint32_t batch_size,
                const std::vector<rdma_buffer *> &remote_buffer);
-  int PostRecv(const std::vector<rdma_request> &requests, size_t &req_idx,
-               uint32_t batch_size);
+  int PostRecv(const std::vector<rdma_request> &requests, uint32_t batch_size);
+  // Re-issues one recorded post of n WRs (--trace_replay)
+  int PostReplay(const trace_wr *const *records, uint32_t n,
+                 const std::vector<rdma_buffer *> &remote_buffer);
+  // Bytes the next batch_size posts will carry
+  uint64_t NextBatchBytes(const std::vector<rdma_request> &requests,
+                          uint32_t batch_size);
+  // Client side of --latency: one request, timed until its answer
+  int PostPing(const std::vector<rdma_request> &requests,
+               const std::vector<rdma_buffer *> &remote_buffer);
+  // Server side of --mw_window: the buffers it advertised, in order
+  int InitWindow(struct ibv_pd *pd,
+                 const std::vector<struct ibv_mw_bind_info> &targets);
+  // Client side of --mw_window: requests within the granted window, or
+  // the request for the next one. The number of requests posted.
+  int PostWindow(const std::vector<rdma_request> &requests,
+                 uint32_t batch_size,
+                 const std::vector<rdma_buffer *> &remote_buffer);
   int Activate(const union ibv_gid &remote_gid);
+  // Undoes a bring-up that failed half way, so the endpoint can be handed
+  // out again: the QP back to RESET, the receives and window dropped
+  int Reset();
+  // The UD address handle attributes of the peer, once SetLid()/SetSl()
+  struct ibv_ah_attr MakeAhAttr(const union ibv_gid &remote_gid);
+  // --cm: INIT, RTR and RTS with the attributes of the CM id, given the
+  // negotiated RDMA READ/atomic depths
+  int ActivateCm(struct rdma_cm_id *id, uint8_t initiator_depth,
+                 uint8_t responder_resources);
   int RestoreFromERR();
   int SendHandler(struct ibv_wc *wc);
   int RecvHandler(struct ibv_wc *wc);
   void PrintThroughput(uint64_t timestamp);
 
   enum ibv_qp_type GetType() { return qp_type_; }
+  uint32_t GetId() { return id_; }
   int GetQpn() { return qp_->qp_num; }
+  const union ibv_gid &GetRemoteGid() { return remote_gid_; }
+  bool GetPingInFlight() { return ping_start_ns_ != 0; }
+  uint64_t GetPings() { return pings_; }
+  const collie_histogram *GetLatency() { return latency_.get(); }
+  uint64_t GetMsgs() { return msgs_sent_now_; }
+  uint64_t GetBytes() { return bytes_sent_now_; }
+  uint64_t GetWindows() { return windows_; }
+  const collie_histogram *GetGrantWait() { return grant_wait_.get(); }
+  rdma_pacer *GetPacer() { return pacer_; }
+  int GetGroup() { return group_; }
+  void SetGroup(int group) { group_ = group; }
+  // The next post rebuilds the send ring, e.g., for a new workload phase.
+  // Safe with WRs in flight: the provider copied them when posting.
+  void ResetSendRing() { send_ring_.clear(); }
+  void SetPacer(rdma_pacer *pacer) { pacer_ = pacer; }
+  void SetTrace(rdma_trace_writer *trace) { trace_ = trace; }
+  void SetDynamic(rdma_dyn_memory *dyn) { dyn_ = dyn; }
+  // Pushes the pages --prefetch_window WRs ahead to prefetch, from the
+  // next BuildSendRing() on (or right away if the ring is built)
+  void SetPrefetcher(rdma_prefetcher *prefetch);
+  const collie_histogram *GetOdpLatency(bool cold) {
+    return cold ? odp_cold_.get() : odp_warm_.get();
+  }
   int GetSendCredits() { return send_credits_; }
   int GetRecvCredits() { return recv_credits_; }
   int GetMemId() { return rmem_id_; }
-  bool GetActivated() { return activated_; }
+  bool GetActivated() { return activated_.load(std::memory_order_acquire); }
   void SetQpn(int qpn) { remote_qpn_ = qpn; }
   void SetLid(int lid) { dlid_ = lid; }
   void SetSl(int sl) { remote_sl_ = sl; }
   void SetContext(void *context) { context_ = context; }
   void SetMaster(void *master) { master_ = master; }
-  void SetActivated(bool state) { activated_ = state; }
+  void SetActivated(bool state) {
+    activated_.store(state, std::memory_order_release);
+  }
   void SetMemId(int remote_mem_id) { rmem_id_ = remote_mem_id; }
+  void SetRecvCredits(uint32_t credits) { recv_credits_ = credits; }
   void SetServer(const std::string &name) { remote_server_ = name; }
 };
 }  // namespace Collie
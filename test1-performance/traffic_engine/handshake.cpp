@@ -0,0 +1,196 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+#include "handshake.hpp"
+
+#include <errno.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+namespace Collie {
+
+// A socket may move a large message in pieces
+static int WriteFull(int fd, const void *buf, size_t len) {
+  auto p = (const char *)buf;
+  while (len) {
+    auto n = write(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int ReadFull(int fd, void *buf, size_t len) {
+  auto p = (char *)buf;
+  while (len) {
+    auto n = read(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+std::vector<char> PackHandshake(uint16_t type,
+                                const std::vector<connect_info> &records) {
+  handshake_header header;
+  header.magic = kHandshakeMagic;
+  header.version = kHandshakeVersion;
+  header.type = type;
+  header.length = records.size() * sizeof(connect_info);
+  std::vector<char> msg(sizeof(header) + header.length);
+  memcpy(msg.data(), &header, sizeof(header));
+  if (header.length)
+    memcpy(msg.data() + sizeof(header), records.data(), header.length);
+  return msg;
+}
+
+static int CheckHeader(const handshake_header &header) {
+  if (header.magic != kHandshakeMagic ||
+      header.version != kHandshakeVersion) {
+    LOG(ERROR) << "The peer speaks handshake version " << header.version
+               << " (magic 0x" << std::hex << header.magic << std::dec
+               << "), we speak " << kHandshakeVersion;
+    return -1;
+  }
+  if (header.length % sizeof(connect_info) ||
+      header.length > kMaxHandshakeBytes) {
+    LOG(ERROR) << "Bad handshake message length " << header.length;
+    return -1;
+  }
+  return 0;
+}
+
+static int CheckType(const handshake_header &header, uint16_t type,
+                     bool *rejected) {
+  if (rejected) *rejected = (header.type == kRejectMsg);
+  if (header.type != type && !(rejected && *rejected)) {
+    LOG(ERROR) << "Got handshake message " << header.type << ", expected "
+               << type;
+    return -1;
+  }
+  return 0;
+}
+
+int WriteHandshake(int fd, uint16_t type,
+                   const std::vector<connect_info> &records) {
+  // One write for small messages, so the peer sees one segment
+  auto msg = PackHandshake(type, records);
+  if (WriteFull(fd, msg.data(), msg.size())) {
+    PLOG(ERROR) << "Couldn't send handshake message " << type;
+    return -1;
+  }
+  return 0;
+}
+
+int ReadHandshake(int fd, uint16_t type, std::vector<connect_info> *records,
+                  bool *rejected) {
+  handshake_header header;
+  if (ReadFull(fd, &header, sizeof(header))) {
+    PLOG(ERROR) << "Couldn't read handshake message " << type;
+    return -1;
+  }
+  if (CheckHeader(header) || CheckType(header, type, rejected)) return -1;
+  records->resize(header.length / sizeof(connect_info));
+  if (header.length && ReadFull(fd, records->data(), header.length)) {
+    PLOG(ERROR) << "Couldn't read the records of handshake message " << type;
+    return -1;
+  }
+  return 0;
+}
+
+int FlushHandshake(int fd, const std::vector<char> &msg, size_t *sent) {
+  while (*sent < msg.size()) {
+    auto n = write(fd, msg.data() + *sent, msg.size() - *sent);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    if (n <= 0) {
+      PLOG(ERROR) << "Couldn't send handshake message";
+      return -1;
+    }
+    *sent += n;
+  }
+  return 1;
+}
+
+void InitCmPrivate(cm_private *data, uint16_t type) {
+  memset(data, 0, sizeof(cm_private));
+  data->magic = kHandshakeMagic;
+  data->version = kHandshakeVersion;
+  data->type = type;
+}
+
+int ParseCmPrivate(const void *data, uint8_t len, uint16_t type,
+                   cm_private *out, bool *rejected) {
+  // The CM may pad the private data, so longer is fine
+  memset(out, 0, sizeof(cm_private));
+  if (data) memcpy(out, data, std::min<size_t>(len, sizeof(cm_private)));
+  if (!data || len < CmPrivateLen(0) || out->magic != kHandshakeMagic ||
+      out->version != kHandshakeVersion) {
+    LOG(ERROR) << "The peer's CM private data is not handshake version "
+               << kHandshakeVersion;
+    return -1;
+  }
+  if (out->count > kCmMaxMem || len < CmPrivateLen(out->count)) {
+    LOG(ERROR) << "Bad CM private data: " << out->count << " buffers in "
+               << (int)len << " bytes";
+    return -1;
+  }
+  if (rejected) *rejected = (out->type == kRejectMsg);
+  if (out->type != type && !(rejected && *rejected)) {
+    LOG(ERROR) << "Got CM handshake message " << out->type << ", expected "
+               << type;
+    return -1;
+  }
+  return 0;
+}
+
+int handshake_reader::Feed(int fd) {
+  while (true) {
+    char *dst;
+    size_t want;
+    if (got_ < sizeof(header_)) {
+      dst = (char *)&header_ + got_;
+      want = sizeof(header_) - got_;
+    } else {
+      auto body = got_ - sizeof(header_);
+      if (body == header_.length) return 1;
+      dst = body_.data() + body;
+      want = header_.length - body;
+    }
+    auto n = read(fd, dst, want);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    if (!n) {
+      LOG(ERROR) << "The peer closed the handshake";
+      return -1;
+    }
+    if (n < 0) {
+      PLOG(ERROR) << "Couldn't read handshake message";
+      return -1;
+    }
+    got_ += n;
+    if (got_ == sizeof(header_)) {
+      if (CheckHeader(header_)) return -1;
+      body_.resize(header_.length);
+    }
+  }
+}
+
+int handshake_reader::Parse(uint16_t type, std::vector<connect_info> *records,
+                            bool *rejected) {
+  if (CheckType(header_, type, rejected)) return -1;
+  records->resize(header_.length / sizeof(connect_info));
+  if (header_.length) memcpy(records->data(), body_.data(), header_.length);
+  return 0;
+}
+
+}  // namespace Collie
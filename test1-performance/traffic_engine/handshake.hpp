@@ -0,0 +1,119 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+#ifndef RDMA_HANDSHAKE_HPP
+#define RDMA_HANDSHAKE_HPP
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "helper.hpp"
+
+namespace Collie {
+
+// The connection handshake takes one message each way plus a one-way
+// "ready". The client sends a hello with its host record, the info of its
+// buffers and of its QPs; the server answers with the same for its side,
+// then activates its QPs while the client activates its own, and tells the
+// client when its receivers are up. Each message is a handshake_header and
+// then header.length bytes of connect_info records.
+constexpr uint32_t kHandshakeMagic = 0x434f4c48;  // "COLH"
+constexpr uint16_t kHandshakeVersion = 1;
+constexpr uint16_t kHelloMsg = 1;
+constexpr uint16_t kReplyMsg = 2;
+constexpr uint16_t kReadyMsg = 3;
+constexpr uint16_t kRejectMsg = 4;
+constexpr uint32_t kMaxHandshakeBytes = 64U << 20;
+
+struct handshake_header {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t type;
+  uint32_t length;  // Bytes of records that follow
+};
+
+std::vector<char> PackHandshake(uint16_t type,
+                                const std::vector<connect_info> &records);
+int WriteHandshake(int fd, uint16_t type,
+                   const std::vector<connect_info> &records);
+// Fails unless the next message is of the type, or a kRejectMsg when
+// rejected is given, which is then set
+int ReadHandshake(int fd, uint16_t type, std::vector<connect_info> *records,
+                  bool *rejected = nullptr);
+
+// WriteHandshake() for non-blocking sockets: sends what the socket takes
+// of a packed message. 1 once all of it is out, 0 until then, -1 on errors.
+int FlushHandshake(int fd, const std::vector<char> &msg, size_t *sent);
+
+// ReadHandshake() for non-blocking sockets: Feed() whenever the socket is
+// readable, then Parse() the message
+class handshake_reader {
+ private:
+  handshake_header header_;
+  std::vector<char> body_;
+  size_t got_ = 0;
+
+ public:
+  void Reset() { got_ = 0; }
+  // 1 once the whole message is in, 0 until then, -1 on errors and EOF
+  int Feed(int fd);
+  int Parse(uint16_t type, std::vector<connect_info> *records,
+            bool *rejected = nullptr);
+};
+
+// With --cm the handshake rides in the private data of the CM REQ, REP and
+// REJ of each QP: the client's buffer and how many of the server's it
+// wants, then the server's buffers.
+struct cm_mem {
+  uint64_t addr;
+  uint32_t rkey;
+  uint32_t size;
+};
+
+struct cm_private {
+  uint32_t magic;  // kHandshakeMagic
+  uint16_t version;
+  uint16_t type;    // kHelloMsg, kReplyMsg or kRejectMsg
+  uint16_t wanted;  // Hello: buffers asked for
+  uint16_t count;   // Entries of mem that follow
+  uint32_t reserved;
+  cm_mem mem[kCmMaxMem];
+};
+
+// Private data length of a cm_private with count buffers
+inline uint8_t CmPrivateLen(int count) {
+  return offsetof(cm_private, mem) + count * sizeof(cm_mem);
+}
+void InitCmPrivate(cm_private *data, uint16_t type);
+// Fails unless data is a cm_private of the type or, when rejected is given,
+// a kRejectMsg
+int ParseCmPrivate(const void *data, uint8_t len, uint16_t type,
+                   cm_private *out, bool *rejected = nullptr);
+
+// Server side of one handshake, run by the acceptor in Listen()
+struct rdma_accept {
+  enum { kHello, kReply, kReject, kActivate, kReady };
+  int state = kHello;
+  int fd = -1;
+  int epfd = -1;
+  handshake_reader reader;
+  std::vector<char> out;  // The message being written
+  size_t sent = 0;
+  // From the hello
+  union ibv_gid gid;
+  int left = 0;
+  int right = 0;
+  int rbuf_id = -1;
+  // The buffers we advertised, for --mw_window to bind over
+  std::vector<struct ibv_mw_bind_info> targets;
+  // StartAccepted() on the activation pool
+  int activated = -1;
+};
+
+}  // namespace Collie
+
+#endif
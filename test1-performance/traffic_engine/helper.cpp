@@ -6,6 +6,14 @@
 // See LICENSE for license information
 
 #include "helper.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <chrono>
+#include <thread>
+
 // Control Path parameter
 DEFINE_string(dev, "mlx5_0", "ib device to use, default mlx5_0");
 DEFINE_int32(gid, 3, "Global id index");
@@ -13,6 +21,8 @@ DEFINE_int32(gid, 3, "Global id index");
 DEFINE_bool(server, false, "Set up a server");
 DEFINE_string(connect, "", "connect to the other end");
 DEFINE_int32(port, 12000, "Tcp port");
+DEFINE_int32(connect_timeout, 30,
+             "Seconds a client keeps retrying a server that is not up yet");
 
 DEFINE_int32(min_rnr_timer, 14, "Minimal Receive Not Ready error");
 DEFINE_int32(hop_limit, 16, "Hop limit");
@@ -34,20 +44,65 @@ DEFINE_int32(mtu, IBV_MTU_1024,
                     \t 5 indicates 4096");
 
 // Resource Management Parameter
+DEFINE_int32(threads, 1,
+             "The number of datapath threads. 0 means one per online core");
 DEFINE_bool(share_cq, false, "All qps inside one thread share cq");
 DEFINE_bool(share_mr, false, "All qps inside one thread share mr");
 DEFINE_bool(share_pd, true, "All elements inside one thread share pd");
 DEFINE_bool(memalign, true, "memalign instead of malloc");
 
+DEFINE_bool(srq, false, "Post receives to shared receive queues (SRQ)");
+DEFINE_int32(srq_num, 1, "The number of SRQs each datapath thread owns");
+DEFINE_int32(srq_limit, 256,
+             "Refill an SRQ once its posted receives drop to this watermark");
+DEFINE_bool(srq_event, false,
+            "Refill SRQs on IBV_EVENT_SRQ_LIMIT_REACHED instead of counting "
+            "completions");
+
 DEFINE_int32(send_wq_depth, 1024, "Send Work Queue depth");
-DEFINE_int32(recv_wq_depth, 1024, "Recv Work Queue depth");
+DEFINE_int32(recv_wq_depth, 1024,
+             "Recv Work Queue depth (the depth of each SRQ with --srq)");
 DEFINE_int32(cq_depth, 65536, "CQ depth");
 DEFINE_int32(buf_size, 65536, "Buffer/Message Size");
 DEFINE_int32(buf_num, 1, "The number of buffers one QP owns");
 DEFINE_int32(mr_num, 1, "The number of MR one thread contains.");
+DEFINE_string(hugepage, "",
+              "Back the buffers with prefaulted hugepages: 2m or 1g. Empty "
+              "for normal pages");
+DEFINE_int32(reg_threads, 0,
+             "Threads allocating and registering MRs at startup, 0 for one "
+             "per core");
+DEFINE_int32(ah_threads, 4,
+             "Threads creating the shared UD address handles ahead of "
+             "activation, 0 to create them inline");
+DEFINE_bool(populate, false,
+            "Prefault the buffers with MAP_POPULATE before registering them");
+DEFINE_bool(dynamic_buf, false,
+            "Send every message from a fresh buffer of a size-classed pool, "
+            "registered through a pin-down cache (see regcache.hpp)");
+DEFINE_int32(dyn_ws_mb, 64,
+             "Working set of each size class of --dynamic_buf, in MiB");
+DEFINE_int32(reg_cache_mb, 256,
+             "Capacity of the --dynamic_buf registration cache in MiB, 0 to "
+             "register every message");
+DEFINE_bool(odp, false,
+            "Register the local MRs with on-demand paging and report the "
+            "latency of first-touch and warm batches apart");
+DEFINE_int32(prefetch_window, 0,
+             "With --odp, prefetch the pages this many WRs ahead of each "
+             "QP's posts with ibv_advise_mr() on a helper thread");
+DEFINE_int32(send_numa, -1,
+             "NUMA node of the send buffers, -1 for the NIC's node, -2 to "
+             "leave it to the kernel");
+DEFINE_int32(recv_numa, -1,
+             "NUMA node of the receive buffers, -1 for the NIC's node, -2 to "
+             "leave it to the kernel");
 DEFINE_bool(use_cuda, false, "Whether use cuda or not");
 DEFINE_int32(gpu_id, 0, "Cuda device id");
 DEFINE_bool(hw_ts, false, "Hardware timestamp enable?");
+DEFINE_bool(qp_ex, false,
+            "Create QPs with ibv_create_qp_ex and post sends through the "
+            "ibv_wr_* API instead of ibv_post_send");
 
 DEFINE_bool(run_infinitely, false, "Will run infinitely");
 DEFINE_int32(iters, 200000, "Iterations one QP will send");
@@ -64,11 +119,73 @@ DEFINE_string(receive, "1_65536",
               "The receive request vector: \
                                     e.g., 1024_65536 means to post a receive buffer with pattern 1K, 64K");
 DEFINE_bool(imm_data, false, "Use immediate data for all WRITE");
+DEFINE_string(size_dist, "",
+              "Draw every send SGE length from a distribution instead of "
+              "--request: uniform:<min>:<max>, loguniform:<min>:<max>, "
+              "zipf:<s>:<min>:<max> or cdf:<file>");
+DEFINE_string(workload, "",
+              "A JSON workload file for the client, used instead of "
+              "--request (see workload.hpp)");
+DEFINE_string(trace_record, "",
+              "Record every client post into <path>.<thread id> (see "
+              "trace.hpp)");
+DEFINE_string(trace_replay, "",
+              "Replay the posts recorded in <path>.<thread id> instead of "
+              "--request");
+DEFINE_bool(trace_asap, false,
+            "Replay as fast as possible instead of with the recorded timing");
+DEFINE_string(local_addr, "seq",
+              "Where send SGEs point to in the local buffers:\n\
+                    \t seq: the next buffer, from its start\n\
+                    \t random: a random buffer and aligned offset\n\
+                    \t stride:<bytes>: the pool as one span, <bytes> apart\n\
+                    \t zipf:<s>: Zipf-popular pages, scattered over the pool\n\
+                    \t page: a random buffer, straddling a page boundary");
+DEFINE_string(remote_addr, "seq",
+              "Where READ/WRITE land in the remote buffers, same strategies "
+              "as --local_addr");
+DEFINE_double(rate_gbps, 0,
+              "Open-loop offered load of each QP in Gbps, 0 for closed loop");
+DEFINE_double(rate_mrps, 0,
+              "Open-loop offered load of each QP in Mrps, 0 for closed loop");
+DEFINE_bool(rate_per_thread, false,
+            "--rate_gbps/--rate_mrps is the load of a datapath thread, "
+            "shared by its QPs, instead of the load of each QP");
+DEFINE_string(arrival, "constant",
+              "Open-loop arrival process:\n\
+                    \t constant: evenly spaced posts\n\
+                    \t poisson: exponentially distributed gaps\n\
+                    \t onoff: the rate for --on_us, then silence for --off_us");
+DEFINE_int32(on_us, 100, "On period of --arrival=onoff");
+DEFINE_int32(off_us, 900, "Off period of --arrival=onoff");
+DEFINE_string(rate_schedule, "",
+              "Time-varying rate as ms:factor steps, repeated. e.g., "
+              "1000:1,200:4 runs 1s at the given rate, then 200ms at 4x");
+DEFINE_bool(latency, false,
+            "Ping-pong latency mode: one request in flight per QP. The server "
+            "answers SEND with SEND and WRITE (with imm) with WRITE with imm; "
+            "READ is timed on its own completion");
+DEFINE_bool(cm, false,
+            "Set up connections with RDMA-CM, one per QP, instead of the TCP "
+            "handshake (RC only)");
+DEFINE_int32(mw_window, 0,
+             "Memory window mode: the server binds a type-2 memory window over "
+             "one of its buffers for every this many client WRITE/READ "
+             "requests, which use its rkey. 0 uses the MR keys");
+DEFINE_string(mw_inv, "send",
+              "How a used window is invalidated: send (the client's "
+              "SEND_WITH_INV) or local (the server's LOCAL_INV)");
 
 DEFINE_int32(host_num, 1, "The number of host to connect or get connected");
 DEFINE_int32(qp_num, 1, "The number of qp each host has");
 
 DEFINE_bool(print_thp, false, "To print throughput or not");
+DEFINE_string(poll_mode, "busy",
+              "How datapath threads wait for completions:\n\
+                    \t busy: spin on ibv_poll_cq (default)\n\
+                    \t event: sleep on the completion channel when idle\n\
+                    \t hybrid: spin for --spin_us when idle, then sleep");
+DEFINE_int32(spin_us, 50, "Idle spinning time before sleeping in hybrid mode");
 
 namespace Collie {
 uint64_t Now64() {
@@ -132,6 +249,28 @@ struct ibv_qp_init_attr MakeQpInitAttr(struct ibv_cq *send_cq,
   return qp_init_attr;
 }
 
+struct ibv_qp_init_attr_ex MakeQpInitAttrEx(
+    const struct ibv_qp_init_attr &qp_init_attr, struct ibv_pd *pd) {
+  struct ibv_qp_init_attr_ex attr_ex;
+  memset(&attr_ex, 0, sizeof(attr_ex));
+  attr_ex.qp_type = qp_init_attr.qp_type;
+  attr_ex.sq_sig_all = qp_init_attr.sq_sig_all;
+  attr_ex.send_cq = qp_init_attr.send_cq;
+  attr_ex.recv_cq = qp_init_attr.recv_cq;
+  attr_ex.srq = qp_init_attr.srq;
+  attr_ex.cap = qp_init_attr.cap;
+  attr_ex.pd = pd;
+  attr_ex.comp_mask = IBV_QP_INIT_ATTR_PD | IBV_QP_INIT_ATTR_SEND_OPS_FLAGS;
+  attr_ex.send_ops_flags = IBV_QP_EX_WITH_SEND | IBV_QP_EX_WITH_SEND_WITH_IMM;
+  if (attr_ex.qp_type != IBV_QPT_UD)
+    attr_ex.send_ops_flags |=
+        IBV_QP_EX_WITH_RDMA_WRITE | IBV_QP_EX_WITH_RDMA_WRITE_WITH_IMM;
+  // UC has no READ (nor atomics): the provider rejects the QP if asked
+  if (attr_ex.qp_type == IBV_QPT_RC)
+    attr_ex.send_ops_flags |= IBV_QP_EX_WITH_RDMA_READ;
+  return attr_ex;
+}
+
 struct ibv_qp_attr MakeQpAttr(enum ibv_qp_state state, enum ibv_qp_type qp_type,
                               int remote_qpn, const union ibv_gid &remote_gid,
                               int *attr_mask) {
@@ -224,6 +363,57 @@ std::vector<std::string> ParseHostlist(const std::string &hostlist) {
   return result;
 }
 
+uint64_t NowCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return Now64Ns();
+#endif
+}
+
+double CyclesPerUs() {
+  static double cycles_per_us = [] {
+    auto t0 = Now64Ns();
+    auto c0 = NowCycles();
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    auto t1 = Now64Ns();
+    auto c1 = NowCycles();
+    return (c1 - c0) * 1000.0 / (t1 - t0);
+  }();
+  return cycles_per_us;
+}
+
+int ParsePollMode(const std::string &mode) {
+  if (mode == "busy") return kBusyPoll;
+  if (mode == "event") return kEventPoll;
+  if (mode == "hybrid") return kHybridPoll;
+  return -1;
+}
+
+int ParseAddrMode(const std::string &spec, double *arg) {
+  auto mode = spec.substr(0, spec.find(':'));
+  *arg = 0;
+  if (mode.size() < spec.size()) {
+    char *end = nullptr;
+    auto value = spec.substr(mode.size() + 1);
+    *arg = strtod(value.c_str(), &end);
+    if (value.empty() || *end || *arg <= 0) return -1;
+  }
+  if (mode == "seq" && mode == spec) return kSeqAddr;
+  if (mode == "random" && mode == spec) return kRandomAddr;
+  if (mode == "page" && mode == spec) return kPageAddr;
+  if (mode == "stride" && *arg >= 1) return kStrideAddr;
+  if (mode == "zipf" && *arg > 0) return kZipfAddr;
+  return -1;
+}
+
+int64_t ParseHugepage(const std::string &size) {
+  if (size == "") return 0;
+  if (size == "2m" || size == "2M") return kHugePage2M;
+  if (size == "1g" || size == "1G") return kHugePage1G;
+  return -1;
+}
+
 bool ParametersCheck() {
   if (FLAGS_connect == "" && !FLAGS_server) {
     LOG(ERROR) << "You are not connecting to anyone and you are not a server";
@@ -247,6 +437,130 @@ bool ParametersCheck() {
     LOG(WARNING) << "Set recv_batch = " << kMaxBatch;
     FLAGS_recv_batch = kMaxBatch;
   }
+  if (FLAGS_srq) {
+    if (FLAGS_srq_num <= 0) {
+      LOG(ERROR) << "Each datapath thread needs at least one SRQ";
+      return false;
+    }
+    if (FLAGS_srq_limit <= 0 || FLAGS_srq_limit >= FLAGS_recv_wq_depth) {
+      LOG(ERROR) << "The SRQ watermark should be in (0, recv_wq_depth): "
+                 << FLAGS_srq_limit;
+      return false;
+    }
+    if (!FLAGS_share_pd) {
+      LOG(WARNING) << "QPs on the same SRQ must share the PD. Set share_pd";
+      FLAGS_share_pd = true;
+    }
+  }
+  if (FLAGS_latency && FLAGS_workload != "") {
+    LOG(ERROR) << "The latency mode takes --request, not a workload file";
+    return false;
+  }
+  if (FLAGS_latency && (FLAGS_srq || FLAGS_hw_ts)) {
+    LOG(ERROR) << "The latency mode works with neither --srq nor --hw_ts";
+    return false;
+  }
+  if (FLAGS_trace_replay != "") {
+    if (FLAGS_trace_record != "" || FLAGS_latency || FLAGS_workload != "" ||
+        FLAGS_size_dist != "" || FLAGS_rate_gbps > 0 || FLAGS_rate_mrps > 0) {
+      LOG(ERROR) << "The replay takes its traffic from the trace only";
+      return false;
+    }
+    if (ParsePollMode(FLAGS_poll_mode) != kBusyPoll) {
+      LOG(ERROR) << "Replaying the recorded timing needs --poll_mode=busy";
+      return false;
+    }
+  }
+  double arg;
+  if (ParseAddrMode(FLAGS_local_addr, &arg) < 0 ||
+      ParseAddrMode(FLAGS_remote_addr, &arg) < 0) {
+    LOG(ERROR) << "Bad address strategy " << FLAGS_local_addr << " or "
+               << FLAGS_remote_addr;
+    return false;
+  }
+  if (FLAGS_dynamic_buf) {
+    if (FLAGS_latency || FLAGS_trace_replay != "") {
+      LOG(ERROR) << "--dynamic_buf works with the throughput mode only";
+      return false;
+    }
+    if (FLAGS_dyn_ws_mb <= 0 || FLAGS_reg_cache_mb < 0) {
+      LOG(ERROR) << "Bad --dyn_ws_mb or --reg_cache_mb";
+      return false;
+    }
+    if (!FLAGS_share_pd) {
+      LOG(WARNING) << "A worker's registration cache needs one PD. "
+                   << "Set share_pd";
+      FLAGS_share_pd = true;
+    }
+  }
+  if (FLAGS_connect_timeout <= 0) {
+    LOG(ERROR) << "--connect_timeout should be positive";
+    return false;
+  }
+  if (FLAGS_cm && (FLAGS_qp_type != IBV_QPT_RC || FLAGS_buf_num > kCmMaxMem)) {
+    LOG(ERROR) << "--cm needs RC and at most " << kCmMaxMem
+               << " buffers (--buf_num) to fit the CM private data";
+    return false;
+  }
+  if (FLAGS_mw_window) {
+    if (FLAGS_mw_window < 0 || FLAGS_qp_type != IBV_QPT_RC) {
+      LOG(ERROR) << "--mw_window should be positive and needs RC";
+      return false;
+    }
+    if (FLAGS_mw_inv != "send" && FLAGS_mw_inv != "local") {
+      LOG(ERROR) << "Unknown --mw_inv " << FLAGS_mw_inv;
+      return false;
+    }
+    if (FLAGS_latency || FLAGS_workload != "" || FLAGS_trace_replay != "" ||
+        FLAGS_trace_record != "" || FLAGS_dynamic_buf || FLAGS_imm_data) {
+      LOG(ERROR) << "--mw_window takes plain WRITE/READ from --request";
+      return false;
+    }
+    if (FLAGS_srq || FLAGS_hw_ts || FLAGS_qp_ex) {
+      LOG(ERROR) << "--mw_window works with neither --srq, --hw_ts nor --qp_ex";
+      return false;
+    }
+    if (!FLAGS_share_pd) {
+      LOG(WARNING) << "Windows, MRs and QPs need one PD. Set share_pd";
+      FLAGS_share_pd = true;
+    }
+  }
+  if (FLAGS_prefetch_window < 0 || (FLAGS_prefetch_window && !FLAGS_odp)) {
+    LOG(ERROR) << "--prefetch_window needs --odp and should not be negative";
+    return false;
+  }
+  if (FLAGS_odp && !FLAGS_share_pd) {
+    LOG(WARNING) << "Prefetching needs the PD of the MRs. Set share_pd";
+    FLAGS_share_pd = true;
+  }
+  if (ParseHugepage(FLAGS_hugepage) < 0) {
+    LOG(ERROR) << "Unknown hugepage size " << FLAGS_hugepage;
+    return false;
+  }
+  if (ParsePollMode(FLAGS_poll_mode) < 0) {
+    LOG(ERROR) << "Unknown poll mode " << FLAGS_poll_mode;
+    return false;
+  }
+  if (FLAGS_rate_gbps > 0 || FLAGS_rate_mrps > 0) {
+    if (FLAGS_rate_gbps > 0 && FLAGS_rate_mrps > 0) {
+      LOG(ERROR) << "Set either --rate_gbps or --rate_mrps, not both";
+      return false;
+    }
+    if (FLAGS_arrival != "constant" && FLAGS_arrival != "poisson" &&
+        FLAGS_arrival != "onoff") {
+      LOG(ERROR) << "Unknown arrival process " << FLAGS_arrival;
+      return false;
+    }
+    if (FLAGS_arrival == "onoff" && (FLAGS_on_us <= 0 || FLAGS_off_us < 0)) {
+      LOG(ERROR) << "The on period should be positive, the off period not "
+                    "negative";
+      return false;
+    }
+    if (ParsePollMode(FLAGS_poll_mode) != kBusyPoll) {
+      LOG(ERROR) << "Open-loop pacing needs --poll_mode=busy";
+      return false;
+    }
+  }
   if (FLAGS_run_infinitely) {
     LOG(WARNING)
         << "Running infinitely. The iterations parameters will be of no use.";
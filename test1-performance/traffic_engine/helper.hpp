@@ -18,15 +18,16 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <sstream>
-//#include <rdma/rdma_cma.h>
 #include <arpa/inet.h>
 #include <byteswap.h>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <netdb.h>
+#include <rdma/rdma_cma.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 
@@ -51,22 +52,40 @@ DECLARE_int32(rnr_retry);
 DECLARE_int32(qp_type);
 DECLARE_int32(mtu);
 
+DECLARE_int32(threads);
 DECLARE_bool(share_cq);
 DECLARE_bool(share_mr);
 DECLARE_bool(share_pd);
 DECLARE_bool(memalign);
 
+DECLARE_bool(srq);
+DECLARE_int32(srq_num);
+DECLARE_int32(srq_limit);
+DECLARE_bool(srq_event);
+
 DECLARE_int32(send_wq_depth);
 DECLARE_int32(recv_wq_depth);
 DECLARE_int32(cq_depth);
 DECLARE_int32(buf_size);
 DECLARE_int32(buf_num);
 DECLARE_int32(mr_num);
+DECLARE_int32(send_numa);
+DECLARE_int32(recv_numa);
+DECLARE_string(hugepage);
+DECLARE_int32(reg_threads);
+DECLARE_int32(ah_threads);
+DECLARE_bool(populate);
+DECLARE_bool(dynamic_buf);
+DECLARE_int32(dyn_ws_mb);
+DECLARE_int32(reg_cache_mb);
+DECLARE_bool(odp);
+DECLARE_int32(prefetch_window);
 DECLARE_int32(max_qp_rd_atom);
 DECLARE_bool(use_cuda);
 DECLARE_int32(gpu_id);
 
 DECLARE_bool(hw_ts);
+DECLARE_bool(qp_ex);
 
 // DECLARE_int32(opcode);
 // DECLARE_string(opcode_name);
@@ -80,11 +99,32 @@ DECLARE_int32(sge_num);
 DECLARE_string(request);
 DECLARE_string(receive);
 DECLARE_bool(imm_data);
+DECLARE_string(workload);
+DECLARE_string(size_dist);
+DECLARE_string(trace_record);
+DECLARE_string(trace_replay);
+DECLARE_bool(trace_asap);
+DECLARE_string(local_addr);
+DECLARE_string(remote_addr);
+DECLARE_bool(latency);
+DECLARE_bool(cm);
+DECLARE_int32(connect_timeout);
+DECLARE_int32(mw_window);
+DECLARE_string(mw_inv);
+DECLARE_double(rate_gbps);
+DECLARE_double(rate_mrps);
+DECLARE_bool(rate_per_thread);
+DECLARE_string(arrival);
+DECLARE_int32(on_us);
+DECLARE_int32(off_us);
+DECLARE_string(rate_schedule);
 
 DECLARE_int32(qp_num);
 DECLARE_int32(host_num);
 
 DECLARE_bool(print_thp);
+DECLARE_string(poll_mode);
+DECLARE_int32(spin_us);
 
 namespace Collie {
 
@@ -93,12 +133,29 @@ constexpr int kInlineThresh = 64;
 constexpr int kHostInfoKey = 0;
 constexpr int kMemInfoKey = 1;
 constexpr int kChannelInfoKey = 2;
-constexpr int kGoGoKey = 3;
 constexpr int kCqPollDepth = 128;
 constexpr int kMaxBatch = 128;
 constexpr int kMaxSge = 16;
 constexpr int kMaxInline = 512;
-constexpr int kMaxConnRetry = 10;
+constexpr int kActivateThreads = 4;  // Server QP bring-up, see Listen()
+constexpr uint64_t kConnBackoffMinMs = 50;
+constexpr uint64_t kConnBackoffMaxMs = 2000;
+constexpr int kCmMaxMem = 11;  // Buffers in the 196 bytes of a CM REP
+constexpr int kCmTimeoutMs = 2000;
+constexpr int kBusyPoll = 0;
+constexpr int kEventPoll = 1;
+constexpr int kHybridPoll = 2;
+constexpr int kEventTimeoutMs = 100;
+constexpr int kClockRefreshMs = 10;
+constexpr int kPaceBurstUs = 10;
+constexpr int kSeqAddr = 0;
+constexpr int kRandomAddr = 1;
+constexpr int kStrideAddr = 2;
+constexpr int kZipfAddr = 3;
+constexpr int kPageAddr = 4;
+constexpr int kAddrAlign = 64;
+constexpr size_t kHugePage2M = 2ULL << 20;
+constexpr size_t kHugePage1G = 1ULL << 30;
 
 class connect_info {
  public:
@@ -125,6 +182,9 @@ class connect_info {
 struct ibv_qp_init_attr MakeQpInitAttr(struct ibv_cq *send_cq,
                                        struct ibv_cq *recv_cq,
                                        int send_wq_depth, int recv_wq_depth);
+// The extended twin of a legacy init attr, enabling the ibv_wr_* send ops
+struct ibv_qp_init_attr_ex MakeQpInitAttrEx(
+    const struct ibv_qp_init_attr &qp_init_attr, struct ibv_pd *pd);
 
 struct ibv_qp_attr MakeQpAttr(enum ibv_qp_state, enum ibv_qp_type,
                               int remote_qpn, const union ibv_gid &remote_gid,
@@ -136,6 +196,39 @@ uint64_t Now64();
 
 uint64_t Now64Ns();
 
+// A cheap cycle counter (TSC on x86) and its rate, calibrated once
+uint64_t NowCycles();
+double CyclesPerUs();
+
+// A fast seeded PRNG (xorshift64*) for the datapath. The state must not be 0,
+// SeedRand() makes one from any seed.
+inline uint64_t SeedRand(uint64_t seed) {
+  return seed * 0x9e3779b97f4a7c15ULL + 1;
+}
+inline uint64_t FastRand(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 0x2545f4914f6cdd1dULL;
+}
+
+// Delay before connection attempt n (from 1): exponential from
+// kConnBackoffMinMs up to kConnBackoffMaxMs, jittered over the upper half
+// so peers that are not up yet are not hammered in lockstep
+inline uint64_t ConnBackoffMs(int attempt, uint64_t *rand) {
+  uint64_t ms = kConnBackoffMaxMs;
+  if (attempt < 16) ms = std::min(kConnBackoffMinMs << (attempt - 1), ms);
+  return ms / 2 + FastRand(rand) % (ms / 2 + 1);
+}
+
+// Returns kBusyPoll/kEventPoll/kHybridPoll, or -1 for an unknown mode
+int ParsePollMode(const std::string &mode);
+// Returns kSeqAddr...kPageAddr and the argument of stride/zipf in arg, or
+// -1 for a bad strategy
+int ParseAddrMode(const std::string &spec, double *arg);
+// Bytes of a --hugepage page: 0 for none, -1 for an unknown size
+int64_t ParseHugepage(const std::string &size);
+
 bool ParametersCheck();
 
 int Initialize(int argc, char **argv);
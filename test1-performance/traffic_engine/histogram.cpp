@@ -0,0 +1,86 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+#include "histogram.hpp"
+
+#include <cmath>
+#include <sstream>
+
+namespace Collie {
+
+uint64_t collie_histogram::LowerBound(int idx) {
+  if (idx < kSubBuckets) return idx;
+  int shift = (idx >> kSubBits) - 1;
+  return (uint64_t)((idx & (kSubBuckets - 1)) + kSubBuckets) << shift;
+}
+
+void collie_histogram::Reset() {
+  for (auto &c : counts_) c.store(0, std::memory_order_relaxed);
+  count_.store(0, std::memory_order_relaxed);
+  sum_.store(0, std::memory_order_relaxed);
+  min_.store(std::numeric_limits<uint64_t>::max(), std::memory_order_relaxed);
+  max_.store(0, std::memory_order_relaxed);
+}
+
+void collie_histogram::Merge(const collie_histogram &other) {
+  uint64_t count = 0;
+  for (int i = 0; i < kBuckets; i++) {
+    auto c = other.counts_[i].load(std::memory_order_relaxed);
+    if (!c) continue;
+    Add(counts_[i], c);
+    count += c;
+  }
+  // Sum the buckets instead of reading other.count_, so the snapshot is
+  // consistent with itself even if other moved meanwhile.
+  Add(count_, count);
+  Add(sum_, other.sum_.load(std::memory_order_relaxed));
+  auto min = other.min_.load(std::memory_order_relaxed);
+  auto max = other.max_.load(std::memory_order_relaxed);
+  if (min < min_.load(std::memory_order_relaxed))
+    min_.store(min, std::memory_order_relaxed);
+  if (max > max_.load(std::memory_order_relaxed))
+    max_.store(max, std::memory_order_relaxed);
+}
+
+uint64_t collie_histogram::Min() const {
+  return Count() ? min_.load(std::memory_order_relaxed) : 0;
+}
+
+double collie_histogram::Mean() const {
+  auto count = Count();
+  return count ? sum_.load(std::memory_order_relaxed) * 1.0 / count : 0;
+}
+
+uint64_t collie_histogram::Percentile(double p) const {
+  auto count = Count();
+  if (!count) return 0;
+  auto target = (uint64_t)std::ceil(p * count);
+  if (target < 1) target = 1;
+  uint64_t seen = 0;
+  for (int i = 0; i < kBuckets; i++) {
+    seen += counts_[i].load(std::memory_order_relaxed);
+    if (seen < target) continue;
+    // Report the middle of the bucket, but never outside [min, max]
+    auto lo = LowerBound(i);
+    auto hi = (i + 1 < kBuckets) ? LowerBound(i + 1) : lo;
+    auto value = lo + (hi - lo) / 2;
+    if (value < Min()) value = Min();
+    if (value > Max()) value = Max();
+    return value;
+  }
+  return Max();
+}
+
+std::string collie_histogram::Summary() const {
+  std::ostringstream os;
+  os << "min: " << Min() << ", p50: " << Percentile(0.5)
+     << ", p99: " << Percentile(0.99) << ", p99.9: " << Percentile(0.999)
+     << ", max: " << Max();
+  return os.str();
+}
+
+}  // namespace Collie
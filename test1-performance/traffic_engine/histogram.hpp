@@ -0,0 +1,80 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+#ifndef COLLIE_HISTOGRAM_HPP
+#define COLLIE_HISTOGRAM_HPP
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <string>
+
+namespace Collie {
+
+// A streaming histogram over uint64_t values (e.g., nanoseconds) with
+// log-linear buckets: values below 2^kSubBits are exact, and each larger
+// power of two is split into 2^kSubBits linear sub-buckets, so a reported
+// percentile is off by at most 1/2^kSubBits. Record() is constant time.
+//
+// One thread records; any other thread may Merge() it into its own copy at
+// any time to take a snapshot, so no sorting or locking on the hot path.
+class collie_histogram {
+ public:
+  static constexpr int kSubBits = 5;
+  static constexpr int kSubBuckets = 1 << kSubBits;
+  static constexpr int kBuckets = (64 - kSubBits + 1) * kSubBuckets;
+
+ private:
+  std::atomic<uint64_t> counts_[kBuckets];
+  std::atomic<uint64_t> count_{0};
+  std::atomic<uint64_t> sum_{0};
+  std::atomic<uint64_t> min_{std::numeric_limits<uint64_t>::max()};
+  std::atomic<uint64_t> max_{0};
+
+  // Single writer: plain load and store, no locked instruction
+  static void Add(std::atomic<uint64_t> &a, uint64_t v) {
+    a.store(a.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+  }
+  static int Index(uint64_t value) {
+    if (value < kSubBuckets) return value;
+    int shift = 63 - __builtin_clzll(value) - kSubBits;
+    return ((shift + 1) << kSubBits) + (value >> shift) - kSubBuckets;
+  }
+  static uint64_t LowerBound(int idx);
+
+ public:
+  collie_histogram() { Reset(); }
+  collie_histogram(const collie_histogram &) = delete;
+  collie_histogram &operator=(const collie_histogram &) = delete;
+
+  void Record(uint64_t value) {
+    Add(counts_[Index(value)], 1);
+    Add(count_, 1);
+    Add(sum_, value);
+    if (value < min_.load(std::memory_order_relaxed))
+      min_.store(value, std::memory_order_relaxed);
+    if (value > max_.load(std::memory_order_relaxed))
+      max_.store(value, std::memory_order_relaxed);
+  }
+
+  // Not thread-safe against Record() on this histogram
+  void Reset();
+  // Adds other's counts into this one. Safe while other is being recorded.
+  void Merge(const collie_histogram &other);
+
+  uint64_t Count() const { return count_.load(std::memory_order_relaxed); }
+  uint64_t Min() const;
+  uint64_t Max() const { return max_.load(std::memory_order_relaxed); }
+  double Mean() const;
+  // p in [0, 1]
+  uint64_t Percentile(double p) const;
+  // "min: x, p50: x, p99: x, p99.9: x, max: x"
+  std::string Summary() const;
+};
+
+}  // namespace Collie
+
+#endif
@@ -24,7 +24,9 @@ int main(int argc, char **argv) {
       LOG(ERROR) << "Collie server initialization failed. Exit...";
       return -1;
     }
-    listen_thread = std::thread(&Collie::rdma_context::Listen, pici_server);
+    listen_thread = std::thread(FLAGS_cm ? &Collie::rdma_context::ListenCm
+                                         : &Collie::rdma_context::Listen,
+                                pici_server);
     server_thread =
         std::thread(&Collie::rdma_context::ServerDatapath, pici_server);
     LOG(INFO) << "Collie server has started.";
@@ -39,10 +41,12 @@ int main(int argc, char **argv) {
       LOG(ERROR) << "Collie client initialization failed. Exit... ";
       return -1;
     }
-    for (size_t i = 0; i < host_vec.size(); i++) {
-      if (pici_client->Connect(host_vec[i].c_str(), FLAGS_port, i)) {
-        LOG(ERROR) << "Collie client connect to " << host_vec[i] << " failed";
-      }
+    auto connected = FLAGS_cm
+                         ? pici_client->ConnectCm(host_vec, FLAGS_port)
+                         : pici_client->ConnectAll(host_vec, FLAGS_port);
+    if (connected < (int)host_vec.size()) {
+      LOG(ERROR) << "Collie client connected to " << connected << " of "
+                 << host_vec.size() << " hosts";
     }
     pici_client->ClientDatapath();
   }
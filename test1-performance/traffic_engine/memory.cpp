@@ -8,11 +8,90 @@
 #include "memory.hpp"
 
 #include <malloc.h>
+#include <numa.h>
+#include <numaif.h>
+#include <sys/mman.h>
+
+// Older glibc only has the shift
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
 
 namespace Collie {
 
+char *rdma_region::HostAllocate(size_t size) {
+  auto huge = ParseHugepage(FLAGS_hugepage);
+  page_size_ = huge ? huge : sysconf(_SC_PAGESIZE);
+  // Hugepages are always prefaulted
+  if (huge || FLAGS_populate) return MapAllocate(size, huge);
+  if (numa_ < 0) {
+    alloc_ = kHeap;
+    if (align_) return (char *)memalign(page_size_, size);
+    return (char *)malloc(size);
+  }
+  // Page aligned anyway; bound to the node before the first touch
+  if (numa_available() < 0 || numa_ > numa_max_node()) {
+    LOG(ERROR) << "NUMA node " << numa_ << " is not available";
+    return nullptr;
+  }
+  alloc_ = kNuma;
+  return (char *)numa_alloc_onnode(size, numa_);
+}
+
+char *rdma_region::MapAllocate(size_t size, bool huge) {
+  size = (size + page_size_ - 1) / page_size_ * page_size_;
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+  if (huge) {
+    flags |= MAP_HUGETLB |
+             (page_size_ == kHugePage1G ? MAP_HUGE_1GB : MAP_HUGE_2MB);
+  }
+  // Without a node to bind to first, the kernel prefaults in one go
+  if (numa_ < 0) flags |= MAP_POPULATE;
+  auto buffer = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (buffer == MAP_FAILED) {
+    PLOG(ERROR) << "mmap() of " << size << " bytes failed";
+    if (huge)
+      LOG(ERROR) << "Are enough " << FLAGS_hugepage << " hugepages reserved "
+                 << "in /sys/kernel/mm/hugepages?";
+    return nullptr;
+  }
+  alloc_ = kMap;
+  bytes_ = size;  // Rounded up to pages
+  if (numa_ >= 0) {
+    if (numa_available() < 0 || numa_ > numa_max_node()) {
+      LOG(ERROR) << "NUMA node " << numa_ << " is not available";
+      munmap(buffer, size);
+      return nullptr;
+    }
+    numa_tonode_memory(buffer, size, numa_);
+    // Fault every page in now, rather than inside ibv_reg_mr() or, with
+    // ODP, on the datapath. Fresh pages are zeroed, so this writes no data.
+    for (size_t off = 0; off < size; off += page_size_)
+      ((volatile char *)buffer)[off] = 0;
+  }
+  return (char *)buffer;
+}
+
+size_t rdma_region::GetPages() const {
+  if (buffers_.empty() || !page_size_) return 0;
+  auto start = buffers_[0]->addr_ / page_size_;
+  auto end = (buffers_[0]->addr_ + (uint64_t)num_ * size_ - 1) / page_size_;
+  return end - start + 1;
+}
+
+int rdma_region::GetNode() const {
+  if (buffers_.empty()) return -1;
+  // ibv_reg_mr() has faulted the pages in, ask where the first one is
+  void *page = (void *)buffers_[0]->addr_;
+  int status = -1;
+  if (move_pages(0, 1, &page, nullptr, &status, 0) || status < 0) return -1;
+  return status;
+}
+
 int rdma_region::Mallocate() {
-  auto buf_size = num_ * size_;
+  // In 64 bits: --buf_num x --buf_size pools reach several GiB
+  size_t buf_size = (size_t)num_ * size_;
   int mrflags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ |
                 IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_ATOMIC;
   char *buffer = nullptr;
@@ -30,45 +109,72 @@ int rdma_region::Mallocate() {
       return -1;
     }
     buffer = (char *)ptr;
+    alloc_ = kGpu;
   } else {
-    if (align_) {
-      buffer = (char *)memalign(sysconf(_SC_PAGESIZE), buf_size);
-    } else {
-      buffer = (char *)malloc(buf_size);
-    }
+    buffer = HostAllocate(buf_size);
   }
 #else
-  if (align_) {
-    buffer = (char *)memalign(sysconf(_SC_PAGESIZE), buf_size);
-  } else {
-    buffer = (char *)malloc(buf_size);
-  }
+  buffer = HostAllocate(buf_size);
 #endif
   if (!buffer) {
     PLOG(ERROR) << "Memory Allocation Failed";
+    alloc_ = kNone;
     return -1;
   }
+  base_ = buffer;
+  if (!bytes_) bytes_ = buf_size;
+  if (FLAGS_odp) mrflags |= IBV_ACCESS_ON_DEMAND;
+  if (FLAGS_mw_window) mrflags |= IBV_ACCESS_MW_BIND;
   mr_ = ibv_reg_mr(pd_, buffer, buf_size, mrflags);
   if (!mr_) {
     PLOG(ERROR) << "ibv_reg_mr() failed";
+    Free();
     return -1;
   }
   for (size_t i = 0; i < num_; i++) {
     rdma_buffer *rbuf = new rdma_buffer((uint64_t)(buffer + size_ * i), size_,
                                         mr_->lkey, mr_->rkey);
-    buffers_.push(rbuf);
+    buffers_.push_back(rbuf);
   }
   return 0;
 }
 
+void rdma_region::Free() {
+  for (auto buf : buffers_) delete buf;
+  buffers_.clear();
+  ret_idx_ = 0;
+  if (mr_ && ibv_dereg_mr(mr_)) PLOG(ERROR) << "ibv_dereg_mr() failed";
+  mr_ = nullptr;
+  switch (alloc_) {
+    case kHeap:
+      free(base_);
+      break;
+    case kNuma:
+      numa_free(base_, bytes_);
+      break;
+    case kMap:
+      munmap(base_, bytes_);
+      break;
+#ifdef GDR
+    case kGpu:
+      cuMemFree((CUdeviceptr)base_);
+      break;
+#endif
+    default:
+      break;
+  }
+  alloc_ = kNone;
+  base_ = nullptr;
+  bytes_ = 0;
+}
+
 rdma_buffer *rdma_region::GetBuffer() {
   if (buffers_.empty()) {
     LOG(ERROR) << "The MR's buffer is empty";
     return nullptr;
   }
-  auto rbuf = buffers_.front();
-  buffers_.pop();
-  buffers_.push(rbuf);
+  auto rbuf = buffers_[ret_idx_++];
+  if (ret_idx_ == buffers_.size()) ret_idx_ = 0;
   return rbuf;
 }
 
@@ -8,6 +8,7 @@
 #ifndef RMEMORY_HPP
 #define RMEMORY_HPP
 #include <queue>
+#include <vector>
 
 #include "helper.hpp"
 
@@ -25,6 +26,12 @@ class rdma_buffer {
       : addr_(addr), size_(size), local_K_(local_K), remote_K_(remote_K) {}
 };
 
+// One entry of a buffer rotation table: where the next SGE points to.
+struct rdma_slot {
+  uint64_t addr;
+  uint32_t lkey;
+};
+
 class rdma_region {
  private:
   struct ibv_mr *mr_ = nullptr;
@@ -33,7 +40,18 @@ class rdma_region {
   int num_ = 0;
   uint32_t size_ = 0;
   bool align_ = false;
-  std::queue<rdma_buffer *> buffers_;
+  size_t ret_idx_ = 0;
+  std::vector<rdma_buffer *> buffers_;
+  // 0 for GPU memory
+  size_t page_size_ = 0;
+  // What Mallocate() got, for Free()
+  enum { kNone, kHeap, kNuma, kMap, kGpu } alloc_ = kNone;
+  char *base_ = nullptr;
+  size_t bytes_ = 0;
+  // Bound to node numa_ when it is >= 0
+  char *HostAllocate(size_t size);
+  // Prefaulted anonymous mapping, for --hugepage and --populate
+  char *MapAllocate(size_t size, bool huge);
 
  public:
   rdma_region(struct ibv_pd *pd, size_t size, int n, bool align, int numa)
@@ -43,8 +61,19 @@ class rdma_region {
   int Mallocate();
   // Allocate from GPU memory
   int Gallocate();
+  // Deregisters the MR and releases the memory of Mallocate()
+  void Free();
   // Pick a buffer in the order of FIFO
   rdma_buffer *GetBuffer();
+  // Pick a buffer by index. Read-only, so datapath threads can share it.
+  rdma_buffer *GetBuffer(size_t idx) const { return buffers_[idx]; }
+  size_t GetBufferNum() const { return buffers_.size(); }
+  // The node the memory actually sits on, -1 if unknown (e.g., GPU memory)
+  int GetNode() const;
+  // Pages the MR pins, of GetPageSize() bytes each
+  size_t GetPages() const;
+  size_t GetPageSize() const { return page_size_; }
+  struct ibv_mr *GetMr() const { return mr_; }
 };
 };  // namespace Collie
 
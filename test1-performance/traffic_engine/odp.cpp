@@ -0,0 +1,139 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+#include "odp.hpp"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+
+namespace Collie {
+
+void rdma_page_map::Init(const std::vector<rdma_region *> &regions) {
+  page_shift_ = __builtin_ctzll(sysconf(_SC_PAGESIZE));
+  ranges_.clear();
+  for (auto region : regions) {
+    if (!region->GetBufferNum()) continue;
+    auto first = region->GetBuffer((size_t)0);
+    auto last = region->GetBuffer(region->GetBufferNum() - 1);
+    ranges_.push_back({first->addr_, last->addr_ + last->size_, 0});
+  }
+  std::sort(ranges_.begin(), ranges_.end(),
+            [](const range &a, const range &b) { return a.start < b.start; });
+  size_t bits = 0;
+  for (auto &r : ranges_) {
+    r.first_bit = bits;
+    bits += ((r.end - 1) >> page_shift_) - (r.start >> page_shift_) + 1;
+  }
+  auto words = (bits + 63) / 64;
+  bits_.reset(new std::atomic<uint64_t>[words]);
+  for (size_t i = 0; i < words; i++) bits_[i].store(0);
+}
+
+const rdma_page_map::range *rdma_page_map::Find(uint64_t addr) const {
+  auto it = std::upper_bound(
+      ranges_.begin(), ranges_.end(), addr,
+      [](uint64_t a, const range &r) { return a < r.start; });
+  if (it == ranges_.begin()) return nullptr;
+  --it;
+  return addr < it->end ? &*it : nullptr;
+}
+
+bool rdma_page_map::Touch(uint64_t addr, uint32_t len) {
+  auto r = Find(addr);
+  if (!r || !len) return false;
+  bool fresh = false;
+  auto base = r->start >> page_shift_;
+  auto last = (std::min(addr + len, r->end) - 1) >> page_shift_;
+  for (auto page = addr >> page_shift_; page <= last; page++) {
+    auto bit = r->first_bit + page - base;
+    auto mask = 1ULL << (bit % 64);
+    auto &word = bits_[bit / 64];
+    // Test first, so warm pages cost no locked instruction
+    if (word.load(std::memory_order_relaxed) & mask) continue;
+    if (!(word.fetch_or(mask, std::memory_order_relaxed) & mask)) fresh = true;
+  }
+  return fresh;
+}
+
+bool rdma_page_map::Touched(uint64_t addr, uint32_t len) const {
+  auto r = Find(addr);
+  if (!r || !len) return true;
+  auto base = r->start >> page_shift_;
+  auto last = (std::min(addr + len, r->end) - 1) >> page_shift_;
+  for (auto page = addr >> page_shift_; page <= last; page++) {
+    auto bit = r->first_bit + page - base;
+    if (!(bits_[bit / 64].load(std::memory_order_relaxed) &
+          (1ULL << (bit % 64))))
+      return false;
+  }
+  return true;
+}
+
+void rdma_prefetcher::Start(struct ibv_pd *pd, const rdma_page_map *pages) {
+  pd_ = pd;
+  pages_ = pages;
+  ring_.reset(new struct ibv_sge[kRingSize]);
+  thread_ = std::thread(&rdma_prefetcher::Run, this);
+}
+
+void rdma_prefetcher::Stop() {
+  if (!thread_.joinable()) return;
+  stop_.store(true);
+  thread_.join();
+}
+
+void rdma_prefetcher::Run() {
+  struct ibv_sge sges[kMaxSge];
+  while (!stop_.load(std::memory_order_relaxed)) {
+    auto tail = tail_.load(std::memory_order_relaxed);
+    auto head = head_.load(std::memory_order_acquire);
+    if (tail == head) {
+      std::this_thread::sleep_for(std::chrono::microseconds(10));
+      continue;
+    }
+    int n = 0;
+    for (; tail != head && n < kMaxSge; tail++) {
+      auto &sge = ring_[tail & (kRingSize - 1)];
+      // Pages the datapath has used are mapped already
+      if (pages_->Touched(sge.addr, sge.length)) {
+        skipped_++;
+        continue;
+      }
+      sges[n++] = sge;
+    }
+    tail_.store(tail, std::memory_order_release);
+    if (!n) continue;
+    auto start = Now64Ns();
+    if (ibv_advise_mr(pd_, IBV_ADVISE_MR_ADVICE_PREFETCH_WRITE,
+                      IBV_ADVISE_MR_FLAG_FLUSH, sges, n)) {
+      PLOG(ERROR) << "ibv_advise_mr() failed, prefetch stopped";
+      return;
+    }
+    ns_ += Now64Ns() - start;
+    calls_++;
+    sges_ += n;
+  }
+}
+
+void rdma_prefetcher::PrintStats(int worker) {
+  if (!pushes_) {
+    LOG(WARNING) << "thread " << worker
+                 << " prefetch: --prefetch_window is set but no endpoint "
+                    "issued a prefetch";
+    return;
+  }
+  auto calls = calls_.load();
+  LOG(INFO) << "thread " << worker << " prefetch: " << sges_.load()
+            << " SGEs in " << calls << " ibv_advise_mr() calls, "
+            << (calls ? ns_.load() / 1000.0 / calls : 0) << " us each, "
+            << skipped_.load() << " warm skipped, " << drops_
+            << " dropped on a full ring";
+}
+
+}  // namespace Collie
@@ -0,0 +1,97 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+#ifndef RDMA_ODP_HPP
+#define RDMA_ODP_HPP
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "helper.hpp"
+#include "memory.hpp"
+
+namespace Collie {
+
+// With --odp the local MRs are registered with IBV_ACCESS_ON_DEMAND, so the
+// NIC faults their pages in on first access. The page map tells which send
+// pages the datapath has touched: a batch with an untouched page is "cold"
+// and its latency is reported apart from the warm ones.
+class rdma_page_map {
+ private:
+  struct range {
+    uint64_t start;
+    uint64_t end;
+    size_t first_bit;
+  };
+  std::vector<range> ranges_;  // Sorted by start
+  std::unique_ptr<std::atomic<uint64_t>[]> bits_;
+  size_t page_shift_ = 12;
+
+  const range *Find(uint64_t addr) const;
+
+ public:
+  void Init(const std::vector<rdma_region *> &regions);
+  // Marks the pages of [addr, addr + len), true if one was new. Workers
+  // share the pool, so the first of them to touch a page sees it cold.
+  bool Touch(uint64_t addr, uint32_t len);
+  // True if the datapath has touched every page of the range already
+  bool Touched(uint64_t addr, uint32_t len) const;
+};
+
+// Advises the NIC to fault in the pages the datapath is about to use. The
+// endpoints push SGEs --prefetch_window WRs ahead of their posts into a
+// lock-free single-producer ring; a helper thread drains it and calls
+// ibv_advise_mr() with FLUSH, so the wait stays off the datapath.
+class rdma_prefetcher {
+ public:
+  static constexpr size_t kRingSize = 4096;  // A power of 2
+
+ private:
+  struct ibv_pd *pd_ = nullptr;
+  const rdma_page_map *pages_ = nullptr;
+  std::unique_ptr<struct ibv_sge[]> ring_;
+  std::atomic<size_t> head_{0};  // Written by the datapath
+  std::atomic<size_t> tail_{0};  // Written by the helper thread
+  std::atomic<bool> stop_{false};
+  std::thread thread_;
+
+  // Statistics
+  uint64_t pushes_ = 0;  // Datapath side
+  uint64_t drops_ = 0;   // Ring full, datapath side
+  std::atomic<uint64_t> calls_{0};
+  std::atomic<uint64_t> sges_{0};
+  std::atomic<uint64_t> skipped_{0};
+  std::atomic<uint64_t> ns_{0};
+
+  void Run();
+
+ public:
+  ~rdma_prefetcher() { Stop(); }
+  void Start(struct ibv_pd *pd, const rdma_page_map *pages);
+  void Stop();
+
+  void Push(uint64_t addr, uint32_t len, uint32_t lkey) {
+    pushes_++;
+    auto head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) == kRingSize) {
+      drops_++;
+      return;
+    }
+    auto &sge = ring_[head & (kRingSize - 1)];
+    sge.addr = addr;
+    sge.length = len;
+    sge.lkey = lkey;
+    head_.store(head + 1, std::memory_order_release);
+  }
+  void PrintStats(int worker);
+};
+
+}  // namespace Collie
+
+#endif
@@ -0,0 +1,99 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+#include "pacer.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <sstream>
+
+namespace Collie {
+
+int rdma_pacer::Init(uint64_t seed) {
+  auto cycles_per_us = CyclesPerUs();
+  double units_per_us = 0;
+  if (FLAGS_rate_gbps > 0) {
+    by_bytes_ = true;
+    units_per_us = FLAGS_rate_gbps * 1000.0 / 8;
+  } else {
+    by_bytes_ = false;
+    units_per_us = FLAGS_rate_mrps;
+  }
+  if (units_per_us <= 0) {
+    LOG(ERROR) << "The offered load should be positive";
+    return -1;
+  }
+  cycles_per_unit_ = cycles_per_us / units_per_us;
+  burst_cycles_ = kPaceBurstUs * cycles_per_us;
+  if (FLAGS_arrival == "poisson") {
+    arrival_ = kPoisson;
+  } else if (FLAGS_arrival == "onoff") {
+    arrival_ = kOnOff;
+    on_cycles_ = FLAGS_on_us * cycles_per_us;
+    period_cycles_ = (FLAGS_on_us + FLAGS_off_us) * cycles_per_us;
+  } else {
+    arrival_ = kConstant;
+  }
+  // e.g., 1000:1,200:4
+  schedule_.clear();
+  schedule_cycles_ = 0;
+  std::stringstream ss(FLAGS_rate_schedule);
+  double ms, factor;
+  char c;
+  while (ss >> ms >> c >> factor) {
+    if (c != ':' || ms <= 0 || factor < 0) {
+      LOG(ERROR) << "Bad rate schedule " << FLAGS_rate_schedule;
+      return -1;
+    }
+    schedule_cycles_ += ms * 1000 * cycles_per_us;
+    schedule_.push_back(std::make_pair(schedule_cycles_, factor));
+    if (ss.peek() == ',') ss.ignore();
+  }
+  if (!ss.eof()) {
+    LOG(ERROR) << "Bad rate schedule " << FLAGS_rate_schedule;
+    return -1;
+  }
+  seed_ = SeedRand(seed);
+  start_ = NowCycles();
+  next_ = start_;
+  factor_until_ = 0;
+  return 0;
+}
+
+void rdma_pacer::UpdateFactor(uint64_t now) {
+  auto t = now - start_;
+  factor_ = 1;
+  factor_until_ = std::numeric_limits<uint64_t>::max();
+  if (arrival_ == kOnOff) {
+    auto phase = t % period_cycles_;
+    if (phase < on_cycles_) {
+      factor_until_ = now + on_cycles_ - phase;
+    } else {
+      factor_ = 0;
+      factor_until_ = now + period_cycles_ - phase;
+    }
+  }
+  if (!schedule_.empty()) {
+    auto phase = t % schedule_cycles_;
+    for (auto &step : schedule_) {
+      if (phase >= step.first) continue;
+      factor_ *= step.second;
+      factor_until_ = std::min(factor_until_, now + step.first - phase);
+      break;
+    }
+  }
+}
+
+double rdma_pacer::Exp() {
+  auto r = FastRand(&seed_);
+  // Uniform in (0, 1]
+  double u = ((r >> 11) + 1) * (1.0 / 9007199254740992.0);
+  return -std::log(u);
+}
+
+}  // namespace Collie
@@ -0,0 +1,70 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+#ifndef RDMA_PACER_HPP
+#define RDMA_PACER_HPP
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "helper.hpp"
+
+namespace Collie {
+
+// Open-loop pacing for one QP, or for all QPs of a worker. The token bucket
+// is kept as the time the next post is due (next_, in cycles), so a check
+// is one compare against the cycle counter. Gaps are the post's cost over
+// the rate: fixed for constant and on/off arrivals, exponential for Poisson.
+class rdma_pacer {
+ private:
+  enum { kConstant, kPoisson, kOnOff } arrival_ = kConstant;
+  // Bytes (--rate_gbps) or messages (--rate_mrps)
+  bool by_bytes_ = false;
+  double cycles_per_unit_ = 0;
+  double next_ = 0;
+  uint64_t burst_cycles_ = 0;
+  uint64_t start_ = 0;
+  uint64_t on_cycles_ = 0;
+  uint64_t period_cycles_ = 0;
+  // (end of the step since the schedule's start, rate factor)
+  std::vector<std::pair<uint64_t, double>> schedule_;
+  uint64_t schedule_cycles_ = 0;
+  // Rate factor from on/off and the schedule, valid until factor_until_
+  double factor_ = 1;
+  uint64_t factor_until_ = 0;
+  uint64_t seed_ = 0;
+
+  void UpdateFactor(uint64_t now);
+  // Exponentially distributed with mean 1
+  double Exp();
+
+ public:
+  int Init(uint64_t seed);
+  bool ByBytes() { return by_bytes_; }
+  // True if a post is due at now (cycles). Cheap, so the caller can test
+  // it before working out the cost.
+  bool Due(uint64_t now) {
+    if (now >= factor_until_) UpdateFactor(now);
+    if (factor_ == 0) {
+      next_ = now;  // Silence banks nothing either
+      return false;
+    }
+    return now >= next_;
+  }
+  // Consumes cost (bytes or messages) of a post Due() let through
+  void Consume(uint64_t now, uint64_t cost) {
+    // Idle time banks at most one burst
+    if (next_ + burst_cycles_ < now) next_ = now - burst_cycles_;
+    auto gap = cost * cycles_per_unit_ / factor_;
+    if (arrival_ == kPoisson) gap *= Exp();
+    next_ += gap;
+  }
+};
+
+}  // namespace Collie
+
+#endif
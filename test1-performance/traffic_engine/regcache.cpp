@@ -0,0 +1,160 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+#include "regcache.hpp"
+
+#include <cstdlib>
+
+namespace Collie {
+
+rdma_size_pool::~rdma_size_pool() {
+  for (auto &c : classes_)
+    for (auto buf : c.bufs) free(buf);
+}
+
+int rdma_size_pool::Init(uint64_t ws_bytes, uint32_t max_size) {
+  classes_.clear();
+  for (uint64_t size = kMinClass;; size *= 2) {
+    size_class c;
+    c.size = size;
+    // Rings are filled lazily, reserving only the slots
+    auto n = std::max<uint64_t>(ws_bytes / size, 1);
+    c.bufs.reserve(n);
+    c.in_use.assign(n, false);
+    classes_.push_back(std::move(c));
+    if (size >= max_size) break;
+  }
+  return 0;
+}
+
+char *rdma_size_pool::Alloc(uint32_t size, uint32_t *cls, uint32_t *idx) {
+  uint32_t k = 0;
+  while (k < classes_.size() - 1 && classes_[k].size < size) k++;
+  auto &c = classes_[k];
+  if (c.size < size) return nullptr;
+  auto n = c.in_use.size();
+  for (size_t tries = 0; tries < n; tries++) {
+    auto i = c.next;
+    c.next = (c.next == n - 1) ? 0 : c.next + 1;
+    if (i == c.bufs.size()) {
+      void *buf = nullptr;
+      if (posix_memalign(&buf, kMinClass, c.size)) {
+        LOG(ERROR) << "posix_memalign() of " << c.size << " bytes failed";
+        return nullptr;
+      }
+      c.bufs.push_back((char *)buf);
+    }
+    if (c.in_use[i]) continue;
+    c.in_use[i] = true;
+    *cls = k;
+    *idx = i;
+    return c.bufs[i];
+  }
+  return nullptr;
+}
+
+rdma_reg_cache::~rdma_reg_cache() {
+  for (auto &kv : entries_) ibv_dereg_mr(kv.second.mr);
+}
+
+rdma_reg_cache::entry *rdma_reg_cache::Get(uint64_t addr, uint32_t len) {
+  // The last range starting at or before addr is the only candidate
+  auto it = entries_.upper_bound(addr);
+  if (it != entries_.begin()) {
+    auto &e = std::prev(it)->second;
+    if (e.end >= addr + len) {
+      hits_++;
+      lru_.splice(lru_.begin(), lru_, e.lru);
+      e.refs++;
+      return &e;
+    }
+  }
+  misses_++;
+  auto start = Now64Ns();
+  auto mr = ibv_reg_mr(pd_, (void *)addr, len,
+                       IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ |
+                           IBV_ACCESS_REMOTE_WRITE);
+  reg_ns_ += Now64Ns() - start;
+  if (!mr) {
+    PLOG(ERROR) << "ibv_reg_mr() failed";
+    return nullptr;
+  }
+  auto &e = entries_[addr];
+  if (e.mr) {
+    // A shorter range at the same start: the new one replaces it
+    bytes_ -= e.end - e.start;
+    lru_.erase(e.lru);
+    if (e.refs)
+      LOG(WARNING) << "Overlapping registrations at 0x" << std::hex << addr;
+    ibv_dereg_mr(e.mr);
+  }
+  e.start = addr;
+  e.end = addr + len;
+  e.mr = mr;
+  e.refs = 1;
+  lru_.push_front(&e);
+  e.lru = lru_.begin();
+  bytes_ += len;
+  if (bytes_ > capacity_) Evict();
+  return &e;
+}
+
+void rdma_reg_cache::Put(entry *e) {
+  e->refs--;
+  if (!e->refs && bytes_ > capacity_) Evict();
+}
+
+void rdma_reg_cache::Evict() {
+  auto it = lru_.end();
+  while (bytes_ > capacity_ && it != lru_.begin()) {
+    auto e = *--it;
+    if (e->refs) continue;  // In flight
+    auto start = Now64Ns();
+    ibv_dereg_mr(e->mr);
+    dereg_ns_ += Now64Ns() - start;
+    evictions_++;
+    bytes_ -= e->end - e->start;
+    it = lru_.erase(it);
+    entries_.erase(e->start);
+  }
+}
+
+void rdma_reg_cache::PrintStats(int worker) {
+  auto lookups = hits_ + misses_;
+  LOG(INFO) << "thread " << worker << " registration cache: "
+            << (lookups ? 100.0 * hits_ / lookups : 0) << "% hits of "
+            << lookups << ", " << (misses_ ? reg_ns_ / 1000.0 / misses_ : 0)
+            << " us/ibv_reg_mr, " << evictions_ << " evictions at "
+            << (evictions_ ? dereg_ns_ / 1000.0 / evictions_ : 0)
+            << " us/ibv_dereg_mr, " << bytes_ << "/" << capacity_
+            << " bytes registered";
+}
+
+int rdma_dyn_memory::Init(struct ibv_pd *pd, uint32_t max_size) {
+  cache_.Init(pd, (uint64_t)FLAGS_reg_cache_mb << 20);
+  return pool_.Init((uint64_t)FLAGS_dyn_ws_mb << 20, max_size);
+}
+
+int rdma_dyn_memory::Acquire(struct ibv_sge *sge, rdma_dyn_buf *buf) {
+  auto addr = pool_.Alloc(sge->length, &buf->cls, &buf->idx);
+  if (!addr) {
+    LOG(ERROR) << "No free dynamic buffer of " << sge->length
+               << " bytes, raise --dyn_ws_mb";
+    return -1;
+  }
+  // Register the whole buffer, so later messages in it can hit
+  buf->reg = cache_.Get((uint64_t)addr, pool_.ClassSize(buf->cls));
+  if (!buf->reg) {
+    pool_.Free(buf->cls, buf->idx);
+    return -1;
+  }
+  sge->addr = (uint64_t)addr;
+  sge->lkey = buf->reg->mr->lkey;
+  return 0;
+}
+
+}  // namespace Collie
@@ -0,0 +1,117 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+#ifndef RDMA_REGCACHE_HPP
+#define RDMA_REGCACHE_HPP
+#include <cstdint>
+#include <list>
+#include <map>
+#include <vector>
+
+#include "helper.hpp"
+
+namespace Collie {
+
+// Dynamic buffers (--dynamic_buf) model applications that send from
+// transient buffers: every message gets a buffer from a size-classed pool
+// and registers it through a pin-down cache before posting. Both belong to
+// one worker, so nothing here is thread-safe.
+
+// Size classes are powers of 2 from kMinClass up. Each class is a ring of
+// buffers covering --dyn_ws_mb, allocated on first use and walked
+// round-robin, so the working set (and the cache hit rate against
+// --reg_cache_mb) is under control. Buffers still in flight are skipped.
+class rdma_size_pool {
+ public:
+  static constexpr uint32_t kMinClass = 64;
+
+ private:
+  struct size_class {
+    uint32_t size = 0;
+    std::vector<char *> bufs;
+    std::vector<bool> in_use;
+    size_t next = 0;
+  };
+  std::vector<size_class> classes_;
+
+ public:
+  ~rdma_size_pool();
+  int Init(uint64_t ws_bytes, uint32_t max_size);
+  // nullptr when every buffer of the class is in flight
+  char *Alloc(uint32_t size, uint32_t *cls, uint32_t *idx);
+  void Free(uint32_t cls, uint32_t idx) { classes_[cls].in_use[idx] = false; }
+  uint32_t ClassSize(uint32_t cls) const { return classes_[cls].size; }
+};
+
+// A pin-down cache: registered ranges in an interval map keyed by start
+// address, with LRU eviction once the registered bytes exceed the capacity.
+// Ranges in use by WRs in flight are never evicted. Capacity 0 registers
+// every message and deregisters it on completion.
+class rdma_reg_cache {
+ public:
+  struct entry {
+    uint64_t start = 0;
+    uint64_t end = 0;
+    struct ibv_mr *mr = nullptr;
+    uint32_t refs = 0;
+    std::list<entry *>::iterator lru;
+  };
+
+ private:
+  struct ibv_pd *pd_ = nullptr;
+  uint64_t capacity_ = 0;
+  uint64_t bytes_ = 0;
+  std::map<uint64_t, entry> entries_;
+  std::list<entry *> lru_;  // Most recently used first
+
+  // Statistics
+  uint64_t hits_ = 0;
+  uint64_t misses_ = 0;
+  uint64_t evictions_ = 0;
+  uint64_t reg_ns_ = 0;
+  uint64_t dereg_ns_ = 0;
+
+  void Evict();
+
+ public:
+  ~rdma_reg_cache();
+  void Init(struct ibv_pd *pd, uint64_t capacity) {
+    pd_ = pd;
+    capacity_ = capacity;
+  }
+  // A registration covering [addr, addr + len), pinned until Put()
+  entry *Get(uint64_t addr, uint32_t len);
+  void Put(entry *e);
+  void PrintStats(int worker);
+};
+
+// One message buffer: where it lives in the pool and its registration
+struct rdma_dyn_buf {
+  uint32_t cls;
+  uint32_t idx;
+  rdma_reg_cache::entry *reg;
+};
+
+class rdma_dyn_memory {
+ private:
+  rdma_size_pool pool_;
+  rdma_reg_cache cache_;
+
+ public:
+  int Init(struct ibv_pd *pd, uint32_t max_size);
+  // Fills sge with a fresh registered buffer of sge->length bytes
+  int Acquire(struct ibv_sge *sge, rdma_dyn_buf *buf);
+  void Release(const rdma_dyn_buf &buf) {
+    cache_.Put(buf.reg);
+    pool_.Free(buf.cls, buf.idx);
+  }
+  void PrintStats(int worker) { cache_.PrintStats(worker); }
+};
+
+}  // namespace Collie
+
+#endif
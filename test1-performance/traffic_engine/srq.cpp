@@ -0,0 +1,78 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+#include "srq.hpp"
+
+#include <algorithm>
+
+namespace Collie {
+
+int rdma_srq::Create(struct ibv_pd *pd) {
+  struct ibv_srq_init_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.srq_context = this;
+  attr.attr.max_wr = depth_;
+  attr.attr.max_sge = kMaxSge;
+  srq_ = ibv_create_srq(pd, &attr);
+  if (!srq_) {
+    PLOG(ERROR) << "ibv_create_srq() failed";
+    return -1;
+  }
+  return 0;
+}
+
+int rdma_srq::Arm() {
+  struct ibv_srq_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.srq_limit = limit_;
+  if (ibv_modify_srq(srq_, &attr, IBV_SRQ_LIMIT)) {
+    PLOG(ERROR) << "ibv_modify_srq() failed to arm SRQ " << id_;
+    return -1;
+  }
+  return 0;
+}
+
+int rdma_srq::PostRecv(const std::vector<rdma_request> &requests,
+                       uint32_t batch_size) {
+  if (!batch_size) return 0;
+  if (ring_.Empty() &&
+      ring_.Build(requests, *rotation_, id_, reinterpret_cast<uint64_t>(this)))
+    return -1;
+  struct ibv_recv_wr *head = ring_.Cut(batch_size);
+  struct ibv_recv_wr *bad_wr;
+  auto ret = ibv_post_srq_recv(srq_, head, &bad_wr);
+  ring_.Mend();
+  if (ret) {
+    PLOG(ERROR) << "ibv_post_srq_recv() failed";
+    LOG(ERROR) << "Return value is " << ret;
+    return -1;
+  }
+  credits_ -= batch_size;
+  return 0;
+}
+
+int rdma_srq::Refill(const std::vector<rdma_request> &requests, int batch_size,
+                     bool force) {
+  if (!force) {
+    if (FLAGS_srq_event) {
+      // The NIC tells us when the SRQ drains. The event is one-shot.
+      if (!limit_reached_.load(std::memory_order_acquire)) return 0;
+      limit_reached_.store(false, std::memory_order_relaxed);
+    } else if (depth_ - credits_ > limit_) {
+      // Count completions: still above the watermark
+      return 0;
+    }
+  }
+  while (credits_ > 0) {
+    uint32_t num_to_post = std::min(credits_, (uint32_t)batch_size);
+    if (PostRecv(requests, num_to_post)) return -1;
+  }
+  if (FLAGS_srq_event) return Arm();
+  return 0;
+}
+
+}  // namespace Collie
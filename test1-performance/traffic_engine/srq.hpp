@@ -0,0 +1,61 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+#ifndef RDMA_SRQ_HPP
+#define RDMA_SRQ_HPP
+#include <atomic>
+
+#include "endpoint.hpp"
+#include "helper.hpp"
+
+namespace Collie {
+
+// A shared receive queue. Many QPs of one worker consume from it and only
+// that worker refills it, so its credits need no lock.
+class rdma_srq {
+ private:
+  struct ibv_srq *srq_ = nullptr;
+  uint32_t id_ = 0;
+  uint32_t depth_ = 0;
+  uint32_t limit_ = 0;
+  uint32_t credits_ = 0;
+  // Set by the async event thread on IBV_EVENT_SRQ_LIMIT_REACHED
+  std::atomic<bool> limit_reached_{false};
+  rdma_recv_ring ring_;
+  const std::vector<rdma_slot> *rotation_ = nullptr;
+
+  int PostRecv(const std::vector<rdma_request> &requests, uint32_t batch_size);
+  int Arm();
+
+ public:
+  rdma_srq(uint32_t id, uint32_t depth, uint32_t limit,
+           const std::vector<rdma_slot> *rotation)
+      : id_(id),
+        depth_(depth),
+        limit_(limit),
+        credits_(depth),
+        rotation_(rotation) {}
+  ~rdma_srq() {
+    if (srq_) ibv_destroy_srq(srq_);
+  }
+
+  int Create(struct ibv_pd *pd);
+  // Post every free slot if the SRQ has drained to its watermark
+  int Refill(const std::vector<rdma_request> &requests, int batch_size,
+             bool force);
+  int RecvHandler(struct ibv_wc *wc) {
+    credits_++;
+    return 0;
+  }
+  void LimitReached() { limit_reached_.store(true, std::memory_order_release); }
+
+  struct ibv_srq *GetSrq() { return srq_; }
+  uint32_t GetDepth() { return depth_; }
+};
+}  // namespace Collie
+
+#endif
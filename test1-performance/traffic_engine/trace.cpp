@@ -0,0 +1,134 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+#include "trace.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+
+namespace Collie {
+
+int rdma_trace_writer::Open(const std::string &path) {
+  fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd_ < 0) {
+    PLOG(ERROR) << "Cannot create trace " << path;
+    return -1;
+  }
+  if (MapSegment(0)) return -1;
+  auto header = reinterpret_cast<trace_file_header *>(map_);
+  memcpy(header->magic, kTraceMagic, sizeof(kTraceMagic));
+  header->version = kTraceVersion;
+  pos_ = sizeof(trace_file_header);
+  ns_per_cycle_ = 1000.0 / CyclesPerUs();
+  start_ = NowCycles();
+  return 0;
+}
+
+int rdma_trace_writer::MapSegment(size_t offset) {
+  if (map_) {
+    msync(map_, kTraceSegment, MS_ASYNC);
+    munmap(map_, kTraceSegment);
+    map_ = nullptr;
+  }
+  if (ftruncate(fd_, offset + kTraceSegment)) {
+    PLOG(ERROR) << "ftruncate() failed on the trace";
+    return -1;
+  }
+  auto map = mmap(nullptr, kTraceSegment, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  fd_, offset);
+  if (map == MAP_FAILED) {
+    PLOG(ERROR) << "mmap() failed on the trace";
+    return -1;
+  }
+  map_ = (char *)map;
+  map_off_ = offset;
+  pos_ = 0;
+  return 0;
+}
+
+void rdma_trace_writer::Close() {
+  if (fd_ < 0) return;
+  if (map_) {
+    msync(map_, kTraceSegment, MS_SYNC);
+    munmap(map_, kTraceSegment);
+    map_ = nullptr;
+  }
+  // Drop the unused tail of the last segment
+  if (ftruncate(fd_, map_off_ + pos_)) PLOG(ERROR) << "ftruncate() failed";
+  close(fd_);
+  fd_ = -1;
+  LOG(INFO) << "Recorded " << records_ << " WRs";
+}
+
+rdma_trace_reader::~rdma_trace_reader() {
+  if (map_) munmap((void *)map_, size_);
+}
+
+int rdma_trace_reader::Open(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    PLOG(ERROR) << "Cannot open trace " << path;
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) || (size_t)st.st_size < sizeof(trace_file_header)) {
+    LOG(ERROR) << "Trace " << path << " is too short";
+    close(fd);
+    return -1;
+  }
+  size_ = st.st_size;
+  auto map = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    PLOG(ERROR) << "mmap() failed on the trace";
+    return -1;
+  }
+  map_ = (const char *)map;
+  auto header = reinterpret_cast<const trace_file_header *>(map_);
+  if (memcmp(header->magic, kTraceMagic, sizeof(kTraceMagic)) ||
+      header->version != kTraceVersion) {
+    LOG(ERROR) << path << " is not a version " << kTraceVersion << " trace";
+    return -1;
+  }
+  // One pass up front: checks the records and finds the largest SGE, so
+  // the buffers can be sized before replay starts
+  Rewind();
+  records_ = 0;
+  max_length_ = 0;
+  while (auto rec = Next()) {
+    // The lengths have to be inside the record, and the record inside the
+    // file, before anything reads them
+    if (rec->num_sge > kMaxSge || pos_ > size_ ||
+        rec->size8 * 8u < sizeof(trace_wr) + rec->num_sge * sizeof(uint32_t)) {
+      LOG(ERROR) << "Corrupted record " << records_ << " in " << path;
+      return -1;
+    }
+    switch (rec->opcode) {
+      case IBV_WR_RDMA_WRITE:
+      case IBV_WR_RDMA_WRITE_WITH_IMM:
+      case IBV_WR_RDMA_READ:
+      case IBV_WR_SEND:
+      case IBV_WR_SEND_WITH_IMM:
+        break;
+      default:
+        LOG(ERROR) << "Unknown opcode " << (int)rec->opcode << " in record "
+                   << records_ << " of " << path;
+        return -1;
+    }
+    for (int j = 0; j < rec->num_sge; j++)
+      max_length_ = std::max(max_length_, rec->Lengths()[j]);
+    records_++;
+  }
+  Rewind();
+  LOG(INFO) << "Loaded " << records_ << " WRs from " << path;
+  return 0;
+}
+
+}  // namespace Collie
@@ -0,0 +1,124 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+#ifndef RDMA_TRACE_HPP
+#define RDMA_TRACE_HPP
+#include <cstdint>
+#include <string>
+
+#include "helper.hpp"
+
+namespace Collie {
+
+// Verbs traces (--trace_record/--trace_replay). Each datapath thread writes
+// its own file, <path>.<worker id>: a 16-byte header, then one record per
+// posted WR, 8-byte aligned, in segments of kTraceSegment bytes. A record
+// with size8 == 0 (the zero fill of a segment) means "go to the next one".
+constexpr char kTraceMagic[8] = {'C', 'O', 'L', 'L', 'I', 'E', 'T', 'R'};
+constexpr uint32_t kTraceVersion = 1;
+constexpr size_t kTraceSegment = 64ULL << 20;
+
+struct trace_file_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+};
+
+struct trace_wr {
+  uint64_t ts_ns;  // Since the recording started
+  uint32_t qp;     // Endpoint id
+  uint8_t opcode;  // enum ibv_wr_opcode
+  uint8_t num_sge;
+  uint8_t last;   // The last WR of one ibv_post_send()
+  uint8_t size8;  // Record size in 8-byte words, header included
+  uint32_t rbuf_idx;
+  uint32_t roffset;  // Offset inside the remote buffer
+  // Followed by num_sge uint32_t SGE lengths
+  const uint32_t *Lengths() const {
+    return reinterpret_cast<const uint32_t *>(this + 1);
+  }
+  uint32_t *Lengths() { return reinterpret_cast<uint32_t *>(this + 1); }
+};
+static_assert(sizeof(trace_wr) == 24, "trace_wr should stay packed");
+
+// Appends records through an mmap'd window of the file. When the window
+// fills up, the file grows by one segment and the window moves on, so the
+// datapath never calls write(); the kernel flushes pages in the background.
+class rdma_trace_writer {
+ private:
+  int fd_ = -1;
+  char *map_ = nullptr;
+  size_t map_off_ = 0;  // File offset of the mapped segment
+  size_t pos_ = 0;      // Write position inside it
+  uint64_t start_ = 0;  // Cycles
+  double ns_per_cycle_ = 0;
+  uint64_t records_ = 0;
+
+  int MapSegment(size_t offset);
+
+ public:
+  ~rdma_trace_writer() { Close(); }
+  int Open(const std::string &path);
+  void Close();
+
+  // One WR of a post taken at ts (cycles)
+  int Record(uint64_t ts, uint32_t qp, const struct ibv_send_wr *wr,
+             uint32_t rbuf_idx, uint32_t roffset, bool last) {
+    size_t bytes = (sizeof(trace_wr) + wr->num_sge * 4 + 7) & ~7ULL;
+    if (pos_ + bytes > kTraceSegment && MapSegment(map_off_ + kTraceSegment))
+      return -1;
+    auto rec = reinterpret_cast<trace_wr *>(map_ + pos_);
+    rec->ts_ns = (ts - start_) * ns_per_cycle_;
+    rec->qp = qp;
+    rec->opcode = wr->opcode;
+    rec->num_sge = wr->num_sge;
+    rec->last = last;
+    rec->size8 = bytes / 8;
+    rec->rbuf_idx = rbuf_idx;
+    rec->roffset = roffset;
+    for (int j = 0; j < wr->num_sge; j++)
+      rec->Lengths()[j] = wr->sg_list[j].length;
+    pos_ += bytes;
+    records_++;
+    return 0;
+  }
+};
+
+// Maps a whole trace, prefaulted, so replay never waits for the disk
+class rdma_trace_reader {
+ private:
+  const char *map_ = nullptr;
+  size_t size_ = 0;
+  size_t pos_ = 0;
+  uint32_t max_length_ = 0;
+  uint64_t records_ = 0;
+
+ public:
+  ~rdma_trace_reader();
+  int Open(const std::string &path);
+
+  // nullptr at the end of the trace
+  const trace_wr *Next() {
+    while (pos_ + sizeof(trace_wr) <= size_) {
+      auto rec = reinterpret_cast<const trace_wr *>(map_ + pos_);
+      if (rec->size8) {
+        pos_ += rec->size8 * 8;
+        return rec;
+      }
+      // Zero fill: skip to the next segment
+      pos_ = (pos_ / kTraceSegment + 1) * kTraceSegment;
+    }
+    return nullptr;
+  }
+  void Rewind() { pos_ = sizeof(trace_file_header); }
+  uint32_t GetMaxLength() { return max_length_; }
+  uint64_t GetRecords() { return records_; }
+};
+
+}  // namespace Collie
+
+#endif
@@ -0,0 +1,607 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+#include "worker.hpp"
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include "context.hpp"
+
+namespace Collie {
+
+void rdma_worker::AddEndpoint(rdma_endpoint *ep, union collie_cq send_cq,
+                              union collie_cq recv_cq) {
+  endpoints_.push_back(ep);
+  // With --share_cq all endpoints of this worker complete on the same CQ
+  auto same = [](union collie_cq a, union collie_cq b) { return a.cq == b.cq; };
+  if (send_cqs_.empty() || !same(send_cqs_.back(), send_cq))
+    send_cqs_.push_back(send_cq);
+  if (recv_cqs_.empty() || !same(recv_cqs_.back(), recv_cq))
+    recv_cqs_.push_back(recv_cq);
+}
+
+void rdma_worker::Refresh() {
+  auto joined = joined_.load(std::memory_order_acquire);
+  if (joined == seen_) return;
+  seen_ = joined;
+  active_.clear();
+  for (auto ep : endpoints_) {
+    if (!ep) continue;                  // Ignore those dead ones
+    if (!ep->GetActivated()) continue;  // YOU ARE NOT PREPARED!
+    active_.push_back(ep);
+  }
+}
+
+inline int rdma_worker::ParseEachEx(struct ibv_cq_ex *cq_ex) {
+  if (cq_ex->status != IBV_WC_SUCCESS) {
+    LOG(ERROR) << "God bad completion status with " << cq_ex->status;
+    return -1;
+  }
+  auto opcode = cq_ex->read_opcode(cq_ex);
+  auto ep = reinterpret_cast<rdma_endpoint *>(cq_ex->wr_id);
+  switch (opcode) {
+    case IBV_WC_RDMA_WRITE:
+    case IBV_WC_RDMA_READ:
+    case IBV_WC_SEND:
+      // Client Handle CQE
+      ep->SendHandler(nullptr);
+      break;
+    case IBV_WC_RECV:
+    case IBV_WC_RECV_RDMA_WITH_IMM:
+      // Server Handle CQE
+      if (FLAGS_srq)
+        reinterpret_cast<rdma_srq *>(cq_ex->wr_id)->RecvHandler(nullptr);
+      else
+        ep->RecvHandler(nullptr);
+      break;
+    default:
+      LOG(ERROR) << "Unknown opcode " << opcode;
+      break;
+  }
+  // NIC time now, extrapolated from the clock the timer thread samples
+  auto nic_wall_ts = ibv_wc_read_completion_wallclock_ns(cq_ex);
+  auto cqe_wall_ts = Now64Ns() + master_->GetNicClockOffset();
+  nic_process_time_.Record(cqe_wall_ts - nic_wall_ts);
+  return 0;
+}
+
+int rdma_worker::PollEachEx(struct ibv_cq_ex *cq_ex) {
+  struct ibv_poll_cq_attr attr = {};
+  int ret = ENOENT, n = 0;
+  ret = ibv_start_poll(cq_ex, &attr);
+  if (ret == ENOENT) return 0;
+  if (ret && ret != ENOENT) {
+    LOG(ERROR) << "ibv_start_poll() failed with " << ret;
+    return -1;
+  }
+  // Then we parse the completion
+  if (ParseEachEx(cq_ex)) {
+    ibv_end_poll(cq_ex);
+    return -1;
+  }
+  n++;
+  while (true) {
+    ret = ibv_next_poll(cq_ex);
+    if (ret) break;
+    if ((ret = ParseEachEx(cq_ex))) break;
+    n++;
+  }
+  ibv_end_poll(cq_ex);
+  if (ret == ENOENT)
+    return n;
+  else
+    return -1;
+}
+
+int rdma_worker::PollEach(struct ibv_cq *cq) {
+  int n = 0, ret = 0;
+  struct ibv_wc wc[kCqPollDepth];
+  do {
+    n = ibv_poll_cq(cq, kCqPollDepth, wc);
+    if (n < 0) {
+      PLOG(ERROR) << "ibv_poll_cq() failed";
+      return -1;
+    }
+    for (int i = 0; i < n; i++) {
+      if (wc[i].status != IBV_WC_SUCCESS) {
+        LOG(ERROR) << "Got bad completion status with " << wc[i].status;
+        return -1;
+      }
+      auto ep = reinterpret_cast<rdma_endpoint *>(wc[i].wr_id);
+      switch (wc[i].opcode) {
+        case IBV_WC_RDMA_WRITE:
+        case IBV_WC_RDMA_READ:
+        case IBV_WC_SEND:
+          // Client Handle CQE
+          ep->SendHandler(&wc[i]);
+          break;
+        case IBV_WC_RECV:
+        case IBV_WC_RECV_RDMA_WITH_IMM:
+          // Server Handle CQE
+          if (FLAGS_srq)
+            reinterpret_cast<rdma_srq *>(wc[i].wr_id)->RecvHandler(&wc[i]);
+          else
+            ep->RecvHandler(&wc[i]);
+          break;
+        default:
+          LOG(ERROR) << "Unknown opcode " << wc[i].opcode;
+          return -1;
+      }
+    }
+    ret += n;
+  } while (n);
+  return ret;
+}
+
+void rdma_worker::Replenish(const std::vector<rdma_request> &requests,
+                            int batch_size) {
+  for (auto ep : active_) {
+    if (ep->GetRecvCredits() <= 0) continue;
+    auto credits = ep->GetRecvCredits();
+    while (credits > 0) {
+      auto toPostRecv = std::min(credits, batch_size);
+      if (ep->PostRecv(requests, toPostRecv)) {
+        LOG(ERROR) << "PostRecv() failed";
+        break;
+      }
+      credits -= toPostRecv;
+    }
+  }
+}
+
+int rdma_worker::RecvRound(int batch_size) {
+  Refresh();
+  // Replenesh Recv Buffer
+  Replenish(requests_, batch_size);
+  for (auto srq : srqs_) {
+    if (srq->Refill(requests_, batch_size, false)) {
+      LOG(ERROR) << "Refill SRQ failed";
+      break;
+    }
+  }
+  // Poll out the possible completion
+  auto polled = PollCqs(recv_cqs_);
+  if (polled < 0) return -1;
+  // With --latency or --mw_window, the pongs or grants posted by
+  // RecvHandler() complete here
+  if (FLAGS_latency || FLAGS_mw_window) {
+    auto sent = PollCqs(send_cqs_);
+    if (sent < 0) return -1;
+    polled += sent;
+  }
+  return polled;
+}
+
+int rdma_worker::SendRound(uint32_t batch_size) {
+  Refresh();
+  int posted = 0;
+  uint64_t now = (pacers_.empty() && !workload_) ? 0 : NowCycles();
+  if (now >= next_phase_ && next_phase_) NextPhases(now);
+  for (auto ep : active_) {
+    const std::vector<rdma_request> *requests = &requests_;
+    auto batch = batch_size;
+    auto group = ep->GetGroup();
+    if (group >= 0) {
+      auto &phases = workload_->GetGroups()[group].phases;
+      if (phase_[group] == phases.size()) continue;  // Done
+      auto &phase = phases[phase_[group]];
+      requests = &phase.requests;
+      batch = phase.batches[batch_pos_++ & (rdma_workload::kProgramLen - 1)];
+    }
+    if ((int)batch > ep->GetSendCredits()) continue;  // YOU DON'T HAVE MONEY!
+    auto pacer = ep->GetPacer();
+    if (pacer) {
+      if (!pacer->Due(now)) continue;  // NOT YET!
+      // Walking the batch for its bytes only pays once it is admitted
+      uint64_t cost = batch;
+      if (pacer->ByBytes()) cost = ep->NextBatchBytes(*requests, batch);
+      pacer->Consume(now, cost);
+    }
+    if (ep->PostSend(*requests, batch,
+                     master_->GetRemoteMempool(ep->GetMemId())) == 0)
+      posted += batch;
+  }
+  auto polled = PollCqs(send_cqs_);
+  if (polled < 0) return -1;
+  return posted + polled;
+}
+
+int rdma_worker::PollCqs(const std::vector<union collie_cq> &cqs) {
+  int polled = 0;
+  for (auto cq : cqs) {
+    int n = 0;
+    if (FLAGS_hw_ts) {
+      n = PollEachEx(cq.cq_ex);
+      if (n < 0) {
+        LOG(ERROR) << "PollEachEx() failed";
+        return -1;
+      }
+    } else {
+      n = PollEach(cq.cq);
+      if (n < 0) {
+        LOG(ERROR) << "PollEach() failed";
+        return -1;
+      }
+    }
+    polled += n;
+  }
+  return polled;
+}
+
+int rdma_worker::InitEvents() {
+  poll_mode_ = ParsePollMode(FLAGS_poll_mode);
+  if (poll_mode_ == kBusyPoll) return 0;
+  if (!channel_) {
+    LOG(ERROR) << "Worker " << id_ << " has no completion channel";
+    return -1;
+  }
+  // Events are drained until EAGAIN after every wakeup
+  int flags = fcntl(channel_->fd, F_GETFL);
+  if (fcntl(channel_->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    PLOG(ERROR) << "fcntl() failed";
+    return -1;
+  }
+  epfd_ = epoll_create1(0);
+  if (epfd_ < 0) {
+    PLOG(ERROR) << "epoll_create1() failed";
+    return -1;
+  }
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = channel_;
+  if (epoll_ctl(epfd_, EPOLL_CTL_ADD, channel_->fd, &ev)) {
+    PLOG(ERROR) << "epoll_ctl() failed";
+    return -1;
+  }
+  return 0;
+}
+
+int rdma_worker::InitPacers() {
+  if (FLAGS_rate_gbps <= 0 && FLAGS_rate_mrps <= 0) return 0;
+  for (auto ep : endpoints_) {
+    if (pacers_.empty() || !FLAGS_rate_per_thread) {
+      pacers_.emplace_back(new rdma_pacer());
+      if (pacers_.back()->Init(ep->GetId())) return -1;
+    }
+    ep->SetPacer(pacers_.back().get());
+  }
+  return 0;
+}
+
+int rdma_worker::InitRecorder() {
+  if (FLAGS_trace_record == "") return 0;
+  recorder_.reset(new rdma_trace_writer());
+  if (recorder_->Open(FLAGS_trace_record + "." + std::to_string(id_)))
+    return -1;
+  for (auto ep : endpoints_) ep->SetTrace(recorder_.get());
+  return 0;
+}
+
+int rdma_worker::InitDynamic() {
+  if (!FLAGS_dynamic_buf) return 0;
+  dyn_.reset(new rdma_dyn_memory());
+  // --dynamic_buf forces share_pd, so any endpoint id gives the PD
+  if (dyn_->Init(master_->GetPd(0), master_->GetBufSize())) return -1;
+  for (auto ep : endpoints_) ep->SetDynamic(dyn_.get());
+  return 0;
+}
+
+void rdma_worker::InitPrefetch() {
+  if (!FLAGS_prefetch_window || FLAGS_dynamic_buf) return;
+  prefetch_.reset(new rdma_prefetcher());
+  // --odp forces share_pd, so any endpoint id gives the PD
+  prefetch_->Start(master_->GetPd(0), master_->GetPageMap());
+  for (auto ep : endpoints_) ep->SetPrefetcher(prefetch_.get());
+}
+
+uint32_t rdma_worker::NextPost(const trace_wr **records) {
+  uint32_t n = 0;
+  while (n < (uint32_t)kMaxBatch) {
+    auto rec = trace_->Next();
+    if (!rec) break;
+    records[n++] = rec;
+    if (rec->last) break;
+  }
+  return n;
+}
+
+void rdma_worker::InitPhases() {
+  if (!workload_) return;
+  auto &groups = workload_->GetGroups();
+  auto now = NowCycles();
+  phase_.assign(groups.size(), 0);
+  phase_end_.assign(groups.size(), 0);
+  for (size_t g = 0; g < groups.size(); g++) {
+    auto us = groups[g].phases[0].duration_us;
+    if (us) phase_end_[g] = now + us * CyclesPerUs();
+  }
+  next_phase_ = 0;
+  for (auto end : phase_end_)
+    if (end && (!next_phase_ || end < next_phase_)) next_phase_ = end;
+}
+
+void rdma_worker::NextPhases(uint64_t now) {
+  auto &groups = workload_->GetGroups();
+  next_phase_ = 0;
+  for (size_t g = 0; g < groups.size(); g++) {
+    auto &phases = groups[g].phases;
+    if (phase_end_[g] && now >= phase_end_[g]) {
+      phase_end_[g] = 0;
+      if (phase_[g] + 1 < phases.size()) {
+        phase_[g]++;
+      } else if (workload_->GetRepeat()) {
+        phase_[g] = 0;
+      } else {
+        phase_[g] = phases.size();  // This group is done
+        continue;
+      }
+      auto us = phases[phase_[g]].duration_us;
+      if (us) phase_end_[g] = now + us * CyclesPerUs();
+      for (auto ep : endpoints_)
+        if (ep->GetGroup() == (int)g) ep->ResetSendRing();
+    }
+    if (phase_end_[g] && (!next_phase_ || phase_end_[g] < next_phase_))
+      next_phase_ = phase_end_[g];
+  }
+  // Done when every endpoint we own belongs to a finished group
+  finished_ = true;
+  for (auto ep : endpoints_) {
+    auto g = ep->GetGroup();
+    if (g < 0 || phase_[g] < groups[g].phases.size()) finished_ = false;
+  }
+}
+
+int rdma_worker::ArmCqs() {
+  for (auto cqs : {&send_cqs_, &recv_cqs_}) {
+    for (auto cq : *cqs) {
+      auto ibv_cq = FLAGS_hw_ts ? ibv_cq_ex_to_cq(cq.cq_ex) : cq.cq;
+      if (ibv_req_notify_cq(ibv_cq, 0)) {
+        PLOG(ERROR) << "ibv_req_notify_cq() failed";
+        return -1;
+      }
+    }
+  }
+  armed_ = true;
+  return 0;
+}
+
+int rdma_worker::WaitEvents() {
+  struct epoll_event ev;
+  // The timeout lets us notice endpoints that joined while we slept
+  int n = epoll_wait(epfd_, &ev, 1, kEventTimeoutMs);
+  if (n < 0 && errno != EINTR) {
+    PLOG(ERROR) << "epoll_wait() failed";
+    return -1;
+  }
+  armed_ = false;
+  idle_since_ = 0;
+  if (n <= 0) return 0;
+  wakeups_++;
+  struct ibv_cq *cq;
+  void *cq_context;
+  while (ibv_get_cq_event(channel_, &cq, &cq_context) == 0) {
+    // CQs are few, so ack one by one instead of counting per CQ
+    ibv_ack_cq_events(cq, 1);
+  }
+  if (errno != EAGAIN) {
+    PLOG(ERROR) << "ibv_get_cq_event() failed";
+    return -1;
+  }
+  return 0;
+}
+
+int rdma_worker::Idle(int progress) {
+  if (poll_mode_ == kBusyPoll) return 0;
+  if (progress) {
+    idle_since_ = 0;
+    armed_ = false;
+    return 0;
+  }
+  // Armed and polled once more without finding anything: safe to sleep
+  if (armed_) return WaitEvents();
+  auto now = Now64();
+  if (!idle_since_) idle_since_ = now;
+  if (poll_mode_ == kHybridPoll && now - idle_since_ < (uint64_t)FLAGS_spin_us)
+    return 0;
+  return ArmCqs();
+}
+
+void rdma_worker::PrintCpuUsage(uint64_t timestamp) {
+  // Called every round: the thread CPU clock is a syscall on some kernels,
+  // so read it only when a report (every 1s) is due
+  if (timestamp_ && timestamp - timestamp_ < 1000000) return;
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  uint64_t cpu_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  if (timestamp_ == 0) {
+    timestamp_ = timestamp;
+    cpu_ns_last_ = cpu_ns;
+    return;
+  }
+  auto t = timestamp - timestamp_;
+  auto usage = (cpu_ns - cpu_ns_last_) / 10.0 / t;  // percent
+  LOG(INFO) << "thread " << id_ << " poll mode " << FLAGS_poll_mode
+            << " CPU=" << usage << "% wakeups=" << wakeups_;
+  if (dyn_) dyn_->PrintStats(id_);
+  timestamp_ = timestamp;
+  cpu_ns_last_ = cpu_ns;
+  wakeups_ = 0;
+}
+
+int rdma_worker::ClientDatapath() {
+  uint32_t batch_size = FLAGS_send_batch;
+  int iterations_left = FLAGS_iters;
+  bool run_infinitely = FLAGS_run_infinitely;
+  bool print_thp = master_->GetPrintThp();
+  if (InitEvents()) exit(1);
+  if (InitPacers()) exit(1);
+  if (InitRecorder()) exit(1);
+  if (InitDynamic()) exit(1);
+  InitPrefetch();
+  InitPhases();
+  while (true) {
+    if (!run_infinitely && iterations_left <= 0) break;
+    if (finished_) break;
+    auto progress = SendRound(batch_size);
+    if (progress < 0) exit(1);
+    // Paced rounds are mostly empty, only those with work count
+    if (pacers_.empty() || progress) iterations_left--;
+    if (Idle(progress)) exit(1);
+    if (print_thp) {
+      auto ts = Now64();
+      for (auto ep : active_) ep->PrintThroughput(ts);
+      PrintCpuUsage(ts);
+    }
+  }
+  if (recorder_) recorder_->Close();
+  if (dyn_) dyn_->PrintStats(id_);
+  if (prefetch_) {
+    prefetch_->Stop();
+    prefetch_->PrintStats(id_);
+  }
+  return 0;
+}
+
+int rdma_worker::ReplayDatapath() {
+  bool run_infinitely = FLAGS_run_infinitely;
+  bool print_thp = master_->GetPrintThp();
+  auto cycles_per_ns = CyclesPerUs() / 1000.0;
+  // Our endpoint ids are contiguous, so a record maps to one by offset
+  auto first_id = endpoints_[0]->GetId();
+  const trace_wr *records[kMaxBatch];
+  uint32_t n = 0;  // Records of the pending post
+  uint64_t start = NowCycles();
+  while (true) {
+    Refresh();
+    if (!n && !(n = NextPost(records))) {
+      if (!run_infinitely) break;
+      trace_->Rewind();
+      start = NowCycles();
+      continue;
+    }
+    auto idx = records[0]->qp - first_id;
+    if (records[0]->qp < first_id || idx >= endpoints_.size()) {
+      LOG(ERROR) << "Thread " << id_ << " does not own endpoint "
+                 << records[0]->qp
+                 << ". Replay with the QPs and --threads of the recording";
+      exit(1);
+    }
+    auto ep = endpoints_[idx];
+    auto due = FLAGS_trace_asap ||
+               NowCycles() - start >= records[0]->ts_ns * cycles_per_ns;
+    // Wait for the endpoint, its credits and, unless ASAP, the recorded time
+    if (due && ep->GetActivated() && n <= (uint32_t)ep->GetSendCredits()) {
+      if (ep->PostReplay(records, n, master_->GetRemoteMempool(ep->GetMemId())))
+        exit(1);
+      n = 0;
+    }
+    if (PollCqs(send_cqs_) < 0) exit(1);
+    if (print_thp) {
+      auto ts = Now64();
+      for (auto ep : active_) ep->PrintThroughput(ts);
+      PrintCpuUsage(ts);
+    }
+  }
+  return 0;
+}
+
+int rdma_worker::LatencyDatapath() {
+  uint64_t iterations = FLAGS_iters;
+  bool run_infinitely = FLAGS_run_infinitely;
+  bool print_thp = master_->GetPrintThp();
+  if (InitEvents()) exit(1);
+  while (true) {
+    Refresh();
+    Replenish(recv_requests_, FLAGS_recv_batch);
+    int progress = 0;
+    size_t finished = 0;
+    for (auto ep : active_) {
+      if (ep->GetPingInFlight()) continue;
+      if (!run_infinitely && ep->GetPings() >= iterations) {
+        finished++;
+        continue;
+      }
+      if (ep->PostPing(requests_, master_->GetRemoteMempool(ep->GetMemId())))
+        exit(1);
+      progress++;
+    }
+    if (!active_.empty() && finished == active_.size()) break;
+    auto sent = PollCqs(send_cqs_);
+    auto received = PollCqs(recv_cqs_);
+    if (sent < 0 || received < 0) exit(1);
+    progress += sent + received;
+    if (Idle(progress)) exit(1);
+    if (print_thp) {
+      auto ts = Now64();
+      for (auto ep : active_) ep->PrintThroughput(ts);
+      PrintCpuUsage(ts);
+    }
+  }
+  return 0;
+}
+
+int rdma_worker::WindowDatapath() {
+  uint64_t iterations = FLAGS_iters;
+  bool run_infinitely = FLAGS_run_infinitely;
+  bool print_thp = master_->GetPrintThp();
+  for (auto &req : requests_) {
+    if (req.opcode != IBV_WR_RDMA_WRITE && req.opcode != IBV_WR_RDMA_READ) {
+      LOG(ERROR) << "Memory windows are for WRITE and READ requests";
+      exit(1);
+    }
+  }
+  if (InitEvents()) exit(1);
+  while (true) {
+    Refresh();
+    Replenish(recv_requests_, FLAGS_recv_batch);
+    int progress = 0;
+    size_t finished = 0;
+    for (auto ep : active_) {
+      if (!run_infinitely && ep->GetMsgs() >= iterations) {
+        finished++;
+        continue;
+      }
+      auto posted = ep->PostWindow(requests_, FLAGS_send_batch,
+                                   master_->GetRemoteMempool(ep->GetMemId()));
+      if (posted < 0) exit(1);
+      progress += posted;
+    }
+    if (!active_.empty() && finished == active_.size()) break;
+    auto sent = PollCqs(send_cqs_);
+    auto received = PollCqs(recv_cqs_);
+    if (sent < 0 || received < 0) exit(1);
+    progress += sent + received;
+    if (Idle(progress)) exit(1);
+    if (print_thp) {
+      auto ts = Now64();
+      for (auto ep : active_) ep->PrintThroughput(ts);
+      PrintCpuUsage(ts);
+    }
+  }
+  return 0;
+}
+
+int rdma_worker::ServerDatapath() {
+  int batch_size = FLAGS_recv_batch;
+  bool print_thp = master_->GetPrintThp();
+  if (InitEvents()) exit(0);
+  while (true) {
+    auto progress = RecvRound(batch_size);
+    if (progress < 0) exit(0);
+    if (Idle(progress)) exit(0);
+    if (print_thp) PrintCpuUsage(Now64());
+  }
+  // Never reach here
+  return 0;
+}
+
+}  // namespace Collie
@@ -0,0 +1,151 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+#ifndef RDMA_WORKER_HPP
+#define RDMA_WORKER_HPP
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "endpoint.hpp"
+#include "helper.hpp"
+#include "histogram.hpp"
+#include "memory.hpp"
+#include "pacer.hpp"
+#include "regcache.hpp"
+#include "srq.hpp"
+#include "trace.hpp"
+#include "workload.hpp"
+
+namespace Collie {
+
+class rdma_context;
+
+union collie_cq {
+  struct ibv_cq *cq;
+  struct ibv_cq_ex *cq_ex;
+};
+
+// A worker is one datapath thread. It owns a contiguous range of endpoints,
+// the CQs these endpoints complete on and their statistics, so nothing is
+// shared with other workers on the hot path.
+class rdma_worker {
+ private:
+  int id_ = 0;
+  rdma_context *master_ = nullptr;
+  std::vector<rdma_endpoint *> endpoints_;
+  // The activated subset of endpoints_, rebuilt when joined_ moves
+  std::vector<rdma_endpoint *> active_;
+  std::atomic<uint32_t> joined_{0};
+  uint32_t seen_ = 0;
+  std::vector<union collie_cq> send_cqs_;
+  std::vector<union collie_cq> recv_cqs_;
+  std::vector<rdma_srq *> srqs_;
+  std::vector<rdma_request> requests_;
+  // Client side of --latency only, for the pongs
+  std::vector<rdma_request> recv_requests_;
+
+  // For hardware timestamp, snapshotted by the context's clock thread
+  collie_histogram nic_process_time_;
+
+  // Open-loop pacers: one per endpoint, or one shared with
+  // --rate_per_thread. Empty when closed loop.
+  std::vector<std::unique_ptr<rdma_pacer>> pacers_;
+
+  // --workload program: the current phase of each group and when it ends
+  // (in cycles, 0 for never). finished_ once every phase has run.
+  const rdma_workload *workload_ = nullptr;
+  std::vector<size_t> phase_;
+  std::vector<uint64_t> phase_end_;
+  uint64_t next_phase_ = 0;
+  uint32_t batch_pos_ = 0;
+  bool finished_ = false;
+
+  // --trace_record writes our posts here; --trace_replay reads them back
+  std::unique_ptr<rdma_trace_writer> recorder_;
+  rdma_trace_reader *trace_ = nullptr;
+  // --dynamic_buf pool and registration cache of our endpoints
+  std::unique_ptr<rdma_dyn_memory> dyn_;
+  // --prefetch_window helper thread for our endpoints
+  std::unique_ptr<rdma_prefetcher> prefetch_;
+
+  // Sleeping on completion events, see --poll_mode
+  int poll_mode_ = kBusyPoll;
+  struct ibv_comp_channel *channel_ = nullptr;
+  int epfd_ = -1;
+  bool armed_ = false;
+  uint64_t idle_since_ = 0;
+
+  // For statistics
+  uint64_t wakeups_ = 0;
+  uint64_t cpu_ns_last_ = 0;
+  uint64_t timestamp_ = 0;
+
+  int PollEach(struct ibv_cq *cq);
+  int PollEachEx(struct ibv_cq_ex *cq_ex);
+  int ParseEachEx(struct ibv_cq_ex *cq_ex);
+  int PollCqs(const std::vector<union collie_cq> &cqs);
+  void Refresh();
+  // Gives every active endpoint's receive credits back to its QP
+  void Replenish(const std::vector<rdma_request> &requests, int batch_size);
+
+  int InitEvents();
+  int InitPacers();
+  int InitRecorder();
+  int InitDynamic();
+  void InitPrefetch();
+  // Gathers the records of the next recorded post, 0 at the end
+  uint32_t NextPost(const trace_wr **records);
+  void InitPhases();
+  // Moves groups whose phase ended on to their next phase
+  void NextPhases(uint64_t now);
+  // Called after each round with the work it did. Spins, arms the CQs or
+  // sleeps on the channel depending on the poll mode and the idle time.
+  int Idle(int progress);
+  int ArmCqs();
+  int WaitEvents();
+  void PrintCpuUsage(uint64_t timestamp);
+
+ public:
+  rdma_worker(int id, rdma_context *master) : id_(id), master_(master) {}
+
+  // Called before the datapath starts
+  void AddEndpoint(rdma_endpoint *ep, union collie_cq send_cq,
+                   union collie_cq recv_cq);
+  void AddSrq(rdma_srq *srq) { srqs_.push_back(srq); }
+  void SetChannel(struct ibv_comp_channel *channel) { channel_ = channel; }
+  void SetRequests(const std::vector<rdma_request> &requests) {
+    requests_ = requests;
+  }
+  void SetRecvRequests(const std::vector<rdma_request> &requests) {
+    recv_requests_ = requests;
+  }
+  void SetWorkload(const rdma_workload *workload) { workload_ = workload; }
+  void SetTrace(rdma_trace_reader *trace) { trace_ = trace; }
+
+  // Called by the connection handler after one of our endpoints has been
+  // activated. Lock-free: the worker picks it up on its next round.
+  void Join() { joined_.fetch_add(1, std::memory_order_release); }
+
+  // One pass of post and poll over the endpoints this worker owns. Returns
+  // the number of WRs posted plus completions polled, or -1 on failure.
+  int SendRound(uint32_t batch_size);
+  int RecvRound(int batch_size);
+
+  int ClientDatapath();
+  int LatencyDatapath();
+  int WindowDatapath();
+  int ReplayDatapath();
+  int ServerDatapath();
+
+  int GetId() { return id_; }
+  size_t GetEndpointNum() { return endpoints_.size(); }
+  const collie_histogram &GetNicProcessTime() { return nic_process_time_; }
+};
+}  // namespace Collie
+
+#endif
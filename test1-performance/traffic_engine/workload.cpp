@@ -0,0 +1,264 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+#include "workload.hpp"
+
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <random>
+#include <sstream>
+
+namespace Collie {
+
+namespace {
+
+// Just enough JSON for workload files: objects, arrays, numbers, strings
+// (without escapes beyond \" and \\), true/false/null.
+struct json_value {
+  enum { kNull, kBool, kNumber, kString, kArray, kObject } type = kNull;
+  bool boolean = false;
+  double number = 0;
+  std::string str;
+  std::vector<json_value> array;
+  std::map<std::string, json_value> object;
+
+  const json_value *Get(const std::string &key) const {
+    if (type != kObject) return nullptr;
+    auto it = object.find(key);
+    return it == object.end() ? nullptr : &it->second;
+  }
+};
+
+class json_parser {
+ public:
+  explicit json_parser(const std::string &text) : text_(text) {}
+  bool Parse(json_value *value) {
+    if (!ParseValue(value)) return false;
+    SkipSpace();
+    return pos_ == text_.size();
+  }
+  size_t GetPos() { return pos_; }
+
+ private:
+  const std::string &text_;
+  size_t pos_ = 0;
+
+  void SkipSpace() {
+    while (pos_ < text_.size() && isspace(text_[pos_])) pos_++;
+  }
+  bool Consume(char c) {
+    SkipSpace();
+    if (pos_ >= text_.size() || text_[pos_] != c) return false;
+    pos_++;
+    return true;
+  }
+  bool ParseString(std::string *str) {
+    if (!Consume('"')) return false;
+    str->clear();
+    while (pos_ < text_.size() && text_[pos_] != '"') {
+      if (text_[pos_] == '\\' && pos_ + 1 < text_.size()) pos_++;
+      str->push_back(text_[pos_++]);
+    }
+    return Consume('"');
+  }
+  bool ParseValue(json_value *value) {
+    SkipSpace();
+    if (pos_ >= text_.size()) return false;
+    char c = text_[pos_];
+    if (c == '{') {
+      pos_++;
+      value->type = json_value::kObject;
+      if (Consume('}')) return true;
+      do {
+        std::string key;
+        if (!ParseString(&key) || !Consume(':')) return false;
+        if (!ParseValue(&value->object[key])) return false;
+      } while (Consume(','));
+      return Consume('}');
+    }
+    if (c == '[') {
+      pos_++;
+      value->type = json_value::kArray;
+      if (Consume(']')) return true;
+      do {
+        value->array.emplace_back();
+        if (!ParseValue(&value->array.back())) return false;
+      } while (Consume(','));
+      return Consume(']');
+    }
+    if (c == '"') {
+      value->type = json_value::kString;
+      return ParseString(&value->str);
+    }
+    for (auto word : {"true", "false", "null"}) {
+      if (text_.compare(pos_, strlen(word), word) == 0) {
+        pos_ += strlen(word);
+        value->type = (word[0] == 'n') ? json_value::kNull : json_value::kBool;
+        value->boolean = (word[0] == 't');
+        return true;
+      }
+    }
+    char *end = nullptr;
+    value->type = json_value::kNumber;
+    value->number = strtod(text_.c_str() + pos_, &end);
+    if (end == text_.c_str() + pos_) return false;
+    pos_ = end - text_.c_str();
+    return true;
+  }
+};
+
+double GetNumber(const json_value &object, const std::string &key,
+                 double fallback) {
+  auto value = object.Get(key);
+  if (!value || value->type != json_value::kNumber) return fallback;
+  return value->number;
+}
+
+// Draws kProgramLen indexes with the given weights
+int Presample(const std::vector<double> &weights, std::mt19937_64 *rng,
+              std::vector<uint32_t> *draws) {
+  if (weights.empty()) return -1;
+  for (auto w : weights)
+    if (w < 0) return -1;
+  std::discrete_distribution<uint32_t> dist(weights.begin(), weights.end());
+  draws->resize(rdma_workload::kProgramLen);
+  for (auto &d : *draws) d = dist(*rng);
+  return 0;
+}
+
+}  // namespace
+
+int rdma_workload::Load(const std::string &path, const request_parser &parse) {
+  std::ifstream file(path);
+  if (!file) {
+    PLOG(ERROR) << "Cannot open workload file " << path;
+    return -1;
+  }
+  std::stringstream text;
+  text << file.rdbuf();
+  auto content = text.str();
+  json_value root;
+  json_parser parser(content);
+  if (!parser.Parse(&root) || root.type != json_value::kObject) {
+    LOG(ERROR) << "Bad JSON in " << path << " around byte "
+               << parser.GetPos();
+    return -1;
+  }
+  std::mt19937_64 rng((uint64_t)GetNumber(root, "seed", 1));
+  auto repeat = root.Get("repeat");
+  repeat_ = repeat && repeat->boolean;
+  auto receive = root.Get("receive");
+  if (receive && receive->type == json_value::kString) receive_ = receive->str;
+
+  groups_.clear();
+  auto groups = root.Get("groups");
+  if (!groups || groups->type != json_value::kArray) {
+    LOG(ERROR) << "The workload needs a \"groups\" array";
+    return -1;
+  }
+  for (auto &g : groups->array) {
+    rdma_group group;
+    auto qps = g.Get("qps");
+    if (!qps || qps->type != json_value::kArray || qps->array.size() != 2) {
+      LOG(ERROR) << "Each group needs \"qps\": [first, last]";
+      return -1;
+    }
+    group.first_qp = qps->array[0].number;
+    group.last_qp = qps->array[1].number;
+    auto phases = g.Get("phases");
+    if (!phases || phases->type != json_value::kArray ||
+        phases->array.empty()) {
+      LOG(ERROR) << "Each group needs a non-empty \"phases\" array";
+      return -1;
+    }
+    for (auto &p : phases->array) {
+      rdma_phase phase;
+      phase.duration_us = GetNumber(p, "duration_ms", 0) * 1000;
+      auto sequence = p.Get("sequence");
+      auto mix = p.Get("mix");
+      if (sequence && sequence->type == json_value::kString) {
+        phase.requests = parse(sequence->str);
+      } else if (mix && mix->type == json_value::kArray) {
+        std::vector<std::vector<rdma_request>> choices;
+        std::vector<double> weights;
+        for (auto &m : mix->array) {
+          auto request = m.Get("request");
+          if (!request || request->type != json_value::kString) {
+            LOG(ERROR) << "Each mix entry needs a \"request\" string";
+            return -1;
+          }
+          choices.push_back(parse(request->str));
+          if (choices.back().empty()) {
+            LOG(ERROR) << "Empty request " << request->str;
+            return -1;
+          }
+          weights.push_back(GetNumber(m, "weight", 1));
+        }
+        std::vector<uint32_t> draws;
+        if (Presample(weights, &rng, &draws)) {
+          LOG(ERROR) << "Bad mix weights";
+          return -1;
+        }
+        for (auto d : draws)
+          phase.requests.insert(phase.requests.end(), choices[d].begin(),
+                                choices[d].end());
+      }
+      if (phase.requests.empty()) {
+        LOG(ERROR) << "Each phase needs a \"sequence\" or a \"mix\"";
+        return -1;
+      }
+      // Batch sizes: a number, or weighted values
+      std::vector<double> values{(double)FLAGS_send_batch}, weights{1};
+      auto batch = p.Get("batch");
+      if (batch && batch->type == json_value::kNumber) {
+        values = {batch->number};
+      } else if (batch && batch->type == json_value::kObject) {
+        auto v = batch->Get("values");
+        auto w = batch->Get("weights");
+        values.clear();
+        weights.clear();
+        if (v && v->type == json_value::kArray)
+          for (auto &x : v->array) values.push_back(x.number);
+        if (w && w->type == json_value::kArray)
+          for (auto &x : w->array) weights.push_back(x.number);
+        if (weights.empty()) weights.assign(values.size(), 1);
+      }
+      if (values.size() != weights.size()) {
+        LOG(ERROR) << "Batch values and weights differ in length";
+        return -1;
+      }
+      for (auto v : values) {
+        if (v < 1 || v > kMaxBatch) {
+          LOG(ERROR) << "Batch sizes should be in [1, " << kMaxBatch << "]";
+          return -1;
+        }
+      }
+      std::vector<uint32_t> draws;
+      if (Presample(weights, &rng, &draws)) {
+        LOG(ERROR) << "Bad batch weights";
+        return -1;
+      }
+      for (auto d : draws) phase.batches.push_back(values[d]);
+      group.phases.push_back(std::move(phase));
+    }
+    groups_.push_back(std::move(group));
+  }
+  LOG(INFO) << "Loaded workload " << path << " with " << groups_.size()
+            << " groups";
+  return 0;
+}
+
+int rdma_workload::GroupOf(uint32_t id) const {
+  for (size_t i = 0; i < groups_.size(); i++) {
+    if (id >= groups_[i].first_qp && id <= groups_[i].last_qp) return i;
+  }
+  return -1;
+}
+
+}  // namespace Collie
@@ -0,0 +1,78 @@
+// MIT License
+
+// Copyright (c) 2021 ByteDance Inc. All rights reserved.
+// Copyright (c) 2021 Duke University.  All rights reserved.
+
+// See LICENSE for license information
+
+#ifndef RDMA_WORKLOAD_HPP
+#define RDMA_WORKLOAD_HPP
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "endpoint.hpp"
+#include "helper.hpp"
+
+namespace Collie {
+
+// A workload file (--workload) describes the client traffic in JSON:
+//
+// {
+//   "seed": 1,                      // optional, for the weighted draws
+//   "repeat": false,                // restart after the last phase?
+//   "receive": "1_65536",           // optional, overrides --receive
+//   "groups": [{
+//     "qps": [0, 7],                // endpoint ids, inclusive
+//     "phases": [{
+//       "duration_ms": 1000,        // 0 or absent: until --iters is done
+//       "sequence": "w_1_4096,r_1_512",  // cyclic, same as --request, or
+//       "mix": [{"weight": 3, "request": "w_1_4096"},
+//               {"weight": 1, "request": "s_2_64_64"}],
+//       "batch": {"values": [1, 16], "weights": [9, 1]}  // or a number
+//     }]
+//   }]
+// }
+//
+// Endpoints outside every group keep using --request and --send_batch.
+// Load() reads the file once and compiles it into a program: each phase
+// becomes a request vector the send ring walks cyclically, with weighted
+// mixes presampled into kProgramLen draws, and a ring of presampled batch
+// sizes, so the datapath never draws a random number.
+struct rdma_phase {
+  uint64_t duration_us = 0;
+  std::vector<rdma_request> requests;
+  std::vector<uint32_t> batches;  // kProgramLen entries
+};
+
+struct rdma_group {
+  uint32_t first_qp = 0;
+  uint32_t last_qp = 0;
+  std::vector<rdma_phase> phases;
+};
+
+class rdma_workload {
+ public:
+  static constexpr uint32_t kProgramLen = 256;  // A power of 2
+
+  // parse turns a --request style string into requests
+  using request_parser =
+      std::function<std::vector<rdma_request>(const std::string &)>;
+  int Load(const std::string &path, const request_parser &parse);
+
+  bool GetRepeat() const { return repeat_; }
+  const std::string &GetReceive() const { return receive_; }
+  const std::vector<rdma_group> &GetGroups() const { return groups_; }
+  // -1 for endpoints that no group covers
+  int GroupOf(uint32_t id) const;
+
+ private:
+  bool repeat_ = false;
+  std::string receive_;
+  std::vector<rdma_group> groups_;
+};
+
+}  // namespace Collie
+
+#endif